@@ -53,11 +53,21 @@ template <int max_capacity>
 using tree_allocator_type = test::heap_allocator<tree_node_type<max_capacity>>;
 #endif //#ifdef SIBENCH_RTREE_LOAD_CUSTOM
 
+#if defined(SIBENCH_RTREE_SPLIT_RSTAR)
+using tree_split_policy = spatial::rtree::rstar;
+#elif defined(SIBENCH_RTREE_SPLIT_LINEAR)
+using tree_split_policy = spatial::rtree::linear;
+#elif defined(SIBENCH_RTREE_SPLIT_ANG_TAN)
+using tree_split_policy = spatial::rtree::ang_tan;
+#else
+using tree_split_policy = spatial::rtree::quadratic;
+#endif
+
 template <int min_capacity, int max_capacity>
 using rtree_t =
     spatial::RTree<sibench::coord_t, sibench::id_type, 2, max_capacity,
                    min_capacity, ArrayIndexable, kVolumeMode, sibench::coord_t,
-                   tree_allocator_type<max_capacity>>;
+                   tree_allocator_type<max_capacity>, tree_split_policy>;
 #endif // #ifdef SIBENCH_RTREE_SPLIT_QUADTREE
 
 template <typename T>
@@ -104,6 +114,15 @@ sibench::result_info benchmark_load(const sibench::boxes2d_t &boxes,
         tree.insert(boxes.cbegin(), boxes.cbegin() + iterations);
       });
 
+  res.accumulate(marks);
+#elif defined(SIBENCH_RTREE_LOAD_BLK)
+  auto const marks = sibench::benchmark(
+      "load", iterations, vboxes,
+      [&tree](box_values_t const &boxes, std::size_t iterations) {
+        assert(iterations <= boxes.size());
+        tree.bulk_load(boxes.cbegin(), boxes.cbegin() + iterations);
+      });
+
   res.accumulate(marks);
 #else
 #error Unknown tree loading method
@@ -238,7 +257,9 @@ void benchmark_run(const sibench::boxes2d_t &boxes,
   qtree_t<max_capacity * quadtree_factor> tree(world_box.min, world_box.max,
                                                indexable);
 
-#elif SIBENCH_RTREE_SPLIT_QUADRATIC || SIBENCH_RTREE_SPLIT_QUADRATIC_SPHERE
+#elif SIBENCH_RTREE_SPLIT_QUADRATIC || SIBENCH_RTREE_SPLIT_QUADRATIC_SPHERE ||  \
+    SIBENCH_RTREE_SPLIT_RSTAR || SIBENCH_RTREE_SPLIT_LINEAR ||                 \
+    SIBENCH_RTREE_SPLIT_ANG_TAN
 
 #if SIBENCH_RTREE_LOAD_CUSTOM
   typedef rtree_t<min_capacity, max_capacity> tree_t;
@@ -269,8 +290,8 @@ int main() {
 #ifdef SIBENCH_THST_RTREE_PARAMS_CT
     // Generate random objects for indexing
     auto const boxes = sibench::generate_boxes(sibench::max_insertions);
-    spatial::BoundingBox<sibench::coord_t, 2> world_box;
-    world_box.init();
+    spatial::BoundingBox<sibench::coord_t, 2> world_box(
+        (spatial::box::empty_init()));
     for (const auto &box : boxes) {
       world_box.extend(box.min);
       world_box.extend(box.max);
@@ -0,0 +1,138 @@
+#include "spatial_index_benchmark.hpp"
+
+#include <ConcurrentRTree.h>
+
+#include <mutex>
+#include <thread>
+
+// Scaling of the concurrent rtree from one to several threads, compared to a
+// rtree guarded by a single mutex: inserts only, then half of the threads
+// inserting while the others query.
+
+namespace {
+
+std::string const lib("thst");
+
+struct ArrayIndexable {
+
+  ArrayIndexable(const sibench::boxes2d_t &array) : array(&array) {}
+
+  const sibench::coord_t *min(const uint32_t index) const {
+    return (*array)[index].min;
+  }
+  const sibench::coord_t *max(const uint32_t index) const {
+    return (*array)[index].max;
+  }
+
+private:
+  const sibench::boxes2d_t *array;
+};
+
+std::size_t const max_capacity = 16;
+std::size_t const min_capacity = 6;
+
+typedef spatial::ConcurrentRTree<sibench::coord_t, sibench::id_type, 2,
+                                 max_capacity, min_capacity, ArrayIndexable>
+    concurrent_rtree_t;
+typedef spatial::RTree<sibench::coord_t, sibench::id_type, 2, max_capacity,
+                       min_capacity, ArrayIndexable>
+    rtree_t;
+
+// Rtree with a single lock, the baseline.
+struct LockedRTree {
+  explicit LockedRTree(const ArrayIndexable &indexable) : tree(indexable) {}
+
+  void insert(sibench::id_type value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tree.insert(value);
+  }
+
+  template <typename Predicate, typename OutIter>
+  size_t query(const Predicate &predicate, OutIter out_it) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return tree.query(predicate, out_it);
+  }
+
+  std::mutex mutex;
+  rtree_t tree;
+};
+
+// Runs the given number of threads, the first inserters ones insert their
+// share of the boxes and the others query until the inserts are done.
+template <class TreeClass>
+double benchmark_threads(const sibench::boxes2d_t &boxes, unsigned threads,
+                         unsigned inserters) {
+  ArrayIndexable indexable(boxes);
+  TreeClass tree(indexable);
+  std::atomic<unsigned> running(inserters);
+
+  auto const marks = sibench::benchmark(
+      "concurrent", boxes.size(), boxes,
+      [&](sibench::boxes2d_t const &boxes, std::size_t iterations) {
+        std::vector<std::thread> pool;
+        for (unsigned thread = 0; thread < threads; ++thread) {
+          pool.emplace_back([&, thread]() {
+            if (thread < inserters) {
+              for (std::size_t i = thread; i < iterations; i += inserters)
+                tree.insert(static_cast<sibench::id_type>(i));
+              --running;
+              return;
+            }
+
+            std::vector<sibench::id_type> results;
+            for (std::size_t i = thread; running; i = (i + 1) % boxes.size()) {
+              results.clear();
+              auto const &box = boxes[i];
+              sibench::coord_t min[2] = {box.min[0] - sibench::query_size,
+                                         box.min[1] - sibench::query_size};
+              sibench::coord_t max[2] = {box.max[0] + sibench::query_size,
+                                         box.max[1] + sibench::query_size};
+              tree.query(spatial::intersects<2>(min, max),
+                         std::back_inserter(results));
+            }
+          });
+        }
+        for (auto &thread : pool)
+          thread.join();
+      });
+  return marks.min;
+}
+} // unnamed namespace
+
+int main() {
+  try {
+    auto const boxes = sibench::generate_boxes(sibench::max_insertions);
+    unsigned const max_threads =
+        std::max(std::thread::hardware_concurrency(), 1u) * 2;
+
+    std::streamsize const wn(8), wf(14);
+    std::cout << lib << " concurrent insert and query" << std::endl;
+    std::cout << std::left << std::setfill(' ') << std::setw(wn) << "threads"
+              << std::setw(wf) << "insert" << std::setw(wf) << "locked_insert"
+              << std::setw(wf) << "mixed" << std::setw(wf) << "locked_mixed"
+              << std::endl;
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+      // the mixed runs insert with half of the threads, at least one
+      unsigned const inserters = std::max(threads / 2, 1u);
+      std::cout << std::fixed << std::setprecision(6) << std::setw(wn)
+                << threads << std::setw(wf)
+                << benchmark_threads<concurrent_rtree_t>(boxes, threads,
+                                                         threads)
+                << std::setw(wf)
+                << benchmark_threads<LockedRTree>(boxes, threads, threads)
+                << std::setw(wf)
+                << benchmark_threads<concurrent_rtree_t>(boxes, threads,
+                                                         inserters)
+                << std::setw(wf)
+                << benchmark_threads<LockedRTree>(boxes, threads, inserters)
+                << std::endl;
+    }
+    return EXIT_SUCCESS;
+  } catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+  } catch (...) {
+    std::cerr << "unknown error" << std::endl;
+  }
+  return EXIT_FAILURE;
+}
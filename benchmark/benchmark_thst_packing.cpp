@@ -0,0 +1,197 @@
+#include "../test/custom_allocator.h"
+#include "spatial_index_benchmark.hpp"
+
+#include <RTree.h>
+
+// Compares the rtree loading methods: iterative insertion and the
+// Sort-Tile-Recursive and Hilbert packing algorithms, for both uniform and
+// clustered data.
+
+namespace {
+
+std::string const lib("thst");
+
+struct ArrayIndexable {
+
+  ArrayIndexable(const sibench::boxes2d_t &array) : array(array) {}
+
+  const sibench::coord_t *min(const uint32_t index) const {
+    return array[index].min;
+  }
+  const sibench::coord_t *max(const uint32_t index) const {
+    return array[index].max;
+  }
+
+private:
+  const sibench::boxes2d_t &array;
+};
+
+using tree_bbox_type = spatial::BoundingBox<sibench::coord_t, 2>;
+template <int max_capacity>
+using tree_node_type =
+    spatial::detail::Node<sibench::id_type, tree_bbox_type, max_capacity>;
+template <int max_capacity>
+using tree_allocator_type = test::heap_allocator<tree_node_type<max_capacity>>;
+
+template <int min_capacity, int max_capacity>
+using rtree_t =
+    spatial::RTree<sibench::coord_t, sibench::id_type, 2, max_capacity,
+                   min_capacity, ArrayIndexable, spatial::box::eNormalVolume,
+                   sibench::coord_t, tree_allocator_type<max_capacity>>;
+
+enum load_method { eIterative = 0, eSortTileRecursive, eHilbert, eLoadCount };
+const char *const kLoadNames[eLoadCount] = {"itr", "str", "hilbert"};
+
+// Generates boxes around a few dense clusters, similar to map tiles.
+sibench::boxes2d_t generate_clustered_boxes(std::size_t n) {
+  std::mt19937 gen(1);
+  const float world = static_cast<float>(n / 2);
+  std::uniform_real_distribution<float> center_dis(-world, world);
+  std::normal_distribution<float> offset_dis(0.0f, world * 0.01f);
+
+  const std::size_t cluster_count = 64;
+  std::vector<std::pair<float, float>> clusters;
+  for (std::size_t i = 0; i < cluster_count; ++i)
+    clusters.emplace_back(center_dis(gen), center_dis(gen));
+
+  sibench::boxes2d_t boxes;
+  boxes.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    const auto &cluster = clusters[i % cluster_count];
+    auto const x = cluster.first + offset_dis(gen);
+    auto const y = cluster.second + offset_dis(gen);
+    boxes.emplace_back();
+    auto &box = boxes.back();
+    float const size = 0.5f;
+    box.min[0] = x - size;
+    box.min[1] = y - size;
+    box.max[0] = x + size;
+    box.max[1] = y + size;
+  }
+  return boxes;
+}
+
+template <class TreeClass>
+void benchmark_load(const sibench::boxes2d_t &boxes, load_method method,
+                    TreeClass &tree, sibench::result_info &res) {
+  typedef std::vector<sibench::id_type> box_values_t;
+  box_values_t vboxes(boxes.size());
+  std::iota(vboxes.begin(), vboxes.end(), 0);
+
+  auto const marks = sibench::benchmark(
+      "load", boxes.size(), vboxes,
+      [&tree, method](box_values_t const &boxes, std::size_t iterations) {
+        switch (method) {
+        case eIterative:
+          tree.insert(boxes.cbegin(), boxes.cbegin() + iterations);
+          break;
+        case eSortTileRecursive:
+          tree.bulk_load(boxes.cbegin(), boxes.cbegin() + iterations,
+                         spatial::rtree::eSortTileRecursive);
+          break;
+        default:
+          tree.bulk_load(boxes.cbegin(), boxes.cbegin() + iterations,
+                         spatial::rtree::eHilbertSort);
+          break;
+        }
+      });
+  res.accumulate(marks);
+}
+
+template <class TreeClass>
+void benchmark_query(const sibench::boxes2d_t &boxes, const TreeClass &tree,
+                     sibench::result_info &res) {
+  size_t query_found = 0;
+  auto const marks = sibench::benchmark(
+      "query", sibench::max_queries, boxes,
+      [&tree, &query_found](sibench::boxes2d_t const &boxes,
+                            std::size_t iterations) {
+        std::vector<sibench::id_type> results;
+        results.reserve(iterations);
+
+        for (size_t i = 0; i < iterations; ++i) {
+          results.clear();
+          auto const &box = boxes[i];
+          sibench::coord_t min[2] = {box.min[0] - sibench::query_size,
+                                     box.min[1] - sibench::query_size};
+          sibench::coord_t max[2] = {box.max[0] + sibench::query_size,
+                                     box.max[1] + sibench::query_size};
+
+          tree.query(spatial::intersects<2>(min, max),
+                     std::back_inserter(results));
+
+          query_found += results.size();
+        }
+      });
+  res.accumulate(marks);
+
+#if SIBENCH_DEBUG_PRINT_INFO == 1
+  sibench::print_query_count(std::cout, lib, query_found);
+#endif
+}
+
+template <int max_capacity, int min_capacity>
+void benchmark_run(const sibench::boxes2d_t &boxes) {
+  typedef rtree_t<min_capacity, max_capacity> tree_t;
+
+  std::streamsize wn(5), wf(14);
+  std::cout << std::left << std::setfill(' ') << std::fixed
+            << std::setprecision(6) << std::setw(wn) << max_capacity
+            << std::setw(wn) << min_capacity;
+
+  for (int method = 0; method < eLoadCount; ++method) {
+    ArrayIndexable indexable(boxes);
+    tree_t tree(indexable);
+
+    sibench::result_info load_r, query_r;
+    benchmark_load(boxes, static_cast<load_method>(method), tree, load_r);
+    benchmark_query(boxes, tree, query_r);
+
+    std::cout << std::setw(wf) << load_r.min << std::setw(wf) << query_r.min;
+  }
+  std::cout << std::endl;
+}
+
+void print_header(const std::string &data) {
+  std::streamsize const wn(5), wf(14);
+  std::cout << lib << " packing (" << data << ")" << std::endl;
+  std::cout << std::left << std::setfill(' ') << std::setw(wn * 2)
+            << "capacity";
+  for (int method = 0; method < eLoadCount; ++method) {
+    std::cout << std::setw(wf) << (std::string(kLoadNames[method]) + "_load")
+              << std::setw(wf) << (std::string(kLoadNames[method]) + "_query");
+  }
+  std::cout << std::endl;
+}
+
+template <int max_capacity, int min_capacity>
+void benchmark_capacities(const sibench::boxes2d_t &boxes) {
+  benchmark_run<max_capacity, min_capacity>(boxes);
+  benchmark_run<max_capacity * 2, min_capacity * 2>(boxes);
+  benchmark_run<max_capacity * 4, min_capacity * 4>(boxes);
+  benchmark_run<max_capacity * 8, min_capacity * 8>(boxes);
+  benchmark_run<max_capacity * 16, min_capacity * 16>(boxes);
+}
+} // unnamed namespace
+
+int main() {
+  try {
+    std::size_t const max_capacity = sibench::constant_max_capacity;
+    std::size_t const min_capacity = sibench::constant_min_capacity;
+
+    print_header("uniform");
+    benchmark_capacities<max_capacity, min_capacity>(
+        sibench::generate_boxes(sibench::max_insertions));
+
+    print_header("clustered");
+    benchmark_capacities<max_capacity, min_capacity>(
+        generate_clustered_boxes(sibench::max_insertions));
+
+    return EXIT_SUCCESS;
+  } catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+  } catch (...) {
+    std::cerr << "unknown error" << std::endl;
+  }
+  return EXIT_FAILURE;
+}
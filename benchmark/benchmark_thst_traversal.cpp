@@ -0,0 +1,309 @@
+#include "spatial_index_benchmark.hpp"
+
+#include <RTree.h>
+
+// Compares the explicit stack traversals of the rtree with the recursive ones
+// they replaced, for the query, hierachical_query, rayQuery and nearest. The
+// recursive versions below are the former member functions, run on the nodes
+// of the same tree.
+
+namespace {
+
+std::string const lib("thst");
+
+struct ArrayIndexable {
+
+  ArrayIndexable(const sibench::boxes2d_t &array) : array(array) {}
+
+  const sibench::coord_t *min(const uint32_t index) const {
+    return array[index].min;
+  }
+  const sibench::coord_t *max(const uint32_t index) const {
+    return array[index].max;
+  }
+
+private:
+  const sibench::boxes2d_t &array;
+};
+
+template <int max_capacity, int min_capacity>
+using rtree_t = spatial::RTree<sibench::coord_t, sibench::id_type, 2,
+                               max_capacity, min_capacity, ArrayIndexable>;
+
+std::size_t const runs = 5;
+// a ray crosses the whole world, fewer of them
+std::size_t const max_rays = sibench::max_queries / 100;
+
+// Recursive traversals, the output iterator is passed by reference so that a
+// plain pointer output works as well.
+
+template <class Node, typename Predicate, typename OutIter>
+void query_rec(const Node *node, const Predicate &predicate, size_t &found,
+               OutIter &it) {
+  if (node->isLeaf()) {
+    for (typename Node::count_type index = 0; index < node->count; ++index) {
+      if (predicate(node->bboxes[index])) {
+        *it = node->values[index];
+        ++it;
+        ++found;
+      }
+    }
+    return;
+  }
+  for (typename Node::count_type index = 0; index < node->count; ++index) {
+    if (predicate.bbox.overlaps(node->bboxes[index]))
+      query_rec(node->children[index], predicate, found, it);
+  }
+}
+
+template <class Node, typename Predicate, typename OutIter>
+void hierachical_query_rec(const Node *node, const Predicate &predicate,
+                           int target_level, size_t &found, OutIter &it) {
+  if (node->level <= target_level) {
+    for (typename Node::count_type index = 0; index < node->count; ++index) {
+      if (predicate(node->bboxes[index])) {
+        *it = node->values[index];
+        ++it;
+        ++found;
+      }
+    }
+    return;
+  }
+  for (typename Node::count_type index = 0; index < node->count; ++index) {
+    const auto &bbox = node->bboxes[index];
+    if (predicate.bbox.contains(bbox)) {
+      *it = node->values[index];
+      ++it;
+      ++found;
+    } else if (predicate.bbox.overlaps(bbox))
+      hierachical_query_rec(node->children[index], predicate, target_level,
+                            found, it);
+  }
+}
+
+template <class Node, typename OutIter>
+void ray_query_rec(const Node *node, const float origin[2],
+                   const float direction[2], size_t &found, OutIter &it) {
+  for (typename Node::count_type index = 0; index < node->count; ++index) {
+    if (!node->bboxes[index].template intersectsRay<float>(origin, direction))
+      continue;
+    if (node->isLeaf()) {
+      *it = node->values[index];
+      ++it;
+      ++found;
+    } else
+      ray_query_rec(node->children[index], origin, direction, found, it);
+  }
+}
+
+struct branch_distance {
+  float distance;
+  uint32_t index;
+
+  bool operator<(const branch_distance &other) const {
+    return distance < other.distance;
+  }
+};
+
+template <class Node>
+float center_distance(const sibench::coord_t point[2], const Node &node,
+                      uint32_t index) {
+  sibench::coord_t center[2];
+  node.bboxes[index].center(center);
+  const float dx = point[0] - center[0], dy = point[1] - center[1];
+  return dx * dx + dy * dy;
+}
+
+template <int max_capacity, class Node, typename OutIter>
+void nearest_rec(const Node *node, const sibench::coord_t point[2],
+                 sibench::coord_t radius, size_t &found, OutIter &it) {
+  branch_distance branches[max_capacity];
+  uint32_t count = 0;
+  for (uint32_t index = 0; index < node->count; ++index) {
+    if (node->bboxes[index].overlaps(point, radius)) {
+      branches[count].distance = center_distance(point, *node, index);
+      branches[count].index = index;
+      ++count;
+    }
+  }
+  std::sort(branches, branches + count);
+
+  for (uint32_t index = 0; index < count; ++index) {
+    if (node->isLeaf()) {
+      *it = node->values[branches[index].index];
+      ++it;
+      ++found;
+    } else
+      nearest_rec<max_capacity>(node->children[branches[index].index], point,
+                                radius, found, it);
+  }
+}
+
+// Runs the given query for the query boxes, the fastest of the runs.
+template <typename Query>
+double benchmark_query(const char *name, const sibench::boxes2d_t &boxes,
+                       std::size_t count, size_t &found, Query query) {
+  sibench::result_info res;
+  for (std::size_t run = 0; run < runs; ++run) {
+    found = 0;
+    auto const marks = sibench::benchmark(
+        name, count, boxes,
+        [&](sibench::boxes2d_t const &boxes, std::size_t iterations) {
+          std::vector<sibench::id_type> results;
+          for (size_t i = 0; i < iterations; ++i) {
+            results.clear();
+            found += query(boxes[i], results);
+          }
+        });
+    res.accumulate(marks);
+  }
+  return res.min;
+}
+
+template <int max_capacity, int min_capacity>
+void benchmark_run(const sibench::boxes2d_t &boxes) {
+  typedef rtree_t<max_capacity, min_capacity> tree_t;
+  typedef typename tree_t::allocator_type::value_type node_t;
+  typedef std::vector<sibench::id_type> results_t;
+
+  std::vector<sibench::id_type> values(boxes.size());
+  std::iota(values.begin(), values.end(), 0);
+  ArrayIndexable indexable(boxes);
+  tree_t tree(indexable);
+  tree.bulk_load(values.begin(), values.end(), spatial::rtree::eHilbertSort);
+  tree.setQueryTargetLevel(1);
+  const node_t *root = tree.rootNode();
+
+  auto query_box = [](const sibench::box2d &box, sibench::coord_t min[2],
+                      sibench::coord_t max[2]) {
+    min[0] = box.min[0] - sibench::query_size;
+    min[1] = box.min[1] - sibench::query_size;
+    max[0] = box.max[0] + sibench::query_size;
+    max[1] = box.max[1] + sibench::query_size;
+  };
+  auto ray = [](const sibench::box2d &box, float origin[2],
+                float direction[2]) {
+    origin[0] = box.min[0];
+    origin[1] = box.min[1];
+    direction[0] = 1.f;
+    direction[1] = 0.5f;
+  };
+
+  size_t recursive_found[4], stack_found[4];
+  double recursive[4], stack[4];
+
+  recursive[0] = benchmark_query(
+      "query", boxes, sibench::max_queries, recursive_found[0],
+      [&](const sibench::box2d &box, results_t &results) {
+        sibench::coord_t min[2], max[2];
+        query_box(box, min, max);
+        size_t found = 0;
+        auto it = std::back_inserter(results);
+        query_rec(root, spatial::intersects<2>(min, max), found, it);
+        return found;
+      });
+  stack[0] = benchmark_query(
+      "query", boxes, sibench::max_queries, stack_found[0],
+      [&](const sibench::box2d &box, results_t &results) {
+        sibench::coord_t min[2], max[2];
+        query_box(box, min, max);
+        return tree.query(spatial::intersects<2>(min, max),
+                          std::back_inserter(results));
+      });
+
+  recursive[1] = benchmark_query(
+      "hierachical_query", boxes, sibench::max_queries, recursive_found[1],
+      [&](const sibench::box2d &box, results_t &results) {
+        sibench::coord_t min[2], max[2];
+        query_box(box, min, max);
+        size_t found = 0;
+        auto it = std::back_inserter(results);
+        hierachical_query_rec(root, spatial::intersects<2>(min, max), 1, found,
+                              it);
+        return found;
+      });
+  stack[1] = benchmark_query(
+      "hierachical_query", boxes, sibench::max_queries, stack_found[1],
+      [&](const sibench::box2d &box, results_t &results) {
+        sibench::coord_t min[2], max[2];
+        query_box(box, min, max);
+        return tree.hierachical_query(spatial::intersects<2>(min, max),
+                                      std::back_inserter(results));
+      });
+
+  recursive[2] = benchmark_query(
+      "rayQuery", boxes, max_rays, recursive_found[2],
+      [&](const sibench::box2d &box, results_t &results) {
+        float origin[2], direction[2];
+        ray(box, origin, direction);
+        size_t found = 0;
+        auto it = std::back_inserter(results);
+        ray_query_rec(root, origin, direction, found, it);
+        return found;
+      });
+  stack[2] = benchmark_query(
+      "rayQuery", boxes, max_rays, stack_found[2],
+      [&](const sibench::box2d &box, results_t &results) {
+        float origin[2], direction[2];
+        ray(box, origin, direction);
+        return tree.rayQuery(origin, direction, std::back_inserter(results));
+      });
+
+  recursive[3] = benchmark_query(
+      "nearest", boxes, sibench::max_queries, recursive_found[3],
+      [&](const sibench::box2d &box, results_t &results) {
+        size_t found = 0;
+        auto it = std::back_inserter(results);
+        nearest_rec<max_capacity>(root, box.min, sibench::query_size, found,
+                                  it);
+        return found;
+      });
+  stack[3] = benchmark_query(
+      "nearest", boxes, sibench::max_queries, stack_found[3],
+      [&](const sibench::box2d &box, results_t &results) {
+        return tree.nearest(box.min, sibench::query_size,
+                            std::back_inserter(results));
+      });
+
+  std::streamsize wn(5), wf(14);
+  std::cout << std::left << std::setfill(' ') << std::fixed
+            << std::setprecision(6) << std::setw(wn) << max_capacity
+            << std::setw(wn) << min_capacity << std::setw(wn + 2)
+            << tree.levels();
+  for (int query = 0; query < 4; ++query) {
+    if (recursive_found[query] != stack_found[query])
+      throw std::runtime_error("the traversals found different results");
+    std::cout << std::setw(wf) << recursive[query] << std::setw(wf)
+              << stack[query];
+  }
+  std::cout << std::endl;
+}
+} // unnamed namespace
+
+int main() {
+  try {
+    auto const boxes = sibench::generate_boxes(sibench::max_insertions);
+
+    std::streamsize const wn(5), wf(14);
+    std::cout << lib << " recursive vs explicit stack traversal" << std::endl;
+    std::cout << std::left << std::setfill(' ') << std::setw(wn * 2)
+              << "capacity" << std::setw(wn + 2) << "height";
+    for (const char *name : {"query", "hquery", "ray", "nearest"}) {
+      std::cout << std::setw(wf) << (std::string(name) + "_rec")
+                << std::setw(wf) << (std::string(name) + "_stack");
+    }
+    std::cout << std::endl;
+
+    benchmark_run<4, 2>(boxes);
+    benchmark_run<8, 4>(boxes);
+    benchmark_run<16, 6>(boxes);
+    benchmark_run<32, 12>(boxes);
+
+    return EXIT_SUCCESS;
+  } catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+  } catch (...) {
+    std::cerr << "unknown error" << std::endl;
+  }
+  return EXIT_FAILURE;
+}
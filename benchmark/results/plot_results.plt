@@ -18,7 +18,7 @@ outfmt = ".png"
 #outfmt = ".svg"
 
 algos = "linear quadratic rstar"
-variants = "quadratic quadratic_custom quadratic_sphere quadratic_sphere_custom"
+variants = "quadratic quadratic_custom quadratic_sphere quadratic_sphere_custom rstar linear ang_tan"
 
 array libs[2] = ["bgi", "thst"]
 array arr[2] = [algos, variants]
@@ -50,6 +50,12 @@ set output "bgi_benchmark_rtree_load_blk_vs_balancing".outfmt
 plot for [l in "bgi"] for [m in algos] \
   "<(head -20 ".l."_".m."_blk_ct.dat)" using 1:3 with linespoints title l." ".m."_blk" noenhanced
 
+array blkarr[2] = ["rstar_blk", "quadratic_blk quadratic_sphere_blk"]
+set title "Bulk loading (blk) times, bgi vs thst (Sort-Tile-Recursive)"
+set output "benchmark_load_blk_bgi_vs_thst".outfmt
+plot for[i=1:2] for [ m in blkarr[i] ] \
+  "<(head -20 ".libs[i]."_".m.ext[i].".dat)" using 1:3 with linespoints title libs[i]."-".m noenhanced
+
 #
 # Plot querying times
 #
@@ -86,6 +92,11 @@ set output "bgi_benchmark_rtree_query_blk_vs_balancing".outfmt
 plot for [l in "bgi"] for [m in algos] \
   "<(head -20 ".l."_".m."_blk_ct.dat)" using 1:4 with linespoints title l." ".m."_blk" noenhanced
 
+set title "Query times of the bulk loaded (blk) trees, bgi vs thst (Sort-Tile-Recursive)"
+set output "benchmark_query_blk_bgi_vs_thst".outfmt
+plot for[i=1:2] for [ m in blkarr[i] ] \
+  "<(head -20 ".libs[i]."_".m.ext[i].".dat)" using 1:4 with linespoints title libs[i]."-".m noenhanced
+
 #
 # Plot dynamic use case(querying + insert + clear) times
 #
@@ -26,7 +26,7 @@ LOGEXT="dat"
 # Benchmark iterative loading (takes long time, skipped on Travis CI)
 #
 if [[ "$TRAVIS" != "true" ]] ; then
-for variant in linear quadratic rstar quadtree
+for variant in linear ang_tan quadratic rstar quadtree
 do
     for benchmark in `find $BDIR -type f -name "*${variant}*" | sort`
     do
@@ -67,6 +67,8 @@ inline std::pair<rtree_variant, std::string> get_rtree_split_variant() {
   return std::make_pair(rtree_variant::quadratic, "QS");
 #elif SIBENCH_RTREE_SPLIT_RSTAR
   return std::make_pair(rtree_variant::rstar, "R");
+#elif SIBENCH_RTREE_SPLIT_ANG_TAN
+  return std::make_pair(rtree_variant::linear, "AT");
 #elif SIBENCH_RTREE_SPLIT_QUADTREE
   return std::make_pair(rtree_variant::quadtree, "QT");
 #else
@@ -0,0 +1,392 @@
+//
+//  ConcurrentRTree.h
+//
+//
+
+#pragma once
+
+#include "RTree.h"
+
+#ifdef SPATIAL_TREE_USE_CPP11
+#include <stdint.h>
+#include <atomic>
+
+namespace spatial {
+	namespace detail {
+		/// Latch of a node of the concurrent tree with the fields of the R-link
+		/// traversal: a split node links to the new node holding its moved
+		/// branches and takes a new split sequence number, so the threads which
+		/// read the parent before the split also visit the new node.
+		struct LinkLatch : SharedLatch {
+			void *rightLink;   ///< Node split from this one, or the old right link
+			uint64_t sequence; ///< Split sequence number
+			uint64_t version;  ///< Incremented by each change of the node
+
+			LinkLatch() : rightLink(NULL), sequence(0), version(0) {}
+		};
+	} // namespace detail
+
+	/**
+	 @class ConcurrentRTree
+	 @brief RTree which can be inserted into and queried by many threads at once,
+	 the nodes are latched individually instead of locking the whole tree.
+
+	 The tree is an R-link tree: a split node links to its new sibling and
+	 takes a new number from a split sequence, which is incremented while the
+	 parent is latched. A thread remembers the sequence when it reads a parent,
+	 a child with a higher number has split since and its right links lead to
+	 the moved branches. Thus a query latches a single node at a time.
+
+	 An insert descends with a shared latch at a time and latches only the leaf
+	 exclusively. If the leaf is full or its box in the parent has to be
+	 enlarged, the recorded path gives the highest node which has to change,
+	 i.e. whose own box contains the new one and which has room for a split.
+	 That node is latched exclusively and validated by its version, then the
+	 path below it is latched exclusively, releasing the ancestors as soon as a
+	 child has room for a split. A node changed meanwhile restarts the insert.
+
+	 @tparam split_policy the split algorithm, the R* forced reinsertion isn't
+	 used, its overflowing nodes are split.
+
+	 @note Each thread splits with its own scratch and the count is atomic.
+	 @see RTree for the other parameters.
+	 */
+	template <typename T,                                            //
+		typename ValueType,                                    //
+		int Dimension,                                         //
+		int max_child_items = 8,                               //
+		int min_child_items = max_child_items / 2,             //
+		typename indexable_getter = Indexable<T, ValueType>,   //
+		int bbox_volume_mode = box::eNormalVolume,             //
+		typename RealType = typename rtree::RealType<T>::type, //
+		typename split_policy = rtree::quadratic>
+		class ConcurrentRTree {
+		public:
+			typedef ValueType value_type;
+			typedef RealType real_type;
+			typedef BoundingBox<T, Dimension> bbox_type;
+			typedef detail::Node<ValueType, bbox_type, max_child_items,
+				detail::LinkLatch>
+				node_type;
+			typedef RTree<T, ValueType, Dimension, max_child_items, min_child_items,
+				indexable_getter, bbox_volume_mode, RealType,
+				spatial::allocator<node_type>, split_policy>
+				tree_type;
+
+			static const size_t max_items = max_child_items;
+			static const size_t min_items = min_child_items;
+
+		private:
+			typedef node_type *node_ptr_type;
+			typedef typename node_type::branch_type branch_type;
+			typedef typename node_type::count_type count_type;
+			typedef typename tree_type::PartitionVars partition_vars;
+
+			enum { kMaxHeight = tree_type::kMaxHeight };
+
+			/// The cursor is the split sequence read with the parent, a level
+			/// holds the pending children and a right link.
+			typedef detail::TraversalStack<const node_type *, uint64_t,
+				kMaxHeight * (max_child_items + 1)>
+				link_stack;
+
+		public:
+			explicit ConcurrentRTree(indexable_getter indexable = indexable_getter());
+
+			/// Inserts the value, safe to call concurrently with the other inserts
+			/// and the queries.
+			void insert(const ValueType &value);
+
+			/// Returns the number of found values, safe to call concurrently with
+			/// the inserts.
+			/// @note Sees the values inserted before the query started, the ones
+			/// inserted meanwhile may or may not be found.
+			template <typename Predicate, typename OutIter>
+			size_t query(const Predicate &predicate, OutIter out_it) const;
+
+			/// Returns the number of inserted values.
+			size_t count() const;
+			/// Returns the number of levels, i.e. the height of the tree.
+			int levels() const;
+
+		private:
+			bool tryInsert(const branch_type &branch);
+			bool insertExclusive(const branch_type &branch, node_ptr_type node,
+				uint64_t version, bool rootSplits);
+			void splitNode(node_type &node, const branch_type &branch,
+				node_ptr_type &newNode, partition_vars &partitionVars);
+
+			ConcurrentRTree(const ConcurrentRTree &);
+			ConcurrentRTree &operator=(const ConcurrentRTree &);
+
+		private:
+			tree_type m_tree;
+			/// Guards the root pointer, held exclusively while the root splits.
+			detail::SharedLatch m_rootLatch;
+			/// Split sequence, incremented while the parent of the split node is
+			/// latched, or the root latch.
+			std::atomic<uint64_t> m_sequence;
+			std::atomic<size_t> m_count;
+	};
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define CONCURRENT_TREE_TEMPLATE                                               \
+  template <typename T, typename ValueType, int Dimension,                     \
+            int max_child_items, int min_child_items,                          \
+            typename indexable_getter, int bbox_volume_mode,                   \
+            typename RealType, typename split_policy>
+#define CONCURRENT_TREE_QUAL                                                   \
+  ConcurrentRTree<T, ValueType, Dimension, max_child_items, min_child_items,   \
+                  indexable_getter, bbox_volume_mode, RealType, split_policy>
+
+	CONCURRENT_TREE_TEMPLATE
+		CONCURRENT_TREE_QUAL::ConcurrentRTree(indexable_getter indexable)
+		: m_tree(indexable), m_sequence(0), m_count(0) {}
+
+	CONCURRENT_TREE_TEMPLATE
+		void CONCURRENT_TREE_QUAL::insert(const ValueType &value) {
+		branch_type branch;
+		branch.value = value;
+		branch.child = NULL;
+		branch.bbox.set(m_tree.m_indexable.min(value),
+			m_tree.m_indexable.max(value));
+
+		while (!tryInsert(branch)) {
+		}
+		m_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	CONCURRENT_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	size_t CONCURRENT_TREE_QUAL::query(const Predicate &predicate,
+		OutIter out_it) const {
+		link_stack stack;
+		m_rootLatch.lockShared();
+		stack.push(m_tree.m_root, m_sequence.load());
+		m_rootLatch.unlockShared();
+
+		// only the node being read is latched, the children are visited with the
+		// split sequence read with it
+		size_t foundCount = 0;
+		while (!stack.empty()) {
+			const node_type *node = stack.top().node;
+			const uint64_t sequence = stack.top().cursor;
+			stack.pop();
+
+			node->lockShared();
+			if (node->sequence > sequence) {
+				// split since its parent was read, the sibling holds the moved branches
+				stack.push(static_cast<const node_type *>(node->rightLink), sequence);
+			}
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->bboxes[index])) {
+						*out_it = node->values[index];
+						++out_it;
+						++foundCount;
+					}
+				}
+			}
+			else {
+				const uint64_t childSequence = m_sequence.load();
+				// in reverse, the first child is visited first
+				for (count_type index = node->count; index-- > 0;) {
+					if (predicate.bbox.overlaps(node->bboxes[index]))
+						stack.push(node->children[index], childSequence);
+				}
+			}
+			node->unlockShared();
+		}
+		return foundCount;
+	}
+
+	CONCURRENT_TREE_TEMPLATE
+		size_t CONCURRENT_TREE_QUAL::count() const {
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	CONCURRENT_TREE_TEMPLATE
+		int CONCURRENT_TREE_QUAL::levels() const {
+		m_rootLatch.lockShared();
+		const int level = m_tree.m_root->level;
+		m_rootLatch.unlockShared();
+		return level + 1;
+	}
+
+	// Descends with a shared latch at a time and adds the branch to the leaf if
+	// it fits and the box of the leaf in its parent already contains it,
+	// otherwise changes the path from the highest node which needs it.
+	// Returns false, without changing the tree, if a read node has changed.
+	CONCURRENT_TREE_TEMPLATE
+		bool CONCURRENT_TREE_QUAL::tryInsert(const branch_type &branch) {
+		node_ptr_type path[kMaxHeight];
+		uint64_t versions[kMaxHeight];
+		// the box of the node in its parent contains the branch
+		bool contained[kMaxHeight];
+		bool full[kMaxHeight];
+		int depth = 0;
+
+		m_rootLatch.lockShared();
+		node_ptr_type node = m_tree.m_root;
+		uint64_t sequence = m_sequence.load();
+		m_rootLatch.unlockShared();
+		contained[0] = true;
+
+		for (;;) {
+			if (node->isLeaf())
+				node->lockExclusive();
+			else
+				node->lockShared();
+			if (node->sequence > sequence) {
+				// split since its parent was read, the box in the parent is stale
+				if (node->isLeaf())
+					node->unlockExclusive();
+				else
+					node->unlockShared();
+				return false;
+			}
+
+			path[depth] = node;
+			versions[depth] = node->version;
+			full[depth] = node->count >= max_child_items;
+			if (node->isLeaf())
+				break;
+
+			const count_type index =
+				m_tree.chooseSubtree(branch.bbox, *node, split_policy());
+			contained[depth + 1] = node->bboxes[index].contains(branch.bbox);
+			node_ptr_type child = node->children[index];
+			sequence = m_sequence.load();
+			node->unlockShared();
+			node = child;
+			++depth;
+		}
+
+		if (!full[depth] && contained[depth]) {
+			node->addBranch(branch);
+			++node->version;
+			node->unlockExclusive();
+			return true;
+		}
+		node->unlockExclusive();
+
+		// the parent of the highest node to change needs no change, its box
+		// contains the branch and no split reaches it; a full node is passed
+		// since a node below might have filled up meanwhile
+		int first = depth;
+		bool splits = full[depth];
+		while (first > 0 && (splits || full[first] || !contained[first])) {
+			--first;
+			splits = splits && full[first];
+		}
+		return insertExclusive(branch, path[first], versions[first],
+			first == 0 && full[0]);
+	}
+
+	// Latches the node exclusively, it must have the version it was read with,
+	// then descends with exclusive latches and enlarges the boxes of the path.
+	// The ancestors of a child which has room for a split are released, the
+	// splits propagate only through the latched nodes.
+	CONCURRENT_TREE_TEMPLATE
+		bool CONCURRENT_TREE_QUAL::insertExclusive(const branch_type &branch,
+			node_ptr_type node, uint64_t version, bool rootSplits) {
+		node_ptr_type path[kMaxHeight];
+		count_type indices[kMaxHeight];
+		// the nodes of path[first, depth) are latched
+		int first = 0, depth = 0;
+
+		// a splitting root is replaced while the root latch is held
+		if (rootSplits)
+			m_rootLatch.lockExclusive();
+		node->lockExclusive();
+		if (node->version != version) {
+			node->unlockExclusive();
+			if (rootSplits)
+				m_rootLatch.unlockExclusive();
+			return false;
+		}
+		path[depth++] = node;
+
+		while (node->isBranch()) {
+			const count_type index =
+				m_tree.chooseSubtree(branch.bbox, *node, split_policy());
+			node->setBBox(index, branch.bbox.extended(node->bboxes[index]));
+			++node->version;
+
+			node_ptr_type child = node->children[index];
+			child->lockExclusive();
+			if (child->count < max_child_items) {
+				for (int level = first; level < depth; ++level)
+					path[level]->unlockExclusive();
+				first = depth;
+			}
+			indices[depth - 1] = index;
+			path[depth++] = child;
+			node = child;
+		}
+
+		node_ptr_type newNode = NULL;
+		++node->version;
+		if (!node->addBranch(branch)) {
+			partition_vars partitionVars;
+			splitNode(*node, branch, newNode, partitionVars);
+
+			// a full node keeps its parent latched
+			for (int level = depth - 1; newNode && level > first; --level) {
+				node_ptr_type parent = path[level - 1];
+				parent->setBBox(indices[level - 1], path[level]->cover());
+				++parent->version;
+
+				branch_type split = branch_type();
+				split.child = newNode;
+				split.bbox = newNode->cover();
+				newNode = NULL;
+				if (!parent->addBranch(split))
+					splitNode(*parent, split, newNode, partitionVars);
+			}
+
+			if (newNode) {
+				// grow the tree taller, the old root is still latched
+				assert(rootSplits && first == 0 && path[0] == m_tree.m_root);
+				node_ptr_type root = path[0];
+				node_ptr_type newRoot = m_tree.allocateNode(root->level + 1);
+
+				branch_type split = branch_type();
+				split.child = root;
+				split.bbox = root->cover();
+				newRoot->addBranch(split);
+				split.child = newNode;
+				split.bbox = newNode->cover();
+				newRoot->addBranch(split);
+				m_tree.m_root = newRoot;
+			}
+		}
+
+		for (int level = first; level < depth; ++level)
+			path[level]->unlockExclusive();
+		if (rootSplits)
+			m_rootLatch.unlockExclusive();
+		return true;
+	}
+
+	// Splits the node and links it to the new node, which takes over its right
+	// link and split sequence.
+	CONCURRENT_TREE_TEMPLATE
+		void CONCURRENT_TREE_QUAL::splitNode(node_type &node,
+			const branch_type &branch, node_ptr_type &newNode,
+			partition_vars &partitionVars) {
+		m_tree.splitNode(node, branch, &newNode, partitionVars);
+		newNode->rightLink = node.rightLink;
+		newNode->sequence = node.sequence;
+		node.rightLink = newNode;
+		node.sequence = m_sequence.fetch_add(1) + 1;
+		++node.version;
+	}
+
+#undef CONCURRENT_TREE_TEMPLATE
+#undef CONCURRENT_TREE_QUAL
+
+} // namespace spatial
+#endif
@@ -0,0 +1,682 @@
+//
+//  FrozenRTree.h
+//
+//
+
+#pragma once
+
+#include "RTree.h"
+#include "mapped_file.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+		/// Node of the frozen tree, the children of a branch node are stored
+		/// consecutively starting at the firstChild offset.
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct FrozenNode {
+			typedef uint32_t count_type;
+
+			count_type count;    ///< Number of branches in the node
+			int32_t level;       ///< Leaf is zero, others positive
+			uint32_t firstChild; ///< Offset of the first child, branch nodes only
+			BBoxClass bboxes[max_child_items];
+			ValueType values[max_child_items];
+
+			bool isBranch() const { return (level > 0); }
+
+			bool isLeaf() const { return (level == 0); }
+		};
+
+		/// Header of the serialized frozen tree, followed by the nodes.
+		struct FrozenHeader {
+			enum { kMagic = 0x54534854, kVersion = 1, kEndianness = 0x01020304 };
+			/// The branch nodes have no values, frozen from a layout without them.
+			enum { kNoBranchValues = 1 };
+
+			uint32_t magic;      ///< "THST"
+			uint32_t version;
+			uint32_t endianness; ///< Written in the native byte order
+			uint32_t coordinateType;
+			uint32_t dimension;
+			uint32_t maxChildItems;
+			uint32_t valueSize;
+			uint32_t nodeSize;
+			uint64_t count;
+			uint64_t nodeCount;
+			uint64_t checksum; ///< Checksum of the nodes
+			int32_t queryTargetLevel;
+			uint32_t flags; ///< Also keeps the nodes 8 byte aligned
+		};
+
+		/// Identifies the coordinate type via its size, signedness and whether
+		/// it's an integer.
+		template <typename T> inline uint32_t coordinateType() {
+			return (uint32_t)sizeof(T) |
+				((uint32_t)std::numeric_limits<T>::is_integer << 8) |
+				((uint32_t)std::numeric_limits<T>::is_signed << 9);
+		}
+	} // namespace detail
+
+	/**
+	 @class FrozenRTree
+	 @brief Read-only version of a built RTree, the nodes are stored in a single
+	 contiguous buffer in breadth-first order and reference their children via
+	 32 bit offsets instead of pointers.
+
+	 The queries have the same semantics and return the results in the same
+	 order as the queries of the source tree.
+
+	 @tparam T                type of the space(eg. int, float, etc.)
+	 @tparam ValueType        type of value stored in the tree's nodes
+	 @tparam Dimension        number of dimensions for the spatial space of the
+	 bounding boxes
+	 @tparam max_child_items  M, must be the same as the one of the source tree
+	 @tparam RealType type of element that allows fractional and large
+	 values such as float or double, for use in distance calculations.
+
+	 @note Better cache locality and half the size of the node links compared to
+	 the allocated nodes, use it for static data.
+	 @note The tree can be saved to a file and opened via a read-only memory
+	 mapping, the queries run directly on the mapped nodes. Requires a trivially
+	 copyable ValueType, eg: int, id, etc.
+	 */
+	template <typename T,                                            //
+		typename ValueType,                                    //
+		int Dimension,                                         //
+		int max_child_items = 8,                               //
+		typename RealType = typename rtree::RealType<T>::type> //
+		class FrozenRTree {
+		public:
+			typedef RealType real_type;
+			typedef BoundingBox<T, Dimension> bbox_type;
+			typedef detail::FrozenNode<ValueType, bbox_type, max_child_items>
+				node_type;
+			/// Scratch buffers of the k nearest search.
+			typedef NearestScratch<uint32_t, RealType> nearest_scratch_type;
+
+			static const size_t max_items = max_child_items;
+
+		private:
+			typedef typename node_type::count_type count_type;
+
+			// bounds the height of any source tree, min_child_items is at least 2
+			enum { kMaxHeight = detail::MaxTreeHeight<2>::value };
+			typedef detail::TraversalStack<const node_type *, count_type, kMaxHeight>
+				traversal_stack;
+
+		public:
+			FrozenRTree();
+			/// Copies the nodes of the given tree.
+			template <class RTreeClass> explicit FrozenRTree(const RTreeClass &tree);
+			/// @note A mapped tree is copied to memory.
+			FrozenRTree(const FrozenRTree &src);
+
+			FrozenRTree &operator=(const FrozenRTree &rhs);
+
+			void swap(FrozenRTree &other);
+
+			/// Replaces the contents with the nodes of the given tree.
+			template <class RTreeClass> void freeze(const RTreeClass &tree);
+
+			/// Writes the tree to the given file, returns false on failure.
+			bool save(const char *path) const;
+			/// Replaces the contents with the tree of the given file, which is mapped
+			/// to memory and used without copying.
+			/// @param verify if true then the checksum of the nodes is verified,
+			/// which reads the whole file.
+			/// @return Returns false if the file can't be mapped, was saved with
+			/// a different version, byte order or tree type, or if its nodes don't
+			/// form a valid tree, which is always checked.
+			bool open(const char *path, bool verify = false);
+			/// Same as open, but for a serialized tree already in memory.
+			/// @note The data must outlive the tree and be 8 byte aligned.
+			bool load(const void *data, size_t size, bool verify = false);
+
+			/// Special query to find all within search rectangle using the hierarchical
+			/// order.
+			/// @see spatial::SpatialPredicate for available predicates.
+			template <typename Predicate>
+			bool hierachical_query(const Predicate &predicate) const;
+			/// \return Returns the number of entries found.
+			template <typename Predicate, typename OutIter>
+			size_t hierachical_query(const Predicate &predicate, OutIter out_it) const;
+			/// Defines the target query level, if 0 then leaf values are retrieved
+			/// otherwise hierarchical node values.
+			/// @note Only used for hierachical_query, initially the one of the
+			/// source tree.
+			void setQueryTargetLevel(int level);
+			/// Returns false if the source tree had a layout without branch values,
+			/// eg. CompactNode, then hierachical_query finds nothing.
+			bool hasBranchValues() const;
+
+			/// @see spatial::SpatialPredicate for available predicates.
+			template <typename BoxPredicate>
+			bool query(const BoxPredicate &predicate) const;
+			template <typename BoxPredicate, typename OutIter>
+			size_t query(const BoxPredicate &predicate, OutIter out_it) const;
+
+			/// Adds the value if the predicate condition is true.
+			template <typename OutIter, typename Predicate = spatial::detail::AlwayTruePredicate>
+			size_t rayQuery(const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], OutIter out_it, const Predicate& predicate = spatial::detail::AlwayTruePredicate()) const;
+
+			/// Performs a knn-nearest search, the results are sorted by increasing
+			/// distance.
+			/// @note Uses the minimum distance to the bbox.
+			/// @see RTree::k_nearest
+			template <typename OutIter>
+			size_t k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+				RealType maxDistance = -1) const;
+			template <typename OutIter>
+			size_t k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+				nearest_scratch_type &scratch, RealType maxDistance = -1) const;
+
+			/// Count the data elements in this container.
+			size_t count() const;
+			/// Returns the number of levels(height) of the tree.
+			size_t levels() const;
+			/// Returns the bbox of the root node.
+			bbox_type bbox() const;
+			/// Returns the size in bytes of the tree.
+			size_t bytes() const;
+
+			/// Returns the nodes, the root is the first one.
+			const node_type *nodes() const;
+			size_t nodeCount() const;
+
+		private:
+			// The traversals use an explicit stack instead of recursion and visit
+			// the nodes in the same order as the ones of RTree.
+			template <typename Predicate, typename OutIter>
+			void queryHierachicalImpl(const node_type *root, const Predicate &predicate,
+				size_t &foundCount, OutIter out_it) const;
+
+			template <typename Predicate, typename OutIter>
+			void queryImpl(const node_type *root, const Predicate &predicate,
+				size_t &foundCount, OutIter out_it) const;
+
+			template <typename Predicate, typename OutIter>
+			void rayQueryImpl(const node_type *root, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
+				size_t& foundCount, OutIter it) const;
+
+			inline static RealType distance(const T point[Dimension], const bbox_type& bbox) {
+
+				RealType d = (RealType)std::max(std::max(bbox.min[0] - point[0], (T)0), point[0] - bbox.max[0]);
+				d *= d;
+				for (int i = 1; i < Dimension; i++)
+				{
+					const RealType temp = (RealType)std::max(std::max(bbox.min[i] - point[i], (T)0), point[i] - bbox.max[i]);
+					d += temp * temp;
+				}
+
+				return d;
+			}
+
+		private:
+			void fillHeader(detail::FrozenHeader &header) const;
+			static bool validNodes(const node_type *nodes, size_t nodeCount);
+
+		private:
+			std::vector<node_type> m_nodes; ///< Owned nodes, empty when mapped
+			detail::MappedFile m_file;
+			const node_type *m_data;        ///< Owned or mapped nodes
+			size_t m_nodeCount;
+			size_t m_count;
+			int m_queryTargetLevel;
+			bool m_hasBranchValues;
+	};
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define FROZEN_TREE_TEMPLATE                                                   \
+  template <typename T, typename ValueType, int Dimension,                     \
+            int max_child_items, typename RealType>
+#define FROZEN_TREE_QUAL                                                       \
+  FrozenRTree<T, ValueType, Dimension, max_child_items, RealType>
+
+	FROZEN_TREE_TEMPLATE
+		FROZEN_TREE_QUAL::FrozenRTree()
+		: m_data(NULL), m_nodeCount(0), m_count(0), m_queryTargetLevel(0),
+		m_hasBranchValues(true) {}
+
+	FROZEN_TREE_TEMPLATE
+		template <class RTreeClass>
+	FROZEN_TREE_QUAL::FrozenRTree(const RTreeClass &tree)
+		: m_data(NULL), m_nodeCount(0), m_count(0), m_queryTargetLevel(0),
+		m_hasBranchValues(true) {
+		freeze(tree);
+	}
+
+	FROZEN_TREE_TEMPLATE
+		FROZEN_TREE_QUAL::FrozenRTree(const FrozenRTree &src)
+		: m_nodes(src.m_data, src.m_data + src.m_nodeCount),
+		m_data(m_nodes.empty() ? NULL : &m_nodes[0]), m_nodeCount(src.m_nodeCount),
+		m_count(src.m_count), m_queryTargetLevel(src.m_queryTargetLevel),
+		m_hasBranchValues(src.m_hasBranchValues) {}
+
+	FROZEN_TREE_TEMPLATE
+		FROZEN_TREE_QUAL &FROZEN_TREE_QUAL::operator=(const FrozenRTree &rhs) {
+		if (&rhs != this) {
+			FrozenRTree copy(rhs);
+			swap(copy);
+		}
+		return *this;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		void FROZEN_TREE_QUAL::swap(FrozenRTree &other) {
+		// the data of the vectors doesn't move on swap
+		m_nodes.swap(other.m_nodes);
+		m_file.swap(other.m_file);
+		std::swap(m_data, other.m_data);
+		std::swap(m_nodeCount, other.m_nodeCount);
+		std::swap(m_count, other.m_count);
+		std::swap(m_queryTargetLevel, other.m_queryTargetLevel);
+		std::swap(m_hasBranchValues, other.m_hasBranchValues);
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <class RTreeClass>
+	void FROZEN_TREE_QUAL::freeze(const RTreeClass &tree) {
+		typedef typename RTreeClass::node_type source_node_type;
+		SPATIAL_TREE_STATIC_ASSERT(
+			(RTreeClass::max_items == (size_t)max_child_items),
+			"The node sizes must match!");
+
+		m_file.close();
+		m_nodes.clear();
+		m_count = tree.m_count;
+		m_queryTargetLevel = tree.m_queryTargetLevel;
+		m_hasBranchValues = source_node_type::has_branch_values != 0;
+
+		// the nodes are visited level by level, the children of a node are
+		// consecutive as they are queued together
+		std::vector<const source_node_type *> queue(1, tree.m_root);
+		m_nodes.reserve(RTreeClass::nodeCount(m_count));
+		for (size_t current = 0; current < queue.size(); ++current) {
+			const source_node_type &source = *queue[current];
+
+			m_nodes.push_back(node_type());
+			node_type &node = m_nodes.back();
+			node.count = source.count;
+			node.level = source.level;
+			node.firstChild = 0;
+			for (count_type index = 0; index < source.count; ++index) {
+				node.bboxes[index] = source.bboxes[index];
+				if (source.isLeaf() || m_hasBranchValues)
+					node.values[index] = source.values[index];
+			}
+
+			if (source.isBranch()) {
+				assert(queue.size() + source.count <= 0xFFFFFFFFu);
+				node.firstChild = (uint32_t)queue.size();
+				for (count_type index = 0; index < source.count; ++index)
+					queue.push_back(source.children[index]);
+			}
+		}
+		m_data = &m_nodes[0];
+		m_nodeCount = m_nodes.size();
+	}
+
+	FROZEN_TREE_TEMPLATE
+		void FROZEN_TREE_QUAL::fillHeader(detail::FrozenHeader &header) const {
+		memset(&header, 0, sizeof(header));
+		header.magic = detail::FrozenHeader::kMagic;
+		header.version = detail::FrozenHeader::kVersion;
+		header.endianness = detail::FrozenHeader::kEndianness;
+		header.coordinateType = detail::coordinateType<T>();
+		header.dimension = Dimension;
+		header.maxChildItems = max_child_items;
+		header.valueSize = sizeof(ValueType);
+		header.nodeSize = sizeof(node_type);
+	}
+
+	FROZEN_TREE_TEMPLATE
+		bool FROZEN_TREE_QUAL::save(const char *path) const {
+		detail::FrozenHeader header;
+		fillHeader(header);
+		header.count = m_count;
+		header.nodeCount = m_nodeCount;
+		header.checksum = detail::checksum(m_data, m_nodeCount * sizeof(node_type));
+		header.queryTargetLevel = m_queryTargetLevel;
+		header.flags = m_hasBranchValues ? 0 : detail::FrozenHeader::kNoBranchValues;
+
+		FILE *file = fopen(path, "wb");
+		if (!file)
+			return false;
+		bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+		if (written && m_nodeCount)
+			written = fwrite(m_data, sizeof(node_type), m_nodeCount, file) == m_nodeCount;
+		return (fclose(file) == 0) && written;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		bool FROZEN_TREE_QUAL::open(const char *path, bool verify /*= false*/) {
+		detail::MappedFile file;
+		if (!file.open(path) || !load(file.data(), file.size(), verify))
+			return false;
+		// the nodes point to the mapping, keep it alive
+		m_file.swap(file);
+		return true;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		bool FROZEN_TREE_QUAL::load(const void *data, size_t size,
+			bool verify /*= false*/) {
+		detail::FrozenHeader expected;
+		fillHeader(expected);
+
+		if (size < sizeof(expected))
+			return false;
+		const detail::FrozenHeader &header =
+			*static_cast<const detail::FrozenHeader *>(data);
+		// all the fields up to the tree specific ones must match
+		if (memcmp(&header, &expected, offsetof(detail::FrozenHeader, count)) != 0)
+			return false;
+		if (header.nodeCount == 0 ||
+			(size - sizeof(header)) / sizeof(node_type) < header.nodeCount)
+			return false;
+
+		const node_type *nodes = reinterpret_cast<const node_type *>(
+			static_cast<const char *>(data) + sizeof(header));
+		if (!validNodes(nodes, (size_t)header.nodeCount))
+			return false;
+		if (verify &&
+			header.checksum != detail::checksum(nodes, (size_t)header.nodeCount * sizeof(node_type)))
+			return false;
+
+		m_file.close();
+		std::vector<node_type>().swap(m_nodes);
+		m_data = nodes;
+		m_nodeCount = (size_t)header.nodeCount;
+		m_count = (size_t)header.count;
+		m_queryTargetLevel = header.queryTargetLevel;
+		m_hasBranchValues = (header.flags & detail::FrozenHeader::kNoBranchValues) == 0;
+		return true;
+	}
+
+	// Checks that the queries stay within the nodes, whatever the file holds.
+	FROZEN_TREE_TEMPLATE
+		bool FROZEN_TREE_QUAL::validNodes(const node_type *nodes, size_t nodeCount) {
+		// the traversal stacks are sized for the height of any source tree
+		if (nodes[0].level < 0 || nodes[0].level >= kMaxHeight)
+			return false;
+
+		for (size_t index = 0; index < nodeCount; ++index) {
+			const node_type &node = nodes[index];
+			if (node.count > (count_type)max_child_items || node.level < 0)
+				return false;
+			if (node.isLeaf())
+				continue;
+
+			// the children follow their parent one level lower, so every path
+			// goes down to the leaves without cycles
+			if (node.firstChild <= index ||
+				(uint64_t)node.firstChild + node.count > nodeCount)
+				return false;
+			for (count_type child = 0; child < node.count; ++child) {
+				if (nodes[node.firstChild + child].level != node.level - 1)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate>
+	bool FROZEN_TREE_QUAL::hierachical_query(const Predicate &predicate) const {
+		return hierachical_query(predicate, spatial::detail::dummy_iterator()) > 0;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	size_t FROZEN_TREE_QUAL::hierachical_query(const Predicate &predicate,
+		OutIter out_it) const {
+		size_t foundCount = 0;
+		// the branch values would be the value-initialized placeholders
+		if (m_nodeCount && m_hasBranchValues)
+			queryHierachicalImpl(m_data, predicate, foundCount, out_it);
+		return foundCount;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		void FROZEN_TREE_QUAL::setQueryTargetLevel(int level) {
+		m_queryTargetLevel = level;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		bool FROZEN_TREE_QUAL::hasBranchValues() const {
+		return m_hasBranchValues;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate>
+	bool FROZEN_TREE_QUAL::query(const Predicate &predicate) const {
+		return query(predicate, spatial::detail::dummy_iterator()) > 0;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	size_t FROZEN_TREE_QUAL::query(const Predicate &predicate, OutIter out_it) const {
+		size_t foundCount = 0;
+		if (m_nodeCount)
+			queryImpl(m_data, predicate, foundCount, out_it);
+		return foundCount;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename OutIter, typename Predicate>
+	size_t FROZEN_TREE_QUAL::rayQuery(const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], OutIter out_it, const Predicate& predicate) const
+	{
+		size_t foundCount = 0;
+		if (m_nodeCount)
+			rayQueryImpl(m_data, rayOrigin, rayDirection, predicate, foundCount, out_it);
+		return foundCount;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename OutIter>
+	size_t FROZEN_TREE_QUAL::k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+		RealType maxDistance /*= -1*/) const {
+#ifdef SPATIAL_TREE_USE_CPP11
+		static thread_local nearest_scratch_type scratch;
+#else
+		nearest_scratch_type scratch;
+#endif
+		return k_nearest(point, k, out_it, scratch, maxDistance);
+	}
+
+	// Same search as the RTree, thus the same order of the results.
+	FROZEN_TREE_TEMPLATE
+		template <typename OutIter>
+	size_t FROZEN_TREE_QUAL::k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+		nearest_scratch_type &scratch, RealType maxDistance /*= -1*/) const {
+		if (!k || !m_nodeCount)
+			return 0;
+
+		scratch.start(k, detail::squaredMaxDistance(maxDistance));
+		scratch.pushNode(0, 0);
+		uint32_t nodeIndex;
+		while (scratch.popNode(nodeIndex)) {
+			const node_type &node = m_data[nodeIndex];
+			if (node.isLeaf()) {
+				for (count_type index = 0; index < node.count; ++index)
+					scratch.offer(nodeIndex, index, distance(point, node.bboxes[index]));
+			}
+			else {
+				for (count_type index = 0; index < node.count; ++index)
+					scratch.pushNode(node.firstChild + index, distance(point, node.bboxes[index]));
+			}
+		}
+
+		const std::vector<typename nearest_scratch_type::Entry> &results = scratch.results();
+		for (size_t index = 0; index < results.size(); ++index) {
+			*out_it = m_data[results[index].node].values[results[index].index];
+			++out_it;
+		}
+		return results.size();
+	}
+
+	FROZEN_TREE_TEMPLATE
+		size_t FROZEN_TREE_QUAL::count() const {
+		return m_count;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		size_t FROZEN_TREE_QUAL::levels() const {
+		return m_nodeCount ? m_data[0].level : 0;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		typename FROZEN_TREE_QUAL::bbox_type FROZEN_TREE_QUAL::bbox() const {
+		assert(m_nodeCount && m_data[0].count);
+
+		const node_type &root = m_data[0];
+		bbox_type bbox = root.bboxes[0];
+		for (count_type index = 1; index < root.count; ++index)
+			bbox.extend(root.bboxes[index]);
+		return bbox;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		size_t FROZEN_TREE_QUAL::bytes() const {
+		return sizeof(FrozenRTree) + m_nodeCount * sizeof(node_type);
+	}
+
+	FROZEN_TREE_TEMPLATE
+		const typename FROZEN_TREE_QUAL::node_type *FROZEN_TREE_QUAL::nodes() const {
+		return m_data;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		size_t FROZEN_TREE_QUAL::nodeCount() const {
+		return m_nodeCount;
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	void FROZEN_TREE_QUAL::queryHierachicalImpl(const node_type *root,
+		const Predicate &predicate,
+		size_t &foundCount, OutIter it) const {
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->level <= m_queryTargetLevel) {
+				// This is a target or lower level node
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->bboxes[index])) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
+
+			count_type index = frame.cursor;
+			for (; index < node->count; ++index) {
+				const bbox_type &nodeBBox = node->bboxes[index];
+				// Branch is fully contained, dont search further
+				if (predicate.bbox.contains(nodeBBox)) {
+					*it = node->values[index];
+					++it;
+					++foundCount;
+				}
+				else if (predicate.bbox.overlaps(nodeBBox))
+					break;
+			}
+
+			if (index < node->count) {
+				// resume after this branch once its subtree is done
+				frame.cursor = index + 1;
+				stack.push(&m_data[node->firstChild + index], 0);
+			}
+			else
+				stack.pop();
+		}
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	void FROZEN_TREE_QUAL::queryImpl(const node_type *root, const Predicate &predicate,
+		size_t &foundCount, OutIter it) const {
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->bboxes[index])) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
+
+			count_type index = frame.cursor;
+			while (index < node->count && !predicate.bbox.overlaps(node->bboxes[index]))
+				++index;
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(&m_data[node->firstChild + index], 0);
+			}
+			else
+				stack.pop();
+		}
+	}
+
+	FROZEN_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	void FROZEN_TREE_QUAL::rayQueryImpl(const node_type *root, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
+		size_t& foundCount, OutIter it) const {
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->values[index]) && node->bboxes[index].template intersectsRay<RealType>(rayOrigin, rayDirection)) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
+
+			count_type index = frame.cursor;
+			while (index < node->count &&
+				!node->bboxes[index].template intersectsRay<RealType>(rayOrigin, rayDirection))
+				++index;
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(&m_data[node->firstChild + index], 0);
+			}
+			else
+				stack.pop();
+		}
+	}
+
+#undef FROZEN_TREE_TEMPLATE
+#undef FROZEN_TREE_QUAL
+
+} // namespace spatial
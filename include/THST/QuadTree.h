@@ -6,6 +6,7 @@
 #pragma once
 
 #include "allocator.h"
+#include "batch.h"
 #include "bbox.h"
 #include "config.h"
 #include "indexable.h"
@@ -201,10 +202,32 @@ namespace spatial {
 			///@note Only used for hierarchical query.
 			void setContainmentFactor(int factor);
 
+			/// Returns true if any value matches, stops at the first one.
 			/// @see spatial::SpatialPredicate for available predicates.
 			template <typename Predicate> bool query(const Predicate &predicate) const;
 			template <typename Predicate, typename OutIter>
 			size_t query(const Predicate &predicate, OutIter out_it) const;
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Runs a query per predicate on a thread pool, the results of the i-th
+			/// predicate are the i-th row of the results.
+			/// @param threadCount zero selects the number of hardware threads.
+			/// @see RTree::parallel_query
+			/// @return Returns the total number of results.
+			template <typename Predicate>
+			size_t parallel_query(const Predicate *predicates, size_t count,
+				BatchResults<ValueType> &results, unsigned threadCount = 0) const;
+#endif
+
+			/// Calls visitor(value, bbox) for each value matching the predicate, the
+			/// traversal stops as soon as the visitor returns false.
+			/// @param nodeVisitor called as nodeVisitor(bbox, level) for each child
+			/// node overlapping the predicate before its values, returns a VisitResult.
+			/// @return Returns false if the traversal was stopped.
+			template <typename Predicate, typename Visitor>
+			bool visit(const Predicate &predicate, Visitor visitor) const;
+			template <typename Predicate, typename Visitor, typename NodeVisitor>
+			bool visit(const Predicate &predicate, Visitor visitor,
+				NodeVisitor nodeVisitor) const;
 
 			/// Remove all entries from tree
 			void clear(bool recursiveCleanup = true);
@@ -394,7 +417,21 @@ namespace spatial {
 	TREE_TEMPLATE
 		template <typename Predicate>
 	bool TREE_QUAL::query(const Predicate &predicate) const {
-		return query(predicate, spatial::detail::dummy_iterator()) > 0;
+		return !visit(predicate, detail::StopAtFirst());
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate, typename Visitor>
+	bool TREE_QUAL::visit(const Predicate &predicate, Visitor visitor) const {
+		return visit(predicate, visitor, detail::VisitAllNodes());
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate, typename Visitor, typename NodeVisitor>
+	bool TREE_QUAL::visit(const Predicate &predicate, Visitor visitor,
+		NodeVisitor nodeVisitor) const {
+		assert(m_root);
+		return m_root->visit(predicate, visitor, nodeVisitor);
 	}
 
 	TREE_TEMPLATE
@@ -404,6 +441,22 @@ namespace spatial {
 		return m_root->query(predicate, m_factor, out_it);
 	}
 
+#ifdef SPATIAL_TREE_USE_CPP11
+	TREE_TEMPLATE
+		template <typename Predicate>
+	size_t TREE_QUAL::parallel_query(const Predicate *predicates, size_t count,
+		BatchResults<ValueType> &results, unsigned threadCount) const {
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+
+		std::vector<size_t> order;
+		detail::predicateOrder<2, T>(predicates, count, order, threadCount);
+		return detail::runBatch(order,
+			[&](size_t query, std::vector<ValueType> &values) {
+			this->query(predicates[query], std::back_inserter(values));
+		}, results, threadCount);
+	}
+#endif
+
 	TREE_TEMPLATE
 		void TREE_QUAL::clear(bool recursiveCleanup /*= true*/) {
 
@@ -6,14 +6,23 @@
 #pragma once
 
 #include "allocator.h"
+#include "batch.h"
 #include "bbox.h"
 #include "config.h"
+#include "frustum.h"
 #include "indexable.h"
+#include "nearest.h"
+#include "parallel.h"
+#include "persistent.h"
 #include "predicates.h"
+#include "ray.h"
+#include "ray_packet.h"
 #include "rtree_detail.h"
+#include "soa_node.h"
 
+#include <functional>
+#include <iterator>
 #include <vector>
-#include <queue>
 
 namespace spatial {
 	namespace rtree {
@@ -22,14 +31,40 @@ namespace spatial {
 		template <typename T> struct RealType { typedef float type; };
 
 		template <> struct RealType<double> { typedef double type; };
-	}
+
+		/// Packing algorithm used for bulk loading.
+		enum PackingMode {
+			eSortTileRecursive = 0, // Tiles of nodes sorted by each axis, good overall packing
+			eHilbertSort            // Nodes ordered by the Hilbert curve, better locality for
+									// clustered data
+		};
+
+		/// Insertion and split policies, see the split_policy of the RTree.
+		/// Guttman's quadratic split.
+		struct quadratic {};
+		/// Guttman's linear split, O(M) seeds picking instead of O(M^2), faster
+		/// insertion for large nodes but with more overlap.
+		struct linear {};
+		/// Ang-Tan linear split, distributes the branches by the closest side of the
+		/// node, evenly balanced splits with less overlap than the Guttman's linear.
+		struct ang_tan {};
+		/// R*-tree insertion, the subtree is chosen by the overlap enlargement, the
+		/// split minimizes the margin of the nodes and on the first overflow of a
+		/// level 30% of the entries are reinserted instead of splitting the node.
+		/// @note Slower insertion, but better queries.
+		struct rstar {};
+	}
+
+	template <typename T, typename ValueType, int Dimension, int max_child_items,
+		typename RealType>
+	class FrozenRTree;
 
 	/**
 	 @class RTree
 	 @brief Implementation of a custom RTree tree based on the version
 	 by Greg Douglas at Auran and original algorithm was by Toni Gutman.
 			R-Trees provide Log(n) speed rectangular indexing into multi-dimensional
-	 data. Only support the quadratric split heuristic.
+	 data. Supports the quadratic, linear, Ang-Tan and R* split heuristics.
 
 			It has the following properties:
 			- hierarchical, you can add values to the internal branch nodes
@@ -50,7 +85,11 @@ namespace spatial {
 	 but worse classification.
 	 @tparam RealType type of element that allows fractional and large
 	 values such as float or double, for use in volume calculations.
-	 @tparam custom_allocator the allocator class
+	 @tparam custom_allocator the allocator class, its value_type selects the node
+	 layout: detail::Node, detail::SoaNode for the SIMD child tests or
+	 detail::CompactNode for less memory
+	 @tparam split_policy the insertion and split algorithm: rtree::quadratic,
+	 rtree::linear, rtree::ang_tan or rtree::rstar
 
 	 @note It's recommended that ValueType should be a fast to copy object, eg: int,
 	 id, obj*, etc.
@@ -64,24 +103,44 @@ namespace spatial {
 		int bbox_volume_mode = box::eNormalVolume,             //
 		typename RealType = typename rtree::RealType<T>::type, //
 		typename custom_allocator = spatial::allocator<detail::Node<
-		ValueType, BoundingBox<T, Dimension>, max_child_items>>>
+		ValueType, BoundingBox<T, Dimension>, max_child_items>>, //
+		typename split_policy = rtree::quadratic>
 		class RTree {
 		public:
+			typedef ValueType value_type;
 			typedef RealType real_type;
 			typedef BoundingBox<T, Dimension> bbox_type;
 			typedef custom_allocator allocator_type;
+			typedef split_policy split_policy_type;
 
 			static const size_t max_items = max_child_items;
 			static const size_t min_items = min_child_items;
 
 		private:
-			typedef detail::Node<ValueType, bbox_type, max_child_items> node_type;
+			// detail::Node or detail::SoaNode
+			typedef typename custom_allocator::value_type node_type;
 			typedef node_type *node_ptr_type;
 			typedef node_type **node_dptr_type;
 			typedef typename node_type::branch_type branch_type;
 			typedef typename node_type::count_type count_type;
 
+			/// Upper bound of the tree height, sizes the traversal stacks.
+			enum { kMaxHeight = detail::MaxTreeHeight<min_child_items>::value };
+			typedef detail::TraversalStack<const node_type *, count_type, kMaxHeight>
+				traversal_stack;
+			typedef detail::TraversalStack<node_ptr_type, count_type, kMaxHeight>
+				mutable_traversal_stack;
+
 		public:
+			/// Scratch buffers of the k nearest search.
+			typedef NearestScratch<const node_type *, RealType> nearest_scratch_type;
+			typedef Ray<RealType, Dimension> ray_type;
+			typedef RayPacket<RealType, Dimension> ray_packet_type;
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Immutable version of the tree which shares its nodes with the writer.
+			typedef std::shared_ptr<const RTree> snapshot_type;
+#endif
+
 			class base_iterator : public detail::Stack<node_type, count_type> {
 			public:
 				/// Returns the depth level of the current branch.
@@ -181,9 +240,54 @@ namespace spatial {
 				friend class RTree;
 			};
 
+			/**
+			 @brief Iterator over the values matching a predicate, found lazily one at
+			 a time in the same order as the query, see qbegin.
+			 @note Doesn't allocate, the tree must not be modified while iterating.
+			 */
+			template <typename Predicate>
+			class query_iterator {
+			public:
+				typedef std::forward_iterator_tag iterator_category;
+				typedef ValueType value_type;
+				typedef ptrdiff_t difference_type;
+				typedef const ValueType *pointer;
+				typedef const ValueType &reference;
+
+				/// Is iterator still valid, ie. not at the end.
+				bool valid() const;
+				/// Access the current value. Caller must be sure iterator is valid.
+				const ValueType &operator*() const;
+				const ValueType *operator->() const;
+				const bbox_type &bbox() const;
+
+				/// Advances to the next match.
+				void next();
+				query_iterator &operator++();
+				query_iterator operator++(int);
+
+				bool operator==(const query_iterator &other) const;
+				bool operator!=(const query_iterator &other) const;
+
+			private:
+				query_iterator(const node_type *root, const Predicate &predicate);
+				explicit query_iterator(const Predicate &predicate);
+
+				/// Finds the next match from the current top of the stack.
+				void seek();
+
+				Predicate m_predicate;
+				/// The cursor of a leaf is the current match, the one of a branch
+				/// the next child to test.
+				traversal_stack m_stack;
+				friend class RTree;
+			};
+
 			RTree(indexable_getter indexable = indexable_getter(),
 				const allocator_type &allocator = allocator_type(),
 				bool allocateRoot = true);
+			/// Creates a packed tree from the given range.
+			/// @see bulk_load
 			template <typename Iter>
 			RTree(Iter first, Iter last,                           //
 				indexable_getter indexable = indexable_getter(), //
@@ -203,11 +307,45 @@ namespace spatial {
 
 			template <typename Iter> void insert(Iter first, Iter last);
 			void insert(const ValueType &value);
+			/// Replaces the contents of the tree with the given values, the tree is
+			/// built bottom-up via the given packing algorithm.
+			/// @note Much faster than the iterative insertion and results in full
+			/// nodes with less overlap, thus better query performance.
+			/// @note With the Hilbert packing the leaves are allocated and traversed
+			/// in the curve order, i.e. neighbouring leaves are spatially close.
+			template <typename Iter>
+			void bulk_load(Iter first, Iter last,
+				rtree::PackingMode packing = rtree::eSortTileRecursive);
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Parallel bulk loading, the input is sorted and the leaves are packed
+			/// on the given number of threads, zero uses all the hardware threads.
+			/// @note The nodes are staged per thread and copied to the allocator
+			/// once packed, thus any allocator can be used. The resulting tree is the
+			/// same as the one of the sequential bulk loading.
+			template <typename Iter>
+			void bulk_load(Iter first, Iter last, rtree::PackingMode packing,
+				unsigned threadCount);
+#endif
 			/// Insert the value if the predicate condition is true.
 			template <typename Predicate>
 			bool insert(const ValueType &value, const Predicate &predicate);
 			bool remove(const ValueType &value);
 
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Publishes the current tree as an immutable snapshot for the readers and
+			/// switches to the persistent mode, where the updates copy the root to
+			/// leaf paths they modify instead of changing the published nodes.
+			/// @note The replaced nodes are deallocated by the following publishes,
+			/// once all the snapshots which can reach them have been released.
+			/// @note The allocator is copied to deallocate the nodes outliving the
+			/// tree, its copies must share the memory.
+			snapshot_type publish();
+			/// Returns the latest published snapshot, null if none.
+			/// @note Safe to call while the writer updates the tree, but only after
+			/// the first publish.
+			snapshot_type snapshot() const;
+#endif
+
 			/// Translates the internal boxes with the given offset point.
 			void translate(const T point[Dimension]);
 
@@ -219,30 +357,188 @@ namespace spatial {
 			/// \return Returns the number of entries found.
 			template <typename Predicate, typename OutIter>
 			size_t hierachical_query(const Predicate &predicate, OutIter out_it) const;
+			/// Frustum culling with the hierarchical values, a branch fully inside the
+			/// frustum is returned without visiting its children.
+			template <int MaxPlanes, typename OutIter>
+			size_t hierachical_query(const Frustum<RealType, Dimension, MaxPlanes> &frustum,
+				OutIter out_it) const;
 			/// Defines the target query level, if 0 then leaf values are retrieved
 			/// otherwise hierarchical node values.
 			/// @note Only used for hierachical_query.
 			void setQueryTargetLevel(int level);
 
+			/// Returns true if any value matches, stops at the first one.
 			/// @see spatial::SpatialPredicate for available predicates.
 			template <typename BoxPredicate> 
 			bool query(const BoxPredicate&predicate) const;
 			template <typename BoxPredicate, typename OutIter>
 			size_t query(const BoxPredicate&predicate, OutIter out_it) const;
+			/// Returns the values whose bbox is not outside the frustum.
+			/// @note The children of a node are tested only against the planes their
+			/// parent straddles, a node fully inside is returned without tests.
+			template <int MaxPlanes, typename OutIter>
+			size_t query(const Frustum<RealType, Dimension, MaxPlanes> &frustum,
+				OutIter out_it) const;
+
+			/// Calls visitor(value, bbox) for each value matching the predicate, the
+			/// traversal stops as soon as the visitor returns false.
+			/// @param nodeVisitor called as nodeVisitor(bbox, level) for each branch
+			/// matching the predicate before its children, returns a VisitResult.
+			/// @return Returns false if the traversal was stopped.
+			template <typename BoxPredicate, typename Visitor>
+			bool visit(const BoxPredicate &predicate, Visitor visitor) const;
+			/// Returns a lazy iterator over the values matching the predicate,
+			/// eg. for(it = qbegin(p); it != qend(p); ++it) or it.valid()/it.next().
+			template <typename BoxPredicate>
+			query_iterator<BoxPredicate> qbegin(const BoxPredicate &predicate) const;
+			/// Returns the end iterator of qbegin(predicate).
+			template <typename BoxPredicate>
+			query_iterator<BoxPredicate> qend(const BoxPredicate &predicate) const;
+			template <typename BoxPredicate, typename Visitor, typename NodeVisitor>
+			bool visit(const BoxPredicate &predicate, Visitor visitor,
+				NodeVisitor nodeVisitor) const;
+			/// Same as visit, but for the values hit by the ray.
+			template <typename Visitor>
+			bool rayVisit(const RealType rayOrigin[Dimension],
+				const RealType rayDirection[Dimension], Visitor visitor) const;
 
 			/// Adds the value if the predicate condition is true.
 			template <typename OutIter, typename Predicate = spatial::detail::AlwayTruePredicate>
 			size_t rayQuery(const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], OutIter out_it, const Predicate& predicate = spatial::detail::AlwayTruePredicate()) const;
 
+			/// Traverses the tree once for all the rays of the packet, calls
+			/// visitor(rayIndex, value) for each object hit by a ray.
+			/// @note The rays of a packet only hit forward within [0, tMax] from
+			/// their origin, like rayCast, whereas rayQuery tests the whole line
+			/// and also returns the objects behind the origin. Otherwise the hits
+			/// of a ray are the ones of rayQuery, in the same order.
+			/// @return Returns the total number of hits.
+			template <typename Visitor>
+			size_t rayPacketQuery(const ray_packet_type &packet, Visitor visitor) const;
+			/// Same as above, but the results are gathered per ray.
+			size_t rayPacketQuery(const ray_packet_type &packet,
+				BatchResults<ValueType> &results) const;
+
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Runs a query per predicate on the thread pool shared by the parallel
+			/// queries, the results of the i-th predicate are the i-th row of the
+			/// results.
+			/// @param threadCount zero selects the number of hardware threads.
+			/// @note The threads take chunks of queries along the Hilbert curve of
+			/// the centers of the predicate boxes, so they visit mostly the same
+			/// nodes.
+			/// @return Returns the total number of results.
+			template <typename Predicate>
+			size_t parallel_query(const Predicate *predicates, size_t count,
+				BatchResults<ValueType> &results, unsigned threadCount = 0) const;
+			/// Same as above, but runs a ray query per origin and direction.
+			/// @param origins, directions arrays of count * Dimension coordinates.
+			size_t parallel_ray_query(const RealType *origins,
+				const RealType *directions, size_t count,
+				BatchResults<ValueType> &results, unsigned threadCount = 0) const;
+			/// Runs a single query on a thread pool, for queries matching a large
+			/// part of the tree.
+			/// The matching nodes are expanded level by level until there are
+			/// enough subtrees to share between the threads, each subtree is
+			/// queried into its own buffer and the buffers are concatenated.
+			/// @param threadCount zero selects the number of hardware threads.
+			/// @note The values are output in the same order as query, the
+			/// subtrees run on the thread pool shared by the parallel queries,
+			/// which isn't worth it for small results.
+			template <typename BoxPredicate, typename OutIter>
+			size_t parallel_query(const BoxPredicate &predicate, OutIter out_it,
+				unsigned threadCount = 0) const;
+#endif
+
+			/// Spatial join, finds all the pairs of overlapping objects of this and
+			/// the other tree, which may have another value type and indexable.
+			/// @note Descends both trees at once, only the node pairs which overlap
+			/// within the common area of their parents are visited.
+			/// @param visitor called as visitor(value, otherValue) for each pair.
+			/// @return Returns the number of pairs.
+			template <class OtherTree, typename Visitor>
+			size_t join_visit(const OtherTree &other, Visitor visitor) const;
+			/// Same as above, but outputs std::pair(value, otherValue).
+			template <class OtherTree, typename OutIter>
+			size_t join(const OtherTree &other, OutIter out_it) const;
+			/// Self join, finds each pair of overlapping objects of the tree once.
+			/// @note Joins each node with itself and with its overlapping siblings.
+			/// @param visitor called as visitor(value, otherValue) for each pair.
+			/// @return Returns the number of pairs.
+			template <typename Visitor>
+			size_t overlapping_pairs(Visitor visitor) const;
+#ifdef SPATIAL_TREE_USE_CPP11
+			/// Parallel self join, the nodes and the node pairs to join are expanded
+			/// from the root until there are several per thread, then they run on
+			/// the thread pool shared by the parallel queries.
+			/// @param threadCount zero selects the number of hardware threads.
+			/// @note The pairs are appended to the vector, their order depends on the
+			/// thread count.
+			size_t overlapping_pairs(std::vector<std::pair<ValueType, ValueType> > &pairs,
+				unsigned threadCount) const;
+#endif
+
+			/// Finds the closest object hit by the ray within tMax, the nodes are
+			/// visited front to back and skipped once they are behind the closest hit.
+			/// @param hit returns the exact distance where the ray hits the given value,
+			/// negative for a miss, and also gets the distance where the ray enters
+			/// the bbox of the value. By default the bbox is the hit.
+			/// @return Returns true if an object was hit, then value and distance are
+			/// set.
+			template <typename HitFunction>
+			bool rayCast(const ray_type &ray, ValueType &value, RealType &distance,
+				const HitFunction &hit,
+				RealType tMax = std::numeric_limits<RealType>::max()) const;
+			bool rayCast(const ray_type &ray, ValueType &value, RealType &distance) const;
+			/// Same as rayCast, but for the closest maxHits objects, which are sorted
+			/// front to back.
+			template <typename OutIter, typename HitFunction>
+			size_t rayCastHits(const ray_type &ray, uint32_t maxHits, OutIter out_it,
+				const HitFunction &hit,
+				RealType tMax = std::numeric_limits<RealType>::max()) const;
+			template <typename OutIter>
+			size_t rayCastHits(const ray_type &ray, uint32_t maxHits, OutIter out_it) const;
+
 			/// Performs a nearest neighbour search.
-			/// @note Uses the distance to the center of the bbox.
+			/// @note Uses the distance to the center of the bbox, only for 2D.
+			/// @see within_distance
 			template <typename OutIter>
 			size_t nearest(const T point[2], T radius, OutIter out_it) const;
 
-			/// Performs a knn-nearest search.
-			/// /// @note Uses the minimum distance to the bbox.
+			/// Returns the objects whose bbox is within the radius of the point.
+			/// @param sorted if true then the results are sorted by increasing
+			/// distance, otherwise they are in the tree order which is faster.
+			/// @note Uses the minimum distance to the bbox.
+			template <typename OutIter>
+			size_t within_distance(const T point[Dimension], RealType radius,
+				OutIter out_it, bool sorted = false) const;
+
+			/// Performs a knn-nearest search, the results are sorted by increasing
+			/// distance.
+			/// @param maxDistance if non negative then only objects within the distance
+			/// are returned.
+			/// @note Uses the minimum distance to the bbox.
+			/// @note Uses a thread local scratch buffer, hence no allocations once
+			/// it has grown to the working size.
+			template <typename OutIter>
+			size_t k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+				RealType maxDistance = -1) const;
+			/// Same as above, but with a caller provided scratch buffer.
 			template <typename OutIter>
-			size_t k_nearest(const T point[Dimension], uint32_t k, OutIter out_it) const;
+			size_t k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+				nearest_scratch_type &scratch, RealType maxDistance = -1) const;
+			/// Performs a knn-nearest search for each of the points.
+			/// @param points array of count * Dimension coordinates.
+			/// @param results receives the results of each query in the order of the
+			/// points, sorted by increasing distance.
+			/// @param threadCount number of threads running the queries, zero
+			/// selects the number of hardware threads, see parallel_query.
+			/// @note The queries are run in the order of the Hilbert curve, so that
+			/// consecutive queries visit mostly the same nodes.
+			/// @return Returns the total number of results.
+			size_t k_nearest_batch(const T *points, size_t count, uint32_t k,
+				BatchResults<ValueType> &results, RealType maxDistance = -1,
+				unsigned threadCount = 1) const;
 
 			/// Remove all entries from tree
 			void clear(bool recursiveCleanup = true);
@@ -264,6 +560,9 @@ namespace spatial {
 			const allocator_type &allocator() const;
 
 			node_iterator root();
+			/// Returns the root node, eg. for custom traversals, its type is the
+			/// value type of the allocator.
+			const node_type *rootNode() const;
 			depth_iterator dbegin();
 			leaf_iterator lbegin();
 
@@ -313,6 +612,16 @@ namespace spatial {
 				const count_type m_minFill;
 			};
 
+			/// Variables for the forced reinsertion of the R* tree
+			struct ReinsertVars {
+				/// Branches removed from overflowing nodes and their level
+				std::vector<std::pair<branch_type, int> > branches;
+				/// Bitmask of the levels which already had an overflow treatment
+				uint32_t overflowedLevels;
+
+				ReinsertVars() : overflowedLevels(0) {}
+			};
+
 			struct BranchDistance {
 				RealType distance;
 				count_type index;
@@ -323,58 +632,98 @@ namespace spatial {
 			};
 
 
-			struct NearestDistance {
-				RealType distance;
-				node_ptr_type node;
-				count_type index;
-
-				NearestDistance(node_ptr_type node, RealType distance, count_type index = 0xFFFFFFF) :
-					node(node), distance(distance), index(index)
-				{
-				}
-
-				bool operator<(const NearestDistance& other) const
-				{
-					return distance > other.distance;
-				}
-
-				bool isLeaf() const
-				{
-					return node->isLeaf();
-				}
-
-				bool isObject() const
-				{
-					return isLeaf() && index != 0xFFFFFFF;
-				}
-
-				const bbox_type& object_bbox() const
-				{
-					assert(isObject());
-					return node->bboxes[index];
-				}
-			};
-
 			template <typename Predicate>
 			bool insertImpl(const branch_type &branch, const Predicate &predicate,
 				int level);
 			template <typename Predicate>
+			bool insertRootImpl(const branch_type &branch, const Predicate &predicate,
+				int level);
+			template <typename Predicate>
 			bool insertRec(const branch_type &branch, const Predicate &predicate,
 				node_type &node, node_ptr_type &newNode, bool &added,
 				int level);
-			void copyRec(const node_ptr_type src, node_ptr_type dst);
+			void copyImpl(const node_type &src, node_type &dst);
+			/// Allocates a node which can be modified until the next publish.
+			node_ptr_type allocateNode(int level) const;
+			/// Returns the node itself if it can be modified, otherwise a copy
+			/// which replaces it, see publish.
+			node_ptr_type writable(node_ptr_type node);
+#ifdef SPATIAL_TREE_USE_CPP11
+			RTree(const RTree &writer, detail::snapshot_tag);
+			/// Deallocates the unpublished nodes of the subtree, the published ones
+			/// are left to the snapshots.
+			void retireNodes(node_ptr_type root);
+			bool findPath(const bbox_type &bbox, const ValueType &value,
+				const node_type *node, count_type *path) const;
+			/// Checks the insert predicate on the node insertRec would add the
+			/// branch to, without modifying the tree.
+			template <typename Predicate>
+			bool checkInsertPath(const bbox_type &bbox, const Predicate &predicate,
+				int level) const;
+			bool checkInsertPath(const bbox_type &bbox,
+				const detail::DummyInsertPredicate &predicate, int level) const;
+#endif
+			bool setRootLevel(int level);
+
+			template <typename Iter>
+			void bulkLoadImpl(Iter first, Iter last, rtree::PackingMode packing,
+				unsigned threadCount);
+			bool packBranches(std::vector<branch_type> &branches,
+				rtree::PackingMode packing, unsigned threadCount);
+#ifdef SPATIAL_TREE_USE_CPP11
+			bool packLeaves(std::vector<branch_type> &branches,
+				rtree::PackingMode packing, unsigned threadCount);
+#endif
+			void sortHilbert(std::vector<branch_type> &branches,
+				unsigned threadCount) const;
+			static size_t tileSlabSize(size_t count, int axis);
+			/// Node source of the packing, allocates the nodes of the tree.
+			struct TreeNodePool {
+				const RTree &tree;
+
+				explicit TreeNodePool(const RTree &tree) : tree(tree) {}
+
+				node_ptr_type allocate(int level) { return tree.allocateNode(level); }
+			};
+			template <class NodePool>
+			void packTiles(branch_type *first, branch_type *last, int axis, int level,
+				std::vector<branch_type> &parents, NodePool &pool) const;
+			template <class NodePool>
+			void packNodes(branch_type *first, branch_type *last, int level,
+				std::vector<branch_type> &parents, NodePool &pool) const;
 
 			count_type pickBranch(const bbox_type &bbox, const node_type &node) const;
+			count_type pickBranch(const bbox_type &bbox, const node_type &node,
+				bool minimizeOverlap) const;
+			template <class Policy>
+			count_type chooseSubtree(const bbox_type &bbox, const node_type &node,
+				Policy) const;
+			count_type chooseSubtree(const bbox_type &bbox, const node_type &node,
+				rtree::quadratic) const;
+			count_type chooseSubtree(const bbox_type &bbox, const node_type &node,
+				rtree::rstar) const;
+			template <class Policy>
+			bool reinsertBranches(node_type &node, const branch_type &branch,
+				Policy) const;
+			bool reinsertBranches(node_type &node, const branch_type &branch,
+				rtree::rstar) const;
 			void getBranches(const node_type &node, const branch_type &branch,
 				BranchVars &branchVars) const;
 			bool addBranch(const branch_type &branch, node_type &node,
 				node_dptr_type newNode) const;
 
+			/// @param partitionVars scratch of the split, m_parVars unless the
+			/// tree is updated concurrently.
 			void splitNode(node_type &node, const branch_type &branch,
-				node_dptr_type newNode) const;
+				node_dptr_type newNode, PartitionVars &partitionVars) const;
 			void loadNodes(node_type &nodeA, node_type &nodeB,
 				const PartitionVars &partitionVars) const;
 			void choosePartition(PartitionVars &partitionVars) const;
+			template <class Policy>
+			void choosePartition(PartitionVars &partitionVars, Policy) const;
+			void choosePartition(PartitionVars &partitionVars, rtree::linear) const;
+			void choosePartition(PartitionVars &partitionVars, rtree::ang_tan) const;
+			void choosePartition(PartitionVars &partitionVars, rtree::rstar) const;
 			void pickSeeds(PartitionVars &partitionVars) const;
 			void classify(count_type index, int group,
 				PartitionVars &partitionVars) const;
@@ -382,27 +731,96 @@ namespace spatial {
 			bool removeImpl(const bbox_type &bbox, const ValueType &value);
 			bool removeRec(const bbox_type &bbox, const ValueType &value,
 				node_ptr_type node, std::vector<node_ptr_type> &reInsertList);
-			void clearRec(const node_ptr_type node);
+			void clearImpl(node_ptr_type node);
 
+			// The traversals use an explicit stack instead of recursion and visit
+			// the nodes in the same order as a recursive descent.
 			template <typename Predicate, typename OutIter>
-			void queryHierachicalRec(node_ptr_type node, const Predicate &predicate,
+			void queryHierachicalImpl(const node_type *root, const Predicate &predicate,
 				size_t &foundCount, OutIter out_it) const;
 
 			template <typename Predicate, typename OutIter>
-			void queryRec(node_ptr_type node, const Predicate &predicate,
-				size_t &foundCount, OutIter out_it) const;
+			void queryImpl(const node_type *root, const Predicate &predicate,
+				size_t &foundCount, OutIter out_it,
+				detail::aos_layout_tag) const;
+			template <typename Predicate, typename OutIter>
+			void queryImpl(const node_type *root, const Predicate &predicate,
+				size_t &foundCount, OutIter out_it,
+				detail::soa_layout_tag) const;
 
 			template <typename Predicate, typename OutIter>
-			void rayQueryRec(node_ptr_type node, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
+			void rayQueryImpl(const node_type *root, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
 				size_t& foundCount, OutIter out_it) const;
 
+			/// Cursor of the nearest traversal, the children overlapping the radius
+			/// sorted by distance and the next one to visit.
+			struct NearestCursor {
+				BranchDistance branches[max_child_items];
+				count_type current;
+				count_type count;
+			};
+			typedef detail::TraversalStack<const node_type *, NearestCursor, kMaxHeight>
+				nearest_traversal_stack;
+
 			template <typename OutIter>
-			void nearestRec(node_ptr_type node, const T point[2], T radius,
+			void nearestImpl(const node_type *root, const T point[2], T radius,
 				size_t &foundCount, OutIter it) const;
+			count_type nearestBranches(const node_type &node, const T point[2],
+				T radius, BranchDistance branches[max_child_items]) const;
+			/// Keeps the closest hit of rayCast.
+			struct ClosestHit {
+				const node_type *node;
+				count_type index;
+				RealType tMax;
+
+				RealType bound() const { return tMax; }
+				bool accepts(RealType t) const { return node ? t < tMax : t <= tMax; }
+				void offer(const node_type *hitNode, count_type hitIndex, RealType t) {
+					node = hitNode;
+					index = hitIndex;
+					tMax = t;
+				}
+			};
+
+			template <typename Visitor>
+			void selfJoinRec(const node_type *node, size_t &foundCount,
+				Visitor &visitor) const;
+			template <class OtherNode, typename Visitor>
+			void joinRec(const node_type *node, const OtherNode *other,
+				const bbox_type &common, size_t &foundCount, Visitor &visitor) const;
+			/// Cursor of the traversals which narrow a mask per level, eg. the
+			/// frustum planes or the active rays.
+			struct MaskCursor {
+				count_type index;
+				uint32_t mask;
+
+				MaskCursor() {}
+				MaskCursor(count_type index, uint32_t mask) : index(index), mask(mask) {}
+			};
+			typedef detail::TraversalStack<const node_type *, MaskCursor, kMaxHeight>
+				mask_traversal_stack;
+
+			template <typename Predicate, typename Visitor, typename NodeVisitor>
+			bool visitImpl(const node_type *root, const Predicate &predicate,
+				Visitor &visitor, NodeVisitor &nodeVisitor) const;
+			template <typename Visitor>
+			bool rayVisitImpl(const node_type *root, const RealType rayOrigin[Dimension],
+				const RealType rayDirection[Dimension], Visitor &visitor) const;
+			template <class FrustumClass, typename OutIter>
+			void frustumImpl(const node_type *root, const FrustumClass &frustum,
+				uint32_t planeMask, bool hierarchical, size_t &foundCount,
+				OutIter &out_it) const;
+			template <typename Visitor>
+			void rayPacketImpl(const node_type *root, const ray_packet_type &packet,
+				uint32_t active, size_t &foundCount, Visitor &visitor) const;
+			template <typename HitFunction, class HitCollector>
+			void rayCastImpl(const node_type *root, const ray_type &ray,
+				const HitFunction &hit, HitCollector &collector) const;
+			template <typename OutIter>
+			void withinDistanceImpl(const node_type *root, const T point[Dimension],
+				RealType radiusSquare, size_t &foundCount, OutIter &out_it) const;
 
-			void translateRec(node_type &node, const T point[Dimension]);
 			size_t countImpl(const node_type &node) const;
-			void countRec(const node_type &node, size_t &count) const;
 
 			inline static RealType distance(const T point0[Dimension], const T point1[Dimension]) {
 
@@ -433,13 +851,28 @@ namespace spatial {
 			indexable_getter m_indexable;
 			mutable allocator_type m_allocator;
 			mutable PartitionVars m_parVars;
+			mutable ReinsertVars m_reinsertVars;
 			size_t m_count;
 			int m_queryTargetLevel;
 			node_ptr_type m_root;
+#ifdef SPATIAL_TREE_USE_CPP11
+			typedef detail::PersistentState<RTree, node_type, allocator_type>
+				persistent_state;
+			/// Set once published, shared with the snapshots.
+			std::shared_ptr<persistent_state> m_persistent;
+#endif
 
 			template <class RTreeClass>
 			friend typename RTreeClass::node_ptr_type &
 				detail::getRootNode(RTreeClass &tree);
+			template <typename, typename, int, int, typename>
+			friend class FrozenRTree;
+			template <typename, typename, int, int, int, typename, int, typename,
+				typename>
+			friend class ConcurrentRTree;
+			template <typename, typename, int, int, int, typename, int, typename,
+				typename, typename>
+			friend class RTree;
 	};
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -448,11 +881,13 @@ namespace spatial {
   template <typename T, typename ValueType, int Dimension,                     \
             int max_child_items, int min_child_items,                          \
             typename indexable_getter, int bbox_volume_mode,                   \
-            typename RealType, typename custom_allocator>
+            typename RealType, typename custom_allocator,                      \
+            typename split_policy>
 
 #define TREE_QUAL                                                              \
   RTree<T, ValueType, Dimension, max_child_items, min_child_items,             \
-        indexable_getter, bbox_volume_mode, RealType, custom_allocator>
+        indexable_getter, bbox_volume_mode, RealType, custom_allocator,    \
+        split_policy>
 
 	TREE_TEMPLATE
 		TREE_QUAL::RTree(indexable_getter indexable /*= indexable_getter()*/,
@@ -472,50 +907,73 @@ namespace spatial {
 		indexable_getter indexable /*= indexable_getter()*/,
 		const allocator_type &allocator /*= allocator_type()*/)
 		: m_indexable(indexable), m_allocator(allocator), m_count(0),
-		m_queryTargetLevel(0) {
+		m_queryTargetLevel(0), m_root(NULL) {
 		SPATIAL_TREE_STATIC_ASSERT((max_child_items > min_child_items),
 			"Invalid child size!");
 		SPATIAL_TREE_STATIC_ASSERT((min_child_items > 0), "Invalid child size!");
 
-		m_root = detail::allocate(m_allocator, 0);
-		// TODO: use packing algorithm
-		insert(first, last);
+		// the root is allocated when clearing the tree
+		bulk_load(first, last);
 	}
 
 	TREE_TEMPLATE
 		TREE_QUAL::RTree(const RTree &src)
 		: m_indexable(src.m_indexable), m_allocator(src.m_allocator),
 		m_count(src.m_count), m_queryTargetLevel(src.m_queryTargetLevel),
-		m_root(detail::allocate(m_allocator, 0)) {
-		copyRec(src.m_root, m_root);
+		m_root(detail::allocate(m_allocator, src.m_root->level)) {
+		copyImpl(*src.m_root, *m_root);
 	}
 
 #ifdef SPATIAL_TREE_USE_CPP11
 	TREE_TEMPLATE
 		TREE_QUAL::RTree(RTree &&src) : m_root(NULL) { swap(src); }
+
+	TREE_TEMPLATE
+		TREE_QUAL::RTree(const RTree &writer, detail::snapshot_tag)
+		: m_indexable(writer.m_indexable), m_allocator(writer.m_allocator),
+		m_count(writer.m_count), m_queryTargetLevel(writer.m_queryTargetLevel),
+		m_root(writer.m_root), m_persistent(writer.m_persistent) {}
 #endif
 
 	TREE_TEMPLATE
 		TREE_QUAL::~RTree() {
+#ifdef SPATIAL_TREE_USE_CPP11
+		if (m_persistent) {
+			// the snapshots don't own their nodes
+			if (m_persistent->writer == this) {
+				retireNodes(m_root);
+				m_persistent->writer = NULL;
+				std::atomic_store(&m_persistent->published, snapshot_type());
+				m_persistent->reclaim(false);
+			}
+			return;
+		}
+#endif
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
 		if (m_root && !m_allocator.overflowed())
 #else
 		if (m_root)
 #endif
-			clearRec(m_root);
+			clearImpl(m_root);
 	}
 
 	TREE_TEMPLATE
 		TREE_QUAL &TREE_QUAL::operator=(const RTree &rhs) {
 		if (&rhs != this) {
+#ifdef SPATIAL_TREE_USE_CPP11
+			// the root may be published, overwritten only once replaced
+			if (m_count > 0 || m_persistent)
+#else
 			if (m_count > 0)
+#endif
 				clear(true);
 
 			m_count = rhs.m_count;
 			m_queryTargetLevel = rhs.m_queryTargetLevel;
+			setRootLevel(rhs.m_root->level);
 			m_allocator = rhs.m_allocator;
 			m_indexable = rhs.m_indexable;
-			copyRec(rhs.m_root, m_root);
+			copyImpl(*rhs.m_root, *m_root);
 		}
 		return *this;
 	}
@@ -540,6 +998,13 @@ namespace spatial {
 		std::swap(m_queryTargetLevel, other.m_queryTargetLevel);
 		std::swap(m_allocator, other.m_allocator);
 		std::swap(m_indexable, other.m_indexable);
+#ifdef SPATIAL_TREE_USE_CPP11
+		std::swap(m_persistent, other.m_persistent);
+		if (m_persistent)
+			m_persistent->writer = this;
+		if (other.m_persistent)
+			other.m_persistent->writer = &other;
+#endif
 	}
 
 	TREE_TEMPLATE
@@ -563,6 +1028,44 @@ namespace spatial {
 		}
 	}
 
+	TREE_TEMPLATE
+		template <typename Iter>
+	void TREE_QUAL::bulk_load(Iter first, Iter last,
+		rtree::PackingMode packing /*= rtree::eSortTileRecursive*/) {
+		bulkLoadImpl(first, last, packing, 1);
+	}
+
+#ifdef SPATIAL_TREE_USE_CPP11
+	TREE_TEMPLATE
+		template <typename Iter>
+	void TREE_QUAL::bulk_load(Iter first, Iter last, rtree::PackingMode packing,
+		unsigned threadCount) {
+		bulkLoadImpl(first, last, packing, detail::resolveThreadCount(threadCount));
+	}
+#endif
+
+	TREE_TEMPLATE
+		template <typename Iter>
+	void TREE_QUAL::bulkLoadImpl(Iter first, Iter last,
+		rtree::PackingMode packing, unsigned threadCount) {
+		clear(true);
+
+		std::vector<branch_type> branches;
+		branch_type branch;
+		branch.child = NULL;
+
+		for (Iter it = first; it != last; ++it) {
+			const ValueType &value = *it;
+			branch.value = value;
+			branch.bbox.set(m_indexable.min(value), m_indexable.max(value));
+			branches.push_back(branch);
+		}
+
+		const size_t count = branches.size();
+		if (packBranches(branches, packing, threadCount))
+			m_count = count;
+	}
+
 	TREE_TEMPLATE
 		void TREE_QUAL::insert(const ValueType &value) {
 		assert(m_root);
@@ -596,7 +1099,32 @@ namespace spatial {
 		void TREE_QUAL::translate(const T point[Dimension]) {
 		assert(m_root);
 
-		translateRec(*m_root, point);
+		// the boxes of a node are translated when it's first visited
+		m_root = writable(m_root);
+		mutable_traversal_stack stack;
+		stack.push(m_root, 0);
+		while (!stack.empty()) {
+			typename mutable_traversal_stack::Frame &frame = stack.top();
+			node_type &node = *frame.node;
+
+			if (frame.cursor == 0) {
+				for (count_type index = 0; index < node.count; ++index) {
+					bbox_type bbox = node.bboxes[index];
+					bbox.translate(point);
+					node.setBBox(index, bbox);
+				}
+			}
+
+			if (node.isBranch() && frame.cursor < node.count) {
+				assert(node.children[frame.cursor] != NULL);
+				node_ptr_type child = node.children[frame.cursor] =
+					writable(node.children[frame.cursor]);
+				++frame.cursor;
+				stack.push(child, 0);
+			}
+			else
+				stack.pop();
+		}
 	}
 
 	TREE_TEMPLATE
@@ -621,210 +1149,605 @@ namespace spatial {
 		template <typename Predicate, typename OutIter>
 	size_t TREE_QUAL::hierachical_query(const Predicate &predicate,
 		OutIter out_it) const {
+		SPATIAL_TREE_STATIC_ASSERT(node_type::has_branch_values,
+			"The branch nodes have no values!");
+
 		size_t foundCount = 0;
-		queryHierachicalRec(m_root, predicate, foundCount, out_it);
+		queryHierachicalImpl(m_root, predicate, foundCount, out_it);
 		return foundCount;
 	}
 
 	TREE_TEMPLATE
-		template <typename Predicate>
-	bool TREE_QUAL::query(const Predicate &predicate) const {
-		return query(predicate, spatial::detail::dummy_iterator()) > 0;
-	}
-
-	TREE_TEMPLATE
-		template <typename Predicate, typename OutIter>
-	size_t TREE_QUAL::query(const Predicate &predicate, OutIter out_it) const {
-
+		template <class OtherTree, typename Visitor>
+	size_t TREE_QUAL::join_visit(const OtherTree &other, Visitor visitor) const {
 		size_t foundCount = 0;
-		queryRec(m_root, predicate, foundCount, out_it);
+		if (!m_root->count || !other.m_root->count)
+			return foundCount;
+		const bbox_type bbox = m_root->cover();
+		const bbox_type otherBBox = other.m_root->cover();
+		if (bbox.overlaps(otherBBox))
+			joinRec(m_root, other.m_root, bbox.intersected(otherBBox), foundCount, visitor);
 		return foundCount;
 	}
 
 	TREE_TEMPLATE
-	template <typename OutIter, typename Predicate>
-	size_t TREE_QUAL::rayQuery(const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], OutIter out_it, const Predicate& predicate) const
-	{
-		size_t foundCount = 0;
-		rayQueryRec(m_root, rayOrigin, rayDirection, predicate, foundCount, out_it);
-		return foundCount;
+		template <class OtherTree, typename OutIter>
+	size_t TREE_QUAL::join(const OtherTree &other, OutIter out_it) const {
+		return join_visit(other,
+			detail::PairWriter<OutIter, ValueType, typename OtherTree::value_type>(out_it));
 	}
 
 	TREE_TEMPLATE
-		template <typename OutIter>
-	size_t TREE_QUAL::nearest(const T point[2], T radius, OutIter out_it) const {
+		template <typename Visitor>
+	size_t TREE_QUAL::overlapping_pairs(Visitor visitor) const {
 		size_t foundCount = 0;
-		nearestRec(m_root, point, radius, foundCount, out_it);
-
+		selfJoinRec(m_root, foundCount, visitor);
 		return foundCount;
 	}
 
+#ifdef SPATIAL_TREE_USE_CPP11
 	TREE_TEMPLATE
-		template <typename OutIter>
-	size_t TREE_QUAL::k_nearest(const T point[Dimension], uint32_t k, OutIter out_it) const {
-		size_t foundCount = 0;
-		
-		// incremental nearest neighbor search
-		std::priority_queue<NearestDistance> queue;
-
-		queue.emplace(m_root, 0);
-		while (!queue.empty())
-		{
-			const NearestDistance element = queue.top();
-			queue.pop();
-			if (element.isObject())
-			{
-				if (!queue.empty() && distance(point, element.object_bbox()) > queue.top().distance)
-				{
-					queue.push(element);
+		size_t TREE_QUAL::overlapping_pairs(
+			std::vector<std::pair<ValueType, ValueType> > &pairs,
+			unsigned threadCount) const {
+		typedef std::pair<ValueType, ValueType> pair_type;
+		typedef std::back_insert_iterator<std::vector<pair_type> > pair_inserter;
+
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+		if (threadCount == 1 || m_root->isLeaf())
+			return overlapping_pairs(detail::PairWriter<pair_inserter, ValueType, ValueType>(
+				std::back_inserter(pairs)));
+
+		// a self join of a node or a join of two nodes within their common area
+		struct Task {
+			const node_type *node;
+			const node_type *other; ///< NULL for a self join
+			bbox_type common;
+		};
+		// amortizes the scheduling, balances the uneven subtrees
+		static const size_t kTasksPerThread = 8;
+		const size_t taskCount = threadCount * kTasksPerThread;
+
+		// split the tasks a level at a time like selfJoinRec and joinRec, until
+		// there are enough of them or only leaves are left
+		Task root = { m_root, NULL, bbox_type() };
+		std::vector<Task> tasks(1, root), level;
+		bool expanded = true;
+		while (expanded && tasks.size() < taskCount) {
+			expanded = false;
+			level.clear();
+			for (size_t index = 0; index < tasks.size(); ++index) {
+				const Task &task = tasks[index];
+				const node_type *node = task.node;
+				const node_type *other = task.other;
+				if (node->isLeaf() && (!other || other->isLeaf())) {
+					level.push_back(task);
+					continue;
 				}
-				else
-				{
-					*out_it = element.node->values[element.index];
-					++out_it;
-					if (++foundCount == k)
-					{
-						break;
+				expanded = true;
+
+				if (!other) {
+					for (count_type i = 0; i < node->count; ++i) {
+						const Task self = { node->children[i], NULL, bbox_type() };
+						level.push_back(self);
+						for (count_type j = i + 1; j < node->count; ++j) {
+							if (!node->bboxes[i].overlaps(node->bboxes[j]))
+								continue;
+							const Task pair = { node->children[i], node->children[j],
+								node->bboxes[i].intersected(node->bboxes[j]) };
+							level.push_back(pair);
+						}
 					}
 				}
-			}
-			else if (element.isLeaf())
-			{
-				for (count_type index = 0; index < element.node->count; ++index)
-				{
-					const bbox_type& bbox = element.node->bboxes[index];
-					RealType d = distance(point, bbox);
-					queue.emplace(element.node, d, index);
+				else if (node->level > other->level) {
+					for (count_type i = 0; i < node->count; ++i) {
+						if (!node->bboxes[i].overlaps(task.common))
+							continue;
+						const Task pair = { node->children[i], other,
+							node->bboxes[i].intersected(task.common) };
+						level.push_back(pair);
+					}
 				}
-			}
-			else
-			{
-				// is a branch
-				for (count_type index = 0; index < element.node->count; ++index)
-				{
-					const bbox_type& bbox = element.node->bboxes[index];
-					RealType d = distance(point, bbox);
-					queue.emplace(element.node->children[index], d);
+				else if (other->level > node->level) {
+					for (count_type j = 0; j < other->count; ++j) {
+						if (!other->bboxes[j].overlaps(task.common))
+							continue;
+						const Task pair = { node, other->children[j],
+							other->bboxes[j].intersected(task.common) };
+						level.push_back(pair);
+					}
+				}
+				else {
+					for (count_type j = 0; j < other->count; ++j) {
+						const bbox_type &otherBBox = other->bboxes[j];
+						if (!otherBBox.overlaps(task.common))
+							continue;
+						for (count_type i = 0; i < node->count; ++i) {
+							const bbox_type &bbox = node->bboxes[i];
+							if (!bbox.overlaps(task.common) || !bbox.overlaps(otherBBox))
+								continue;
+							const Task pair = { node->children[i], other->children[j],
+								bbox.intersected(otherBBox) };
+							level.push_back(pair);
+						}
+					}
 				}
 			}
+			tasks.swap(level);
 		}
 
+		std::vector<std::vector<pair_type> > threadPairs(threadCount);
+		detail::sharedThreadPool().run(tasks.size(), [&](size_t index, unsigned thread) {
+			size_t foundCount = 0;
+			detail::PairWriter<pair_inserter, ValueType, ValueType> writer(
+				std::back_inserter(threadPairs[thread]));
+			const Task &task = tasks[index];
+			if (!task.other)
+				selfJoinRec(task.node, foundCount, writer);
+			else
+				joinRec(task.node, task.other, task.common, foundCount, writer);
+		}, threadCount);
+
+		size_t foundCount = 0;
+		for (size_t thread = 0; thread < threadPairs.size(); ++thread) {
+			pairs.insert(pairs.end(), threadPairs[thread].begin(), threadPairs[thread].end());
+			foundCount += threadPairs[thread].size();
+		}
 		return foundCount;
 	}
+#endif
 
 	TREE_TEMPLATE
-		void TREE_QUAL::setQueryTargetLevel(int level) { m_queryTargetLevel = level; }
-
-	TREE_TEMPLATE
-		size_t TREE_QUAL::count() const {
-		assert(m_root);
-		assert(m_count == countImpl(*m_root));
+		template <int MaxPlanes, typename OutIter>
+	size_t TREE_QUAL::hierachical_query(
+		const Frustum<RealType, Dimension, MaxPlanes> &frustum, OutIter out_it) const {
+		SPATIAL_TREE_STATIC_ASSERT(node_type::has_branch_values,
+			"The branch nodes have no values!");
 
-		return m_count;
+		size_t foundCount = 0;
+		frustumImpl(m_root, frustum, frustum.planeMask(), true, foundCount, out_it);
+		return foundCount;
 	}
 
 	TREE_TEMPLATE
-		size_t TREE_QUAL::bytes(bool estimate /*= true*/) const {
-		size_t size = sizeof(RTree);
-
-		if (!m_count)
-			return size;
-
-		if (estimate)
-			return size + nodeCount(count()) * sizeof(node_type);
-
-		depth_iterator it = const_cast<RTree &>(*this).dbegin();
-		size_t n = 0;
-		for (; !it.isNull(); ++it) {
-			++n;
-		}
-
-		return size + n * sizeof(node_type);
+		template <int MaxPlanes, typename OutIter>
+	size_t TREE_QUAL::query(const Frustum<RealType, Dimension, MaxPlanes> &frustum,
+		OutIter out_it) const {
+		size_t foundCount = 0;
+		frustumImpl(m_root, frustum, frustum.planeMask(), false, foundCount, out_it);
+		return foundCount;
 	}
 
 	TREE_TEMPLATE
-		size_t TREE_QUAL::nodeCount(size_t numberOfItems) {
-		const double k = min_child_items;
-		const double invK1 = 1.0 / (k - 1.0);
-
-		const double depth = levels(numberOfItems);
-		// perfectly balanced k-ary tree formula
-		double count = std::pow(k, depth + 1.0) - 1;
-		count *= invK1;
-		return std::max(count * 0.5, 1.0);
+		template <typename Predicate>
+	bool TREE_QUAL::query(const Predicate &predicate) const {
+		return !visit(predicate, detail::StopAtFirst());
 	}
 
 	TREE_TEMPLATE
-		size_t TREE_QUAL::branchCount(size_t numberOfItems) {
-		size_t count = nodeCount(numberOfItems) *
-			(min_child_items + max_child_items / min_child_items);
-		return count;
+		template <typename Predicate, typename Visitor>
+	bool TREE_QUAL::visit(const Predicate &predicate, Visitor visitor) const {
+		return visit(predicate, visitor, detail::VisitAllNodes());
 	}
 
 	TREE_TEMPLATE
-		size_t TREE_QUAL::levels() const {
-		assert(m_root);
-		return m_root->level;
+		template <typename Predicate, typename Visitor, typename NodeVisitor>
+	bool TREE_QUAL::visit(const Predicate &predicate, Visitor visitor,
+		NodeVisitor nodeVisitor) const {
+		return visitImpl(m_root, predicate, visitor, nodeVisitor);
 	}
 
 	TREE_TEMPLATE
-		double TREE_QUAL::levels(size_t numberOfItems) {
-		static const double invLog = 1 / std::log(min_child_items);
-		const double depth = std::log(numberOfItems) * invLog - 1;
-		return depth;
+		template <typename Visitor>
+	bool TREE_QUAL::rayVisit(const RealType rayOrigin[Dimension],
+		const RealType rayDirection[Dimension], Visitor visitor) const {
+		return rayVisitImpl(m_root, rayOrigin, rayDirection, visitor);
 	}
 
 	TREE_TEMPLATE
-		typename TREE_QUAL::bbox_type TREE_QUAL::bbox() const {
-		assert(m_root);
-		return m_root->cover();
+		template <typename Predicate>
+	typename TREE_QUAL::template query_iterator<Predicate>
+		TREE_QUAL::qbegin(const Predicate &predicate) const {
+		return query_iterator<Predicate>(m_root, predicate);
 	}
 
 	TREE_TEMPLATE
-		typename TREE_QUAL::allocator_type &TREE_QUAL::allocator() {
-		return m_allocator;
+		template <typename Predicate>
+	typename TREE_QUAL::template query_iterator<Predicate>
+		TREE_QUAL::qend(const Predicate &predicate) const {
+		return query_iterator<Predicate>(predicate);
 	}
 
 	TREE_TEMPLATE
-		const typename TREE_QUAL::allocator_type &TREE_QUAL::allocator() const {
-		return m_allocator;
-	}
+		template <typename Predicate, typename OutIter>
+	size_t TREE_QUAL::query(const Predicate &predicate, OutIter out_it) const {
 
-	TREE_TEMPLATE
-		void TREE_QUAL::countRec(const node_type &node, size_t &count) const {
-		if (node.isBranch()) // not a leaf node
-		{
-			for (count_type index = 0; index < node.count; ++index) {
-				assert(node.children[index] != NULL);
-				countRec(*node.children[index], count);
-			}
-		}
-		else // A leaf node
-		{
-			count += node.count;
-		}
+		size_t foundCount = 0;
+		queryImpl(m_root, predicate, foundCount, out_it,
+			typename node_type::layout_tag());
+		return foundCount;
 	}
 
 	TREE_TEMPLATE
-		void TREE_QUAL::translateRec(node_type &node, const T point[Dimension]) {
-		for (count_type index = 0; index < node.count; ++index) {
-			node.bboxes[index].translate(point);
+	template <typename OutIter, typename Predicate>
+	size_t TREE_QUAL::rayQuery(const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], OutIter out_it, const Predicate& predicate) const
+	{
+		size_t foundCount = 0;
+		rayQueryImpl(m_root, rayOrigin, rayDirection, predicate, foundCount, out_it);
+		return foundCount;
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter>
+	size_t TREE_QUAL::nearest(const T point[2], T radius, OutIter out_it) const {
+		size_t foundCount = 0;
+		nearestImpl(m_root, point, radius, foundCount, out_it);
+
+		return foundCount;
+	}
+
+	TREE_TEMPLATE
+		template <typename Visitor>
+	size_t TREE_QUAL::rayPacketQuery(const ray_packet_type &packet,
+		Visitor visitor) const {
+		size_t foundCount = 0;
+		if (packet.count)
+			rayPacketImpl(m_root, packet, uint32_t(0xFFFFFFFFu >> (32 - packet.count)),
+				foundCount, visitor);
+		return foundCount;
+	}
+
+#ifdef SPATIAL_TREE_USE_CPP11
+	TREE_TEMPLATE
+		template <typename Predicate>
+	size_t TREE_QUAL::parallel_query(const Predicate *predicates, size_t count,
+		BatchResults<ValueType> &results, unsigned threadCount) const {
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+
+		std::vector<size_t> order;
+		detail::predicateOrder<Dimension, T>(predicates, count, order, threadCount);
+		return detail::runBatch(order,
+			[&](size_t query, std::vector<ValueType> &values) {
+			this->query(predicates[query], std::back_inserter(values));
+		}, results, threadCount);
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::parallel_ray_query(const RealType *origins,
+			const RealType *directions, size_t count,
+			BatchResults<ValueType> &results, unsigned threadCount) const {
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+
+		std::vector<size_t> order;
+		detail::hilbertOrder<Dimension>(origins, count, order, threadCount);
+		return detail::runBatch(order,
+			[&](size_t query, std::vector<ValueType> &values) {
+			rayQuery(origins + query * Dimension, directions + query * Dimension,
+				std::back_inserter(values));
+		}, results, threadCount);
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	size_t TREE_QUAL::parallel_query(const Predicate &predicate, OutIter out_it,
+		unsigned threadCount) const {
+		// subtrees per thread, balances the uneven subtrees
+		static const size_t kTasksPerThread = 8;
+
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+		const size_t taskCount = threadCount * kTasksPerThread;
+
+		// a whole level at a time, so the order of the subtrees is the one of
+		// the sequential traversal
+		std::vector<const node_type *> subtrees(1, m_root), level;
+		while (threadCount > 1 && subtrees.size() < taskCount &&
+			subtrees.front()->isBranch()) {
+			level.clear();
+			for (size_t task = 0; task < subtrees.size(); ++task) {
+				const node_type &node = *subtrees[task];
+				for (count_type index = 0; index < node.count; ++index) {
+					if (predicate.bbox.overlaps(node.bboxes[index]))
+						level.push_back(node.children[index]);
+				}
+			}
+			subtrees.swap(level);
+			if (subtrees.empty())
+				return 0;
 		}
 
-		if (node.isBranch()) // not a leaf node
-		{
-			for (count_type index = 0; index < node.count; ++index) {
-				assert(node.children[index] != NULL);
-				translateRec(*node.children[index], point);
+		size_t foundCount = 0;
+		if (threadCount <= 1 || subtrees.size() <= 1) {
+			for (size_t task = 0; task < subtrees.size(); ++task)
+				queryImpl(subtrees[task], predicate, foundCount, out_it,
+					typename node_type::layout_tag());
+			return foundCount;
+		}
+
+		std::vector<std::vector<ValueType> > buffers(subtrees.size());
+		detail::sharedThreadPool().run(subtrees.size(), [&](size_t task, unsigned) {
+			size_t count = 0;
+			queryImpl(subtrees[task], predicate, count,
+				std::back_inserter(buffers[task]), typename node_type::layout_tag());
+		}, threadCount);
+
+		for (size_t task = 0; task < buffers.size(); ++task) {
+			out_it = std::copy(buffers[task].begin(), buffers[task].end(), out_it);
+			foundCount += buffers[task].size();
+		}
+		return foundCount;
+	}
+#endif
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::rayPacketQuery(const ray_packet_type &packet,
+			BatchResults<ValueType> &results) const {
+		// gathered in traversal order, then bucketed per ray
+		std::vector<std::pair<uint32_t, ValueType> > hits;
+		rayPacketQuery(packet, detail::HitGatherer<ValueType>(hits));
+
+		results.offsets.assign(packet.count + 1, 0);
+		for (size_t index = 0; index < hits.size(); ++index)
+			++results.offsets[hits[index].first + 1];
+		for (uint32_t ray = 0; ray < packet.count; ++ray)
+			results.offsets[ray + 1] += results.offsets[ray];
+
+		std::vector<size_t> cursors(results.offsets.begin(), results.offsets.end() - 1);
+		results.values.resize(hits.size());
+		for (size_t index = 0; index < hits.size(); ++index)
+			results.values[cursors[hits[index].first]++] = hits[index].second;
+		return hits.size();
+	}
+
+	TREE_TEMPLATE
+		template <typename HitFunction>
+	bool TREE_QUAL::rayCast(const ray_type &ray, ValueType &value,
+		RealType &distance, const HitFunction &hit, RealType tMax) const {
+		ClosestHit collector = { NULL, 0, tMax };
+		rayCastImpl(m_root, ray, hit, collector);
+		if (!collector.node)
+			return false;
+
+		value = collector.node->values[collector.index];
+		distance = collector.tMax;
+		return true;
+	}
+
+	TREE_TEMPLATE
+		bool TREE_QUAL::rayCast(const ray_type &ray, ValueType &value,
+			RealType &distance) const {
+		return rayCast(ray, value, distance, detail::BoxHit());
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter, typename HitFunction>
+	size_t TREE_QUAL::rayCastHits(const ray_type &ray, uint32_t maxHits,
+		OutIter out_it, const HitFunction &hit, RealType tMax) const {
+		if (!maxHits)
+			return 0;
+
+		// not the thread local one, the hit function may run other queries
+		nearest_scratch_type collector;
+		collector.start(maxHits, tMax);
+		rayCastImpl(m_root, ray, hit, collector);
+
+		const std::vector<typename nearest_scratch_type::Entry> &results = collector.results();
+		for (size_t index = 0; index < results.size(); ++index) {
+			*out_it = results[index].node->values[results[index].index];
+			++out_it;
+		}
+		return results.size();
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter>
+	size_t TREE_QUAL::rayCastHits(const ray_type &ray, uint32_t maxHits,
+		OutIter out_it) const {
+		return rayCastHits(ray, maxHits, out_it, detail::BoxHit());
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter>
+	size_t TREE_QUAL::within_distance(const T point[Dimension], RealType radius,
+		OutIter out_it, bool sorted /*= false*/) const {
+		if (radius < 0)
+			return 0;
+		if (sorted) {
+			// a knn search without a limit on the count
+			return k_nearest(point, std::numeric_limits<uint32_t>::max(), out_it, radius);
+		}
+
+		size_t foundCount = 0;
+		withinDistanceImpl(m_root, point, detail::squaredMaxDistance(radius),
+			foundCount, out_it);
+		return foundCount;
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter>
+	size_t TREE_QUAL::k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+		RealType maxDistance /*= -1*/) const {
+#ifdef SPATIAL_TREE_USE_CPP11
+		static thread_local nearest_scratch_type scratch;
+#else
+		nearest_scratch_type scratch;
+#endif
+		return k_nearest(point, k, out_it, scratch, maxDistance);
+	}
+
+	TREE_TEMPLATE
+		template <typename OutIter>
+	size_t TREE_QUAL::k_nearest(const T point[Dimension], uint32_t k, OutIter out_it,
+		nearest_scratch_type &scratch, RealType maxDistance /*= -1*/) const {
+		if (!k)
+			return 0;
+
+		// best-first search, the k best objects bound the visited nodes
+		scratch.start(k, detail::squaredMaxDistance(maxDistance));
+		scratch.pushNode(m_root, 0);
+		const node_type *node;
+		while (scratch.popNode(node)) {
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index)
+					scratch.offer(node, index, distance(point, node->bboxes[index]));
+			}
+			else {
+				for (count_type index = 0; index < node->count; ++index)
+					scratch.pushNode(node->children[index], distance(point, node->bboxes[index]));
 			}
 		}
-		// A leaf node
+
+		const std::vector<typename nearest_scratch_type::Entry> &results = scratch.results();
+		for (size_t index = 0; index < results.size(); ++index) {
+			*out_it = results[index].node->values[results[index].index];
+			++out_it;
+		}
+		return results.size();
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::k_nearest_batch(const T *points, size_t count, uint32_t k,
+			BatchResults<ValueType> &results, RealType maxDistance /*= -1*/,
+			unsigned threadCount /*= 1*/) const {
+#ifdef SPATIAL_TREE_USE_CPP11
+		threadCount = detail::sharedThreadPool().threadCount(threadCount);
+		if (threadCount > 1) {
+			std::vector<size_t> order;
+			detail::hilbertOrder<Dimension>(points, count, order, threadCount);
+			return detail::runBatch(order,
+				[&](size_t query, std::vector<ValueType> &values) {
+				k_nearest(points + query * Dimension, k, std::back_inserter(values),
+					maxDistance);
+			}, results, threadCount);
+		}
+#else
+		(void)threadCount;
+#endif
+
+		std::vector<std::pair<uint64_t, size_t> > keys;
+		detail::hilbertKeys<Dimension>(points, count, keys);
+		std::sort(keys.begin(), keys.end());
+
+		// the rows are appended in the Hilbert order, then copied in query order
+		std::vector<ValueType> values;
+		std::vector<size_t> begins(count);
+		results.offsets.assign(count + 1, 0);
+		for (size_t index = 0; index < count; ++index) {
+			const size_t query = keys[index].second;
+			begins[query] = values.size();
+			results.offsets[query + 1] = k_nearest(points + query * Dimension, k,
+				std::back_inserter(values), maxDistance);
+		}
+
+		results.values.clear();
+		results.values.reserve(values.size());
+		for (size_t query = 0; query < count; ++query) {
+			const size_t found = results.offsets[query + 1];
+			results.values.insert(results.values.end(), values.begin() + begins[query],
+				values.begin() + begins[query] + found);
+			results.offsets[query + 1] = results.offsets[query] + found;
+		}
+		return results.offsets[count];
+	}
+
+	TREE_TEMPLATE
+		void TREE_QUAL::setQueryTargetLevel(int level) { m_queryTargetLevel = level; }
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::count() const {
+		assert(m_root);
+		assert(m_count == countImpl(*m_root));
+
+		return m_count;
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::bytes(bool estimate /*= true*/) const {
+		size_t size = sizeof(RTree);
+
+		if (!m_count)
+			return size;
+
+		if (estimate)
+			return size + nodeCount(count()) * sizeof(node_type);
+
+		depth_iterator it = const_cast<RTree &>(*this).dbegin();
+		size_t n = 0;
+		for (; !it.isNull(); ++it) {
+			++n;
+		}
+
+		return size + n * sizeof(node_type);
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::nodeCount(size_t numberOfItems) {
+		const double k = min_child_items;
+		const double invK1 = 1.0 / (k - 1.0);
+
+		const double depth = levels(numberOfItems);
+		// perfectly balanced k-ary tree formula
+		double count = std::pow(k, depth + 1.0) - 1;
+		count *= invK1;
+		return std::max(count * 0.5, 1.0);
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::branchCount(size_t numberOfItems) {
+		size_t count = nodeCount(numberOfItems) *
+			(min_child_items + max_child_items / min_child_items);
+		return count;
+	}
+
+	TREE_TEMPLATE
+		size_t TREE_QUAL::levels() const {
+		assert(m_root);
+		return m_root->level;
+	}
+
+	TREE_TEMPLATE
+		double TREE_QUAL::levels(size_t numberOfItems) {
+		static const double invLog = 1 / std::log(min_child_items);
+		const double depth = std::log(numberOfItems) * invLog - 1;
+		return depth;
+	}
+
+	TREE_TEMPLATE
+		typename TREE_QUAL::bbox_type TREE_QUAL::bbox() const {
+		assert(m_root);
+		return m_root->cover();
+	}
+
+	TREE_TEMPLATE
+		typename TREE_QUAL::allocator_type &TREE_QUAL::allocator() {
+		return m_allocator;
+	}
+
+	TREE_TEMPLATE
+		const typename TREE_QUAL::allocator_type &TREE_QUAL::allocator() const {
+		return m_allocator;
 	}
 
 	TREE_TEMPLATE
 		size_t TREE_QUAL::countImpl(const node_type &node) const {
 		size_t count = 0;
-		countRec(node, count);
+
+		traversal_stack stack;
+		stack.push(&node, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *current = frame.node;
+
+			if (current->isLeaf()) {
+				count += current->count;
+				stack.pop();
+			}
+			else if (frame.cursor < current->count) {
+				assert(current->children[frame.cursor] != NULL);
+				stack.push(current->children[frame.cursor++], 0);
+			}
+			else
+				stack.pop();
+		}
 		return count;
 	}
 
@@ -836,25 +1759,41 @@ namespace spatial {
 			recursiveCleanup &= !m_allocator.overflowed();
 #endif
 
+#ifdef SPATIAL_TREE_USE_CPP11
+		if (m_persistent) {
+			retireNodes(m_root);
+			m_root = allocateNode(0);
+			m_count = 0;
+			return;
+		}
+#endif
 		if (recursiveCleanup && m_root)
-			clearRec(m_root);
+			clearImpl(m_root);
 
 		m_root = detail::allocate(m_allocator, 0);
 		m_count = 0;
 	}
 
 	TREE_TEMPLATE
-		void TREE_QUAL::clearRec(const node_ptr_type node) {
+		void TREE_QUAL::clearImpl(node_ptr_type node) {
 		assert(node);
 		assert(node->level >= 0);
 
-		if (node->isBranch()) // This is an internal node in the tree
-		{
-			for (count_type index = 0; index < node->count; ++index) {
-				clearRec(node->children[index]);
+		// the children are deallocated before their parent
+		mutable_traversal_stack stack;
+		stack.push(node, 0);
+		while (!stack.empty()) {
+			typename mutable_traversal_stack::Frame &frame = stack.top();
+			node_ptr_type current = frame.node;
+
+			if (current->isBranch() && frame.cursor < current->count) {
+				stack.push(current->children[frame.cursor++], 0);
+			}
+			else {
+				stack.pop();
+				detail::deallocate(m_allocator, current);
 			}
 		}
-		detail::deallocate(m_allocator, node);
 	}
 
 	// Inserts a new data rectangle into the index structure.
@@ -880,25 +1819,29 @@ namespace spatial {
 			node_ptr_type otherNode = NULL;
 
 			// find the optimal branch for this record
-			const count_type index = pickBranch(branch.bbox, node);
+			const count_type index = chooseSubtree(branch.bbox, node, split_policy());
 
 			// recursively insert this record into the picked branch
 			assert(node.children[index]);
+			node.children[index] = writable(node.children[index]);
 			bool childWasSplit = insertRec(branch, predicate, *node.children[index],
 				otherNode, added, level);
 
 			if (!childWasSplit) {
 				// Child was not split. Merge the bounding box of the new record with the
 				// existing bounding box
-				if (added)
-					node.bboxes[index] = branch.bbox.extended(node.bboxes[index]);
+				if (!m_reinsertVars.branches.empty())
+					// branches were removed for reinsertion, the child might have shrunk
+					node.setBBox(index, node.children[index]->cover());
+				else if (added)
+					node.setBBox(index, branch.bbox.extended(node.bboxes[index]));
 				return false;
 			}
 			else if (otherNode) {
 				// Child was split. The old branches are now re-partitioned to two nodes
 				// so we have to re-calculate the bounding boxes of each node
-				node.bboxes[index] = node.children[index]->cover();
-				branch_type branch;
+				node.setBBox(index, node.children[index]->cover());
+				branch_type branch = branch_type();
 				branch.child = otherNode;
 				branch.bbox = otherNode->cover();
 
@@ -938,6 +1881,24 @@ namespace spatial {
 	TREE_TEMPLATE
 		template <typename Predicate>
 	bool TREE_QUAL::insertImpl(const branch_type &branch,
+		const Predicate &predicate, int level) {
+		const bool added = insertRootImpl(branch, predicate, level);
+
+		// R* forced reinsertion, the branches closest to the center of their old
+		// node are reinserted first
+		while (!m_reinsertVars.branches.empty()) {
+			const std::pair<branch_type, int> reinserted = m_reinsertVars.branches.back();
+			m_reinsertVars.branches.pop_back();
+			insertRootImpl(reinserted.first, spatial::detail::DummyInsertPredicate(),
+				reinserted.second);
+		}
+		m_reinsertVars.overflowedLevels = 0;
+		return added;
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	bool TREE_QUAL::insertRootImpl(const branch_type &branch,
 		const Predicate &predicate, int level) {
 		assert(m_root);
 		assert(level >= 0 && level <= m_root->level);
@@ -947,9 +1908,16 @@ namespace spatial {
 		}
 #endif
 
+#ifdef SPATIAL_TREE_USE_CPP11
+		// a rejected insert mustn't copy the published path
+		if (m_persistent && !checkInsertPath(branch.bbox, predicate, level))
+			return false;
+#endif
+
 		node_ptr_type newNode = NULL;
 		bool added = true;
 
+		m_root = writable(m_root);
 		// Check if root was split
 		if (insertRec(branch, predicate, *m_root, newNode, added, level)) {
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
@@ -958,9 +1926,9 @@ namespace spatial {
 #endif
 
 			// Grow tree taller and new root
-			node_ptr_type newRoot = detail::allocate(m_allocator, m_root->level + 1);
+			node_ptr_type newRoot = allocateNode(m_root->level + 1);
 
-			branch_type branch;
+			branch_type branch = branch_type();
 			// add old root node as a child of the new root
 			branch.bbox = m_root->cover();
 			branch.child = m_root;
@@ -977,16 +1945,389 @@ namespace spatial {
 	}
 
 	TREE_TEMPLATE
-		void TREE_QUAL::copyRec(const node_ptr_type src, node_ptr_type dst) {
-		*dst = *src;
-		for (count_type index = 0; index < src->count; ++index) {
-			const node_ptr_type srcCurrent = src->children[index];
-			if (srcCurrent) {
-				node_ptr_type dstCurrent = dst->children[index] =
-					detail::allocate(m_allocator, srcCurrent->level);
-				copyRec(srcCurrent, dstCurrent);
+		void TREE_QUAL::copyImpl(const node_type &src, node_type &dst) {
+		// A copied node still points to the source children, they are replaced
+		// by their copies as the traversal descends.
+		dst = src;
+
+		mutable_traversal_stack stack;
+		stack.push(&dst, 0);
+		while (!stack.empty()) {
+			typename mutable_traversal_stack::Frame &frame = stack.top();
+			node_type &current = *frame.node;
+
+			if (current.isLeaf() || frame.cursor == current.count) {
+				stack.pop();
+				continue;
+			}
+
+			const count_type index = frame.cursor++;
+			const node_ptr_type srcChild = current.children[index];
+			if (srcChild) {
+				node_ptr_type dstChild = current.children[index] =
+					allocateNode(srcChild->level);
+				*dstChild = *srcChild;
+				stack.push(dstChild, 0);
+			}
+		}
+	}
+
+	TREE_TEMPLATE
+		typename TREE_QUAL::node_ptr_type TREE_QUAL::allocateNode(int level) const {
+		node_ptr_type node = detail::allocate(m_allocator, level);
+#ifdef SPATIAL_TREE_USE_CPP11
+		if (m_persistent && node)
+			m_persistent->owned.insert(node);
+#endif
+		return node;
+	}
+
+	TREE_TEMPLATE
+		typename TREE_QUAL::node_ptr_type TREE_QUAL::writable(node_ptr_type node) {
+#ifdef SPATIAL_TREE_USE_CPP11
+		if (m_persistent && !m_persistent->isOwned(node)) {
+			// published, replace it by a copy
+			node_ptr_type copy = allocateNode(node->level);
+			*copy = *node;
+			m_persistent->retire(node);
+			return copy;
+		}
+#endif
+		return node;
+	}
+
+#ifdef SPATIAL_TREE_USE_CPP11
+	TREE_TEMPLATE
+		typename TREE_QUAL::snapshot_type TREE_QUAL::publish() {
+		if (!m_persistent)
+			m_persistent = std::make_shared<persistent_state>(this, m_allocator);
+
+		persistent_state &state = *m_persistent;
+		// all the current nodes become shared
+		state.owned.clear();
+
+		typename persistent_state::Epoch epoch;
+		epoch.released = std::make_shared<std::atomic<bool> >(false);
+		detail::SnapshotDeleter<RTree> deleter = { epoch.released };
+		const snapshot_type version(new RTree(*this, detail::snapshot_tag()), deleter);
+		state.epochs.push_back(epoch);
+		std::atomic_store(&state.published, version);
+
+		state.reclaim(false);
+		return version;
+	}
+
+	TREE_TEMPLATE
+		typename TREE_QUAL::snapshot_type TREE_QUAL::snapshot() const {
+		if (!m_persistent)
+			return snapshot_type();
+		return std::atomic_load(&m_persistent->published);
+	}
+
+	TREE_TEMPLATE
+		void TREE_QUAL::retireNodes(node_ptr_type root) {
+		persistent_state &state = *m_persistent;
+
+		mutable_traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename mutable_traversal_stack::Frame &frame = stack.top();
+			node_ptr_type node = frame.node;
+
+			if (!state.isOwned(node)) {
+				// published, the whole subtree is shared with the snapshots
+				state.epochs.back().subtrees.push_back(node);
+				stack.pop();
+			}
+			else if (node->isBranch() && frame.cursor < node->count) {
+				stack.push(node->children[frame.cursor++], 0);
+			}
+			else {
+				stack.pop();
+				detail::deallocate(m_allocator, node);
+			}
+		}
+	}
+
+	// Finds the value in the same order as removeRec, the path receives the
+	// index of the child taken at each level.
+	TREE_TEMPLATE
+		bool TREE_QUAL::findPath(const bbox_type &bbox, const ValueType &value,
+			const node_type *node, count_type *path) const {
+		if (node->isLeaf()) {
+			for (count_type index = 0; index < node->count; ++index) {
+				if (node->values[index] == value)
+					return true;
+			}
+			return false;
+		}
+
+		for (count_type index = 0; index < node->count; ++index) {
+			if (bbox.overlaps(node->bboxes[index]) &&
+				findPath(bbox, value, node->children[index], path)) {
+				path[node->level] = index;
+				return true;
 			}
 		}
+		return false;
+	}
+
+	// Follows the subtrees chosen by insertRec down to the insertion level.
+	TREE_TEMPLATE
+		template <typename Predicate>
+	bool TREE_QUAL::checkInsertPath(const bbox_type &bbox,
+		const Predicate &predicate, int level) const {
+		const node_type *node = m_root;
+		while (node->level > level)
+			node = node->children[chooseSubtree(bbox, *node, split_policy())];
+		return detail::checkInsertPredicate(predicate, *node);
+	}
+
+	TREE_TEMPLATE
+		bool TREE_QUAL::checkInsertPath(const bbox_type & /*bbox*/,
+			const detail::DummyInsertPredicate & /*predicate*/, int /*level*/) const {
+		return true;
+	}
+#endif
+
+	// Packs the branches level by level until they fit into the root node.
+	// Returns false if the allocator has overflowed, the tree is left empty.
+	TREE_TEMPLATE
+		bool TREE_QUAL::packBranches(std::vector<branch_type> &branches,
+			rtree::PackingMode packing, unsigned threadCount) {
+		assert(m_root && m_root->count == 0);
+
+		int level = 0;
+#ifdef SPATIAL_TREE_USE_CPP11
+		// the leaves hold most of the items, the upper levels are packed sequentially
+		if (threadCount > 1 && branches.size() > max_child_items) {
+			if (!packLeaves(branches, packing, threadCount))
+				return false;
+			level = 1;
+		}
+#endif
+
+		// the parents of consecutive nodes keep the curve order, only sort once
+		if (level == 0 && packing == rtree::eHilbertSort &&
+			branches.size() > max_child_items)
+			sortHilbert(branches, threadCount);
+
+		TreeNodePool pool(*this);
+		std::vector<branch_type> parents;
+		while (branches.size() > max_child_items) {
+			parents.clear();
+			parents.reserve(branches.size() / max_child_items + 1);
+			branch_type *first = &branches[0];
+			if (packing == rtree::eHilbertSort)
+				packNodes(first, first + branches.size(), level, parents, pool);
+			else
+				packTiles(first, first + branches.size(), 0, level, parents, pool);
+
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+			if (allocator_type::is_overflowable && m_allocator.overflowed())
+				return false;
+#endif
+			branches.swap(parents);
+			++level;
+		}
+
+		// reuse the empty root for the top level
+		if (!setRootLevel(level))
+			return false;
+		for (size_t index = 0; index < branches.size(); ++index) {
+			m_root->addBranch(branches[index]);
+		}
+		return true;
+	}
+
+	// Sets the level of the empty root, the level sized nodes are reallocated.
+	// Returns false if the allocator has overflowed.
+	TREE_TEMPLATE
+		bool TREE_QUAL::setRootLevel(int level) {
+		assert(m_root && m_root->count == 0);
+
+		if (node_type::is_level_sized && m_root->level != level) {
+			node_ptr_type root = allocateNode(level);
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+			if (allocator_type::is_overflowable && !root)
+				return false;
+#endif
+			detail::deallocate(m_allocator, m_root);
+			m_root = root;
+		}
+		m_root->level = level;
+		return true;
+	}
+
+#ifdef SPATIAL_TREE_USE_CPP11
+	// Packs the leaf level by splitting the sorted branches in ranges which
+	// follow the node or slab boundaries of the sequential packing, each range
+	// is packed on a worker thread in its own staging pool.
+	TREE_TEMPLATE
+		bool TREE_QUAL::packLeaves(std::vector<branch_type> &branches,
+			rtree::PackingMode packing, unsigned threadCount) {
+		// with a single axis the tiles are consecutive nodes
+		const bool tiled = packing != rtree::eHilbertSort && Dimension > 1;
+		if (packing == rtree::eHilbertSort)
+			sortHilbert(branches, threadCount);
+
+		const size_t count = branches.size();
+		branch_type *first = &branches[0];
+
+		// ends of the ranges which are packed independently
+		std::vector<size_t> ends;
+		if (tiled) {
+			detail::parallel_sort(first, first + count,
+				detail::BranchCenterCompare<branch_type>(0), threadCount);
+
+			const size_t slabSize = tileSlabSize(count, 0);
+			for (size_t slab = 0; slab < count;) {
+				slab = (count - slab < slabSize + max_child_items) ? count
+					: slab + slabSize;
+				ends.push_back(slab);
+			}
+		} else {
+			if (packing != rtree::eHilbertSort)
+				detail::parallel_sort(first, first + count,
+					detail::BranchCenterCompare<branch_type>(0), threadCount);
+
+			const size_t nodeCount = (count + max_child_items - 1) / max_child_items;
+			for (unsigned index = 1; index <= threadCount; ++index) {
+				const size_t end = std::min(
+					count, (nodeCount * index / threadCount) * max_child_items);
+				if (end > (ends.empty() ? 0 : ends.back()))
+					ends.push_back(end);
+			}
+		}
+
+		// each thread gets consecutive ranges, thus the order is kept
+		std::vector<detail::StagingNodePool<node_type> > pools(threadCount);
+		std::vector<std::vector<branch_type> > parents(threadCount);
+		detail::parallel_for(ends.size(), threadCount,
+			[&](size_t begin, size_t end, unsigned thread) {
+			for (size_t range = begin; range < end; ++range) {
+				branch_type *rangeFirst = first + (range ? ends[range - 1] : 0);
+				branch_type *rangeLast = first + ends[range];
+				if (tiled)
+					packTiles(rangeFirst, rangeLast, 1, 0, parents[thread], pools[thread]);
+				else
+					packNodes(rangeFirst, rangeLast, 0, parents[thread], pools[thread]);
+			}
+		});
+
+		// copy the staged leaves to the allocator in the packing order
+		std::vector<branch_type> leaves;
+		leaves.reserve(count / max_child_items + threadCount);
+		for (unsigned thread = 0; thread < threadCount; ++thread) {
+			for (size_t index = 0; index < parents[thread].size(); ++index) {
+				branch_type parent = parents[thread][index];
+				node_ptr_type node = allocateNode(0);
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+				if (allocator_type::is_overflowable && !node)
+					return false;
+#endif
+				*node = *parent.child;
+				parent.child = node;
+				leaves.push_back(parent);
+			}
+			pools[thread].nodes.clear();
+		}
+		branches.swap(leaves);
+		return true;
+	}
+#endif
+
+	// Sorts the branches by the Hilbert index of their bbox centers, the centers
+	// are quantized on a grid covering all of the centers.
+	TREE_TEMPLATE
+		void TREE_QUAL::sortHilbert(std::vector<branch_type> &branches,
+			unsigned threadCount) const {
+		typedef std::pair<uint64_t, size_t> key_type;
+
+		std::vector<T> centers(branches.size() * Dimension);
+		for (size_t index = 0; index < branches.size(); ++index)
+			branches[index].bbox.center(&centers[index * Dimension]);
+
+		std::vector<key_type> keys;
+		detail::hilbertKeys<Dimension>(centers.empty() ? NULL : &centers[0],
+			branches.size(), keys);
+#ifdef SPATIAL_TREE_USE_CPP11
+		detail::parallel_sort(keys.begin(), keys.end(), std::less<key_type>(),
+			threadCount);
+#else
+		(void)threadCount;
+		std::sort(keys.begin(), keys.end());
+#endif
+
+		std::vector<branch_type> sorted;
+		sorted.reserve(branches.size());
+		for (size_t index = 0; index < keys.size(); ++index) {
+			sorted.push_back(branches[keys[index].second]);
+		}
+		branches.swap(sorted);
+	}
+
+	// Sorts the branches by the center of the given axis and slices them into
+	// vertical slabs of about S = ceil(P^(1/(Dimension - axis))) nodes each,
+	// where P is the number of nodes needed, then recurses into the next axis.
+	TREE_TEMPLATE
+		size_t TREE_QUAL::tileSlabSize(size_t count, int axis) {
+		const size_t nodeCount = (count + max_child_items - 1) / max_child_items;
+		const size_t slabCount = (size_t)std::ceil(
+			std::pow((double)nodeCount, 1.0 / (double)(Dimension - axis)));
+		return max_child_items * ((nodeCount + slabCount - 1) / slabCount);
+	}
+
+	TREE_TEMPLATE
+		template <class NodePool>
+	void TREE_QUAL::packTiles(branch_type *first, branch_type *last, int axis,
+		int level, std::vector<branch_type> &parents, NodePool &pool) const {
+		std::sort(first, last, detail::BranchCenterCompare<branch_type>(axis));
+		if (axis + 1 >= Dimension) {
+			packNodes(first, last, level, parents, pool);
+			return;
+		}
+
+		const size_t slabSize = tileSlabSize(last - first, axis);
+		for (branch_type *slab = first; slab < last;) {
+			// the leftover of the last slab is merged to avoid underfilled nodes
+			branch_type *slabEnd = ((size_t)(last - slab) < slabSize + max_child_items)
+				? last
+				: slab + slabSize;
+			packTiles(slab, slabEnd, axis + 1, level, parents, pool);
+			slab = slabEnd;
+		}
+	}
+
+	// Packs consecutive runs of max_child_items branches into new nodes.
+	TREE_TEMPLATE
+		template <class NodePool>
+	void TREE_QUAL::packNodes(branch_type *first, branch_type *last, int level,
+		std::vector<branch_type> &parents, NodePool &pool) const {
+		branch_type parent = branch_type();
+
+		size_t remaining = last - first;
+		while (remaining > 0) {
+			size_t fill = std::min(remaining, (size_t)max_child_items);
+			// balance the last two nodes so the last one is not underfilled
+			if (remaining > max_child_items &&
+				remaining - max_child_items < (size_t)min_child_items)
+				fill = remaining / 2;
+
+			node_ptr_type node = pool.allocate(level);
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+			if (allocator_type::is_overflowable && !node)
+				return;
+#endif
+			for (size_t index = 0; index < fill; ++index) {
+				node->addBranch(*first++);
+			}
+
+			parent.child = node;
+			parent.bbox = node->cover();
+			parents.push_back(parent);
+			remaining -= fill;
+		}
 	}
 
 	// Add a branch to a node.  Split the node if necessary.
@@ -1001,7 +2342,10 @@ namespace spatial {
 		}
 
 		assert(newNode);
-		splitNode(node, branch, newNode);
+		// the R* tree first tries to reinsert some of the branches
+		if (reinsertBranches(node, branch, split_policy()))
+			return false;
+		splitNode(node, branch, newNode, m_parVars);
 
 		return true;
 	}
@@ -1042,28 +2386,147 @@ namespace spatial {
 		return best;
 	}
 
+	// Guttman's ChooseLeaf, the branch needing the least enlargement.
+	TREE_TEMPLATE
+		template <class Policy>
+	typename TREE_QUAL::count_type
+		TREE_QUAL::chooseSubtree(const bbox_type &bbox, const node_type &node,
+			Policy) const {
+		return pickBranch(bbox, node, false);
+	}
+
+	// The quadratic split keeps its original branch choice.
+	TREE_TEMPLATE
+		typename TREE_QUAL::count_type
+		TREE_QUAL::chooseSubtree(const bbox_type &bbox, const node_type &node,
+			rtree::quadratic) const {
+		return pickBranch(bbox, node);
+	}
+
+	// R* ChooseSubtree, minimizes the overlap for the nodes pointing to leaves.
+	TREE_TEMPLATE
+		typename TREE_QUAL::count_type
+		TREE_QUAL::chooseSubtree(const bbox_type &bbox, const node_type &node,
+			rtree::rstar) const {
+		return pickBranch(bbox, node, node.level == 1);
+	}
+
+	// Pick the child whose overlap with its siblings needs the smallest increase,
+	// if minimizing the overlap, otherwise the one that needs the smallest
+	// increase in volume. Ties are resolved by the smallest volume increase and
+	// then by the smallest volume.
+	TREE_TEMPLATE
+		typename TREE_QUAL::count_type
+		TREE_QUAL::pickBranch(const bbox_type &bbox, const node_type &node,
+			bool minimizeOverlap) const {
+		assert(node.count);
+
+		count_type best = 0;
+		real_type bestOverlap = 0, bestIncrease = 0, bestArea = 0;
+		for (count_type index = 0; index < node.count; ++index) {
+			const bbox_type &currentBBox = node.bboxes[index];
+			const bbox_type extendedBBox = bbox.extended(currentBBox);
+			const real_type area = currentBBox.template volume<bbox_volume_mode, RealType>();
+			const real_type increase =
+				extendedBBox.template volume<bbox_volume_mode, RealType>() - area;
+
+			real_type overlap = 0;
+			if (minimizeOverlap) {
+				for (count_type other = 0; other < node.count; ++other) {
+					if (other == index)
+						continue;
+					const bbox_type &otherBBox = node.bboxes[other];
+					overlap +=
+						extendedBBox.template overlap<bbox_volume_mode, RealType>(otherBBox) -
+						currentBBox.template overlap<bbox_volume_mode, RealType>(otherBBox);
+				}
+			}
+
+			if (index == 0 || overlap < bestOverlap ||
+				(overlap == bestOverlap &&
+				(increase < bestIncrease ||
+					(increase == bestIncrease && area < bestArea)))) {
+				best = index;
+				bestOverlap = overlap;
+				bestIncrease = increase;
+				bestArea = area;
+			}
+		}
+		return best;
+	}
+
+	TREE_TEMPLATE
+		template <class Policy>
+	bool TREE_QUAL::reinsertBranches(node_type & /*node*/,
+		const branch_type & /*branch*/, Policy) const {
+		return false;
+	}
+
+	// R* OverflowTreatment. On the first overflow of a level, except for the
+	// root, the branches farthest from the center of the node are removed and
+	// queued for reinsertion, instead of splitting the node.
+	// Returns false if the node must be split.
+	TREE_TEMPLATE
+		bool TREE_QUAL::reinsertBranches(node_type &node, const branch_type &branch,
+			rtree::rstar) const {
+		const uint32_t levelMask = 1u << std::min(node.level, 31);
+		if (&node == m_root || (m_reinsertVars.overflowedLevels & levelMask))
+			return false;
+		m_reinsertVars.overflowedLevels |= levelMask;
+
+		getBranches(node, branch, m_parVars);
+
+		T center[Dimension];
+		m_parVars.coverSplit.center(center);
+		BranchDistance distances[max_child_items + 1];
+		for (count_type index = 0; index < max_child_items + 1; ++index) {
+			T branchCenter[Dimension];
+			m_parVars.branches[index].bbox.center(branchCenter);
+			distances[index].distance = distance(center, branchCenter);
+			distances[index].index = index;
+		}
+		std::sort(distances, distances + max_child_items + 1);
+
+		// 30% as recommended by the paper, without underfilling the node
+		count_type reinsertCount = std::max(max_child_items * 3 / 10, 1);
+		reinsertCount = std::min(reinsertCount,
+			(count_type)(max_child_items + 1 - min_child_items));
+		const count_type keepCount = max_child_items + 1 - reinsertCount;
+
+		node.count = 0;
+		for (count_type index = 0; index < keepCount; ++index) {
+			node.addBranch(m_parVars.branches[distances[index].index]);
+		}
+		// queue the farthest first, as the closest are reinserted first
+		for (count_type index = max_child_items + 1; index-- > keepCount;) {
+			m_reinsertVars.branches.push_back(std::make_pair(
+				m_parVars.branches[distances[index].index], (int)node.level));
+		}
+		return true;
+	}
+
 	// Split a node.
 	// Divides the nodes branches and the extra one between two nodes.
 	// Old node is one of the new ones, and one really new one is created.
 	// Tries more than one method for choosing a partition, uses best result.
 	TREE_TEMPLATE
 		void TREE_QUAL::splitNode(node_type &node, const branch_type &branch,
-			node_dptr_type newNodePtr) const {
+			node_dptr_type newNodePtr, PartitionVars &partitionVars) const {
 		assert(newNodePtr);
 		node_ptr_type &newNode = *newNodePtr;
 
 		// Could just use local here, but member or external is faster since it is
 		// reused
-		m_parVars.clear();
+		partitionVars.clear();
 
 		// Load all the branches into a buffer, initialize old node
-		getBranches(node, branch, m_parVars);
+		getBranches(node, branch, partitionVars);
 
 		// Find partition
-		choosePartition(m_parVars);
+		choosePartition(partitionVars, split_policy());
 
 		// Create a new node to hold (about) half of the branches
-		newNode = detail::allocate(m_allocator, node.level);
+		newNode = allocateNode(node.level);
 
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
 		if (allocator_type::is_overflowable && !newNode)
@@ -1073,9 +2536,9 @@ namespace spatial {
 		assert(newNode);
 		// Put branches from buffer into 2 nodes according to the chosen partition
 		node.count = 0;
-		loadNodes(node, *newNode, m_parVars);
+		loadNodes(node, *newNode, partitionVars);
 
-		assert((node.count + newNode->count) == m_parVars.maxFill());
+		assert((node.count + newNode->count) == partitionVars.maxFill());
 	}
 
 	// Load branch buffer with branches from full node plus the extra branch.
@@ -1085,11 +2548,8 @@ namespace spatial {
 		assert(node.count == max_child_items);
 
 		// Load the branch buffer
-		for (size_t index = 0; index < max_child_items; ++index) {
-			branch_type &branch = branchVars.branches[index];
-			branch.bbox = node.bboxes[index];
-			branch.value = node.values[index];
-			branch.child = node.children[index];
+		for (count_type index = 0; index < max_child_items; ++index) {
+			node.getBranch(index, branchVars.branches[index]);
 		}
 		branchVars.branches[max_child_items] = branch;
 
@@ -1116,8 +2576,8 @@ namespace spatial {
 	TREE_TEMPLATE
 		void TREE_QUAL::choosePartition(PartitionVars &partitionVars) const {
 		real_type biggestDiff;
-		count_type chosen;
-		int group, betterGroup;
+		count_type chosen = 0;
+		int group, betterGroup = 0;
 
 		pickSeeds(partitionVars);
 
@@ -1174,7 +2634,251 @@ namespace spatial {
 			}
 		}
 
-		assert(partitionVars.totalCount() == partitionVars.maxFill());
+		assert(partitionVars.totalCount() == partitionVars.maxFill());
+		assert((partitionVars.count[0] >= partitionVars.minFill()) &&
+			(partitionVars.count[1] >= partitionVars.minFill()));
+	}
+
+	TREE_TEMPLATE
+		template <class Policy>
+	void TREE_QUAL::choosePartition(PartitionVars &partitionVars, Policy) const {
+		choosePartition(partitionVars);
+	}
+
+	// Linear split, Guttman's LinearPickSeeds. Along each axis find the branch
+	// with the highest low side and the one with the lowest high side, the pair
+	// with the greatest separation normalized by the width of the set are the
+	// seeds. The remaining branches are assigned in order to the group that needs
+	// the least enlargement.
+	TREE_TEMPLATE
+		void TREE_QUAL::choosePartition(PartitionVars &partitionVars,
+			rtree::linear) const {
+		const count_type total = partitionVars.maxFill();
+		const bbox_type &cover = partitionVars.coverSplit;
+
+		count_type seed0 = 0, seed1 = 1;
+		real_type bestSeparation = 0;
+		bool found = false;
+		for (int axis = 0; axis < Dimension; ++axis) {
+			count_type highestLow = 0, lowestHigh = 0;
+			for (count_type index = 1; index < total; ++index) {
+				const bbox_type &bbox = partitionVars.branches[index].bbox;
+				if (bbox.min[axis] > partitionVars.branches[highestLow].bbox.min[axis])
+					highestLow = index;
+				if (bbox.max[axis] < partitionVars.branches[lowestHigh].bbox.max[axis])
+					lowestHigh = index;
+			}
+			if (highestLow == lowestHigh)
+				continue;
+
+			real_type separation =
+				(real_type)(partitionVars.branches[highestLow].bbox.min[axis] -
+					partitionVars.branches[lowestHigh].bbox.max[axis]);
+			const real_type width = (real_type)(cover.max[axis] - cover.min[axis]);
+			if (width > 0)
+				separation /= width;
+			if (!found || separation > bestSeparation) {
+				found = true;
+				bestSeparation = separation;
+				seed0 = lowestHigh;
+				seed1 = highestLow;
+			}
+		}
+
+		classify(seed0, 0, partitionVars);
+		classify(seed1, 1, partitionVars);
+
+		for (count_type index = 0; index < total; ++index) {
+			if (PartitionVars::ePartitionUnused != partitionVars.partitions[index])
+				continue;
+
+			// a group has to take all the remaining to reach the minimum fill
+			const count_type remaining = total - partitionVars.totalCount();
+			int group;
+			if (partitionVars.count[0] + remaining <= partitionVars.minFill()) {
+				group = 0;
+			}
+			else if (partitionVars.count[1] + remaining <= partitionVars.minFill()) {
+				group = 1;
+			}
+			else {
+				const bbox_type &bbox = partitionVars.branches[index].bbox;
+				const real_type growth0 =
+					bbox.extended(partitionVars.cover[0]).template volume<bbox_volume_mode, RealType>() -
+					partitionVars.area[0];
+				const real_type growth1 =
+					bbox.extended(partitionVars.cover[1]).template volume<bbox_volume_mode, RealType>() -
+					partitionVars.area[1];
+				if (growth0 != growth1)
+					group = growth0 < growth1 ? 0 : 1;
+				else if (partitionVars.area[0] != partitionVars.area[1])
+					group = partitionVars.area[0] < partitionVars.area[1] ? 0 : 1;
+				else
+					group = partitionVars.count[0] <= partitionVars.count[1] ? 0 : 1;
+			}
+			classify(index, group, partitionVars);
+		}
+
+		assert(partitionVars.totalCount() == partitionVars.maxFill());
+		assert((partitionVars.count[0] >= partitionVars.minFill()) &&
+			(partitionVars.count[1] >= partitionVars.minFill()));
+	}
+
+	// Ang-Tan linear split. Along each axis the branches closer to the lower side
+	// of the node go to the first group and the others to the second one. The
+	// axis with the most even distribution is chosen, ties are resolved by the
+	// smallest overlap and then by the smallest volume of the groups.
+	// An underfilled group takes the branches of the other group closest to it.
+	TREE_TEMPLATE
+		void TREE_QUAL::choosePartition(PartitionVars &partitionVars,
+			rtree::ang_tan) const {
+		const count_type total = partitionVars.maxFill();
+		const bbox_type &cover = partitionVars.coverSplit;
+
+		int bestAxis = 0;
+		count_type bestMaxCount = 0;
+		real_type bestOverlap = 0, bestArea = 0;
+		for (int axis = 0; axis < Dimension; ++axis) {
+			count_type counts[2] = { 0, 0 };
+			bbox_type covers[2];
+			for (count_type index = 0; index < total; ++index) {
+				const bbox_type &bbox = partitionVars.branches[index].bbox;
+				const int group =
+					(bbox.min[axis] - cover.min[axis]) < (cover.max[axis] - bbox.max[axis]) ? 0 : 1;
+				covers[group] = counts[group] ? covers[group].extended(bbox) : bbox;
+				++counts[group];
+			}
+
+			const count_type maxCount = std::max(counts[0], counts[1]);
+			real_type overlap = 0, area = 0;
+			for (int group = 0; group < 2; ++group) {
+				if (counts[group])
+					area += covers[group].template volume<bbox_volume_mode, RealType>();
+			}
+			if (counts[0] && counts[1])
+				overlap = covers[0].template overlap<bbox_volume_mode, RealType>(covers[1]);
+
+			if (axis == 0 || maxCount < bestMaxCount ||
+				(maxCount == bestMaxCount &&
+				(overlap < bestOverlap || (overlap == bestOverlap && area < bestArea)))) {
+				bestAxis = axis;
+				bestMaxCount = maxCount;
+				bestOverlap = overlap;
+				bestArea = area;
+			}
+		}
+
+		int groups[max_child_items + 1];
+		count_type counts[2] = { 0, 0 };
+		for (count_type index = 0; index < total; ++index) {
+			const bbox_type &bbox = partitionVars.branches[index].bbox;
+			groups[index] = (bbox.min[bestAxis] - cover.min[bestAxis]) <
+				(cover.max[bestAxis] - bbox.max[bestAxis])
+				? 0
+				: 1;
+			++counts[groups[index]];
+		}
+
+		const int underfilled = counts[0] < partitionVars.minFill()
+			? 0
+			: (counts[1] < partitionVars.minFill() ? 1 : -1);
+		if (underfilled >= 0) {
+			// order by the side facing the underfilled group
+			count_type order[max_child_items + 1];
+			for (count_type index = 0; index < total; ++index)
+				order[index] = index;
+			std::sort(order, order + total,
+				detail::BranchBoundCompare<branch_type>(partitionVars.branches, bestAxis,
+					underfilled == 1));
+			for (count_type step = 0;
+				step < total && counts[underfilled] < partitionVars.minFill(); ++step) {
+				const count_type index = underfilled == 0 ? order[step] : order[total - 1 - step];
+				if (groups[index] == underfilled)
+					continue;
+				groups[index] = underfilled;
+				++counts[underfilled];
+				--counts[1 - underfilled];
+			}
+		}
+
+		for (count_type index = 0; index < total; ++index) {
+			classify(index, groups[index], partitionVars);
+		}
+		assert((partitionVars.count[0] >= partitionVars.minFill()) &&
+			(partitionVars.count[1] >= partitionVars.minFill()));
+	}
+
+	// R* split. The split axis is the one with the minimum sum of the margins
+	// of all the distributions, where the branches are sorted by their lower and
+	// then by their upper bounds. Along it the distribution with the minimum
+	// overlap is chosen, ties are resolved by the minimum volume.
+	TREE_TEMPLATE
+		void TREE_QUAL::choosePartition(PartitionVars &partitionVars,
+			rtree::rstar) const {
+		const count_type total = partitionVars.maxFill();
+		const count_type minFill = partitionVars.minFill();
+		assert(2 * minFill <= total);
+
+		count_type order[max_child_items + 1];
+		count_type axisOrder[max_child_items + 1];
+		count_type bestOrder[max_child_items + 1];
+		// covers of the first index + 1 branches and of the branches from index on
+		bbox_type lowerCovers[max_child_items + 1];
+		bbox_type upperCovers[max_child_items + 1];
+
+		count_type bestSplit = minFill;
+		real_type bestMarginSum = 0;
+		for (int axis = 0; axis < Dimension; ++axis) {
+			count_type axisSplit = minFill;
+			real_type marginSum = 0, axisOverlap = 0, axisArea = 0;
+			for (int bound = 0; bound < 2; ++bound) {
+				for (count_type index = 0; index < total; ++index)
+					order[index] = index;
+				std::sort(order, order + total,
+					detail::BranchBoundCompare<branch_type>(partitionVars.branches, axis,
+						bound == 1));
+
+				lowerCovers[0] = partitionVars.branches[order[0]].bbox;
+				for (count_type index = 1; index < total; ++index) {
+					lowerCovers[index] =
+						lowerCovers[index - 1].extended(partitionVars.branches[order[index]].bbox);
+				}
+				upperCovers[total - 1] = partitionVars.branches[order[total - 1]].bbox;
+				for (count_type index = total - 1; index-- > 0;) {
+					upperCovers[index] =
+						upperCovers[index + 1].extended(partitionVars.branches[order[index]].bbox);
+				}
+
+				for (count_type split = minFill; split <= total - minFill; ++split) {
+					const bbox_type &first = lowerCovers[split - 1];
+					const bbox_type &second = upperCovers[split];
+					marginSum += first.template margin<RealType>() +
+						second.template margin<RealType>();
+
+					const real_type overlap =
+						first.template overlap<bbox_volume_mode, RealType>(second);
+					const real_type area = first.template volume<bbox_volume_mode, RealType>() +
+						second.template volume<bbox_volume_mode, RealType>();
+					if ((bound == 0 && split == minFill) || overlap < axisOverlap ||
+						(overlap == axisOverlap && area < axisArea)) {
+						axisOverlap = overlap;
+						axisArea = area;
+						axisSplit = split;
+						std::copy(order, order + total, axisOrder);
+					}
+				}
+			}
+
+			if (axis == 0 || marginSum < bestMarginSum) {
+				bestMarginSum = marginSum;
+				bestSplit = axisSplit;
+				std::copy(axisOrder, axisOrder + total, bestOrder);
+			}
+		}
+
+		for (count_type index = 0; index < total; ++index) {
+			classify(bestOrder[index], index < bestSplit ? 0 : 1, partitionVars);
+		}
 		assert((partitionVars.count[0] >= partitionVars.minFill()) &&
 			(partitionVars.count[1] >= partitionVars.minFill()));
 	}
@@ -1200,7 +2904,7 @@ namespace spatial {
 
 	TREE_TEMPLATE
 		void TREE_QUAL::pickSeeds(PartitionVars &partitionVars) const {
-		count_type seed0, seed1;
+		count_type seed0 = 0, seed1 = 1;
 		real_type worst, waste;
 		real_type area[max_child_items + 1];
 
@@ -1262,6 +2966,21 @@ namespace spatial {
 		bool TREE_QUAL::removeImpl(const bbox_type &bbox, const ValueType &value) {
 		assert(m_root);
 
+#ifdef SPATIAL_TREE_USE_CPP11
+		if (m_persistent) {
+			// copy the path to the value before removing it
+			count_type path[kMaxHeight];
+			if (!findPath(bbox, value, m_root, path))
+				return false;
+
+			node_ptr_type node = m_root = writable(m_root);
+			while (node->isBranch()) {
+				const count_type index = path[node->level];
+				node = node->children[index] = writable(node->children[index]);
+			}
+		}
+#endif
+
 		std::vector<node_ptr_type> reInsertList;
 		if (removeRec(bbox, value, m_root, reInsertList)) {
 			// Found and deleted a data item
@@ -1271,12 +2990,10 @@ namespace spatial {
 
 				for (count_type index = 0; index < tempNode->count; ++index) {
 					branch_type branch;
-					branch.bbox = tempNode->bboxes[index];
-					branch.value = tempNode->values[index];
-					branch.child = tempNode->children[index];
+					tempNode->getBranch(index, branch);
 					insertImpl(branch, spatial::detail::DummyInsertPredicate(), tempNode->level);
 				}
-				m_allocator.deallocate(tempNode);
+				detail::deallocate(m_allocator, tempNode);
 			}
 
 			// Check for redundant root (not leaf, 1 child) and eliminate TODO replace
@@ -1285,7 +3002,7 @@ namespace spatial {
 				node_ptr_type tempNode = m_root->children[0];
 
 				assert(tempNode);
-				m_allocator.deallocate(m_root);
+				detail::deallocate(m_allocator, m_root);
 				m_root = tempNode;
 			}
 			return true;
@@ -1316,7 +3033,7 @@ namespace spatial {
 				if (removeRec(bbox, value, currentNode, reInsertList)) {
 					if (currentNode->count >= min_child_items) {
 						// child removed, just resize parent bbox
-						node->bboxes[index] = currentNode->cover();
+						node->setBBox(index, currentNode->cover());
 					}
 					else {
 						// child removed, not enough entries in node, eliminate node
@@ -1344,24 +3061,33 @@ namespace spatial {
 	// bbox.
 	TREE_TEMPLATE
 		template <typename Predicate, typename OutIter>
-	void TREE_QUAL::queryHierachicalRec(node_ptr_type node,
+	void TREE_QUAL::queryHierachicalImpl(const node_type *root,
 		const Predicate &predicate,
 		size_t &foundCount, OutIter it) const {
-		assert(node);
-		assert(node->level >= 0);
-
-		if (node->level <= m_queryTargetLevel) {
-			// This is a target or lower level node
-			for (count_type index = 0; index < node->count; ++index) {
-				if (predicate(node->bboxes[index])) {
-					*it = node->values[index];
-					++it;
-					++foundCount;
+		assert(root);
+		assert(root->level >= 0);
+
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->level <= m_queryTargetLevel) {
+				// This is a target or lower level node
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->bboxes[index])) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
 				}
+				stack.pop();
+				continue;
 			}
-		}
-		else {
-			for (count_type index = 0; index < node->count; ++index) {
+
+			count_type index = frame.cursor;
+			for (; index < node->count; ++index) {
 				const bbox_type &nodeBBox = node->bboxes[index];
 				// Branch is fully contained, dont search further
 				if (predicate.bbox.contains(nodeBBox)) {
@@ -1369,145 +3095,549 @@ namespace spatial {
 					++it;
 					++foundCount;
 				}
-				else if (predicate.bbox.overlaps(nodeBBox)) {
-					queryHierachicalRec(node->children[index], predicate, foundCount, it);
-				}
+				else if (predicate.bbox.overlaps(nodeBBox))
+					break;
+			}
+
+			if (index < node->count) {
+				// resume after this branch once its subtree is done
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
 			}
+			else
+				stack.pop();
 		}
 	}
 
 	TREE_TEMPLATE
 		template <typename Predicate, typename OutIter>
-	void TREE_QUAL::queryRec(node_ptr_type node, const Predicate &predicate,
-		size_t &foundCount, OutIter it) const {
-		assert(node);
-		assert(node->level >= 0);
+	void TREE_QUAL::queryImpl(const node_type *root, const Predicate &predicate,
+		size_t &foundCount, OutIter it, detail::aos_layout_tag) const {
+		assert(root);
+		assert(root->level >= 0);
+
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->bboxes[index])) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
 
-		if (node->isLeaf()) {
-			for (count_type index = 0; index < node->count; ++index) {
-				if (predicate(node->bboxes[index])) {
+			count_type index = frame.cursor;
+			while (index < node->count && !predicate.bbox.overlaps(node->bboxes[index]))
+				++index;
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
+			}
+			else
+				stack.pop();
+		}
+	}
+
+	// Same as above, but the children are tested at once and the bitmask of the
+	// remaining matches is the cursor of a node, iterated in the same order.
+	TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	void TREE_QUAL::queryImpl(const node_type *root, const Predicate &predicate,
+		size_t &foundCount, OutIter it, detail::soa_layout_tag) const {
+		assert(root);
+		assert(root->level >= 0);
+
+		typedef detail::TraversalStack<const node_type *, uint64_t, kMaxHeight> mask_stack;
+
+		mask_stack stack;
+		stack.push(root, root->isLeaf() ? 0 : root->overlapMask(predicate.bbox));
+		while (!stack.empty()) {
+			typename mask_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (uint64_t mask = detail::childMask(*node, predicate); mask;
+					mask &= mask - 1) {
+					const count_type index = detail::lowestBitIndex(mask);
 					*it = node->values[index];
 					++it;
 					++foundCount;
 				}
+				stack.pop();
+				continue;
 			}
-		}
-		else {
-			for (count_type index = 0; index < node->count; ++index) {
-				const bbox_type &nodeBBox = node->bboxes[index];
 
-				if (predicate.bbox.overlaps(nodeBBox)) {
-					queryRec(node->children[index], predicate, foundCount, it);
-				}
+			if (!frame.cursor) {
+				stack.pop();
+				continue;
 			}
+
+			const count_type index = detail::lowestBitIndex(frame.cursor);
+			frame.cursor &= frame.cursor - 1;
+			const node_type *child = node->children[index];
+			stack.push(child, child->isLeaf() ? 0 : child->overlapMask(predicate.bbox));
 		}
 	}
 
 	TREE_TEMPLATE
 		template <typename Predicate, typename OutIter>
-	void TREE_QUAL::rayQueryRec(node_ptr_type node, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
+	void TREE_QUAL::rayQueryImpl(const node_type *root, const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension], const Predicate& predicate,
 		size_t& foundCount, OutIter it) const {
+		assert(root);
+		assert(root->level >= 0);
+
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (predicate(node->values[index]) && node->bboxes[index].template intersectsRay<RealType>(rayOrigin, rayDirection)) {
+						*it = node->values[index];
+						++it;
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
+
+			count_type index = frame.cursor;
+			while (index < node->count &&
+				!node->bboxes[index].template intersectsRay<RealType>(rayOrigin, rayDirection))
+				++index;
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
+			}
+			else
+				stack.pop();
+		}
+	}
+
+	TREE_TEMPLATE
+		template <typename Visitor>
+	void TREE_QUAL::selfJoinRec(const node_type *node, size_t &foundCount,
+		Visitor &visitor) const {
 		assert(node);
-		assert(node->level >= 0);
 
-		if (node->isLeaf()) {
-			for (count_type index = 0; index < node->count; ++index) {
-				if (predicate(node->values[index]) && node->bboxes[index].template intersectsRay<RealType>(rayOrigin, rayDirection)) {
-					*it = node->values[index];
-					++it;
+		for (count_type i = 0; i < node->count; ++i) {
+			if (node->isBranch())
+				selfJoinRec(node->children[i], foundCount, visitor);
+
+			// the pairs of distinct entries, each once
+			for (count_type j = i + 1; j < node->count; ++j) {
+				const bbox_type &bbox = node->bboxes[i];
+				if (!bbox.overlaps(node->bboxes[j]))
+					continue;
+
+				if (node->isLeaf()) {
+					visitor(node->values[i], node->values[j]);
 					++foundCount;
 				}
+				else {
+					joinRec(node->children[i], node->children[j],
+						bbox.intersected(node->bboxes[j]), foundCount, visitor);
+				}
 			}
 		}
-		else {
-			for (count_type index = 0; index < node->count; ++index) {
-				const bbox_type& nodeBBox = node->bboxes[index];
+	}
+
+	// Synchronized traversal, a node pair is joined only within the common area
+	// of their parent boxes and the deeper tree is descended first.
+	TREE_TEMPLATE
+		template <class OtherNode, typename Visitor>
+	void TREE_QUAL::joinRec(const node_type *node, const OtherNode *other,
+		const bbox_type &common, size_t &foundCount, Visitor &visitor) const {
+		assert(node && other);
 
-				if (nodeBBox.template intersectsRay<RealType>(rayOrigin, rayDirection)) {
-					rayQueryRec(node->children[index], rayOrigin, rayDirection, predicate, foundCount, it);
+		// only the entries which overlap the common area can form pairs
+		count_type indices[max_child_items];
+		count_type count = 0;
+		for (count_type index = 0; index < node->count; ++index) {
+			if (node->bboxes[index].overlaps(common))
+				indices[count++] = index;
+		}
+		if (!count)
+			return;
+
+		if (node->level > other->level) {
+			for (count_type i = 0; i < count; ++i) {
+				const bbox_type &bbox = node->bboxes[indices[i]];
+				joinRec(node->children[indices[i]], other, bbox.intersected(common),
+					foundCount, visitor);
+			}
+			return;
+		}
+
+		for (typename OtherNode::count_type j = 0; j < other->count; ++j) {
+			const bbox_type &otherBBox = other->bboxes[j];
+			if (!otherBBox.overlaps(common))
+				continue;
+
+			if (other->level > node->level) {
+				joinRec(node, other->children[j], otherBBox.intersected(common),
+					foundCount, visitor);
+				continue;
+			}
+
+			for (count_type i = 0; i < count; ++i) {
+				const bbox_type &bbox = node->bboxes[indices[i]];
+				if (!bbox.overlaps(otherBBox))
+					continue;
+
+				if (node->isLeaf()) {
+					visitor(node->values[indices[i]], other->values[j]);
+					++foundCount;
+				}
+				else {
+					joinRec(node->children[indices[i]], other->children[j],
+						bbox.intersected(otherBBox), foundCount, visitor);
 				}
 			}
 		}
 	}
 
 	TREE_TEMPLATE
-		template <typename OutIter>
-	void TREE_QUAL::nearestRec(node_ptr_type node, const T point[2], T radius,
-		size_t &foundCount, OutIter it) const {
-		SPATIAL_TREE_STATIC_ASSERT(Dimension == 2, "Only for 2 dimensions!");
+		template <typename Predicate, typename Visitor, typename NodeVisitor>
+	bool TREE_QUAL::visitImpl(const node_type *root, const Predicate &predicate,
+		Visitor &visitor, NodeVisitor &nodeVisitor) const {
+		assert(root);
 
-		assert(node);
-		assert(node->level >= 0);
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
 
-		if (node->isLeaf()) {
-			BranchDistance branches[max_child_items];
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					const bbox_type &bbox = node->bboxes[index];
+					if (predicate(bbox) && !visitor(node->values[index], bbox))
+						return false;
+				}
+				stack.pop();
+				continue;
+			}
 
-			count_type current = 0;
-			for (count_type index = 0; index < node->count; ++index) {
-				const bbox_type &nodeBBox = node->bboxes[index];
+			count_type index = frame.cursor;
+			for (; index < node->count; ++index) {
+				const bbox_type &bbox = node->bboxes[index];
+				if (!predicate.bbox.overlaps(bbox))
+					continue;
+
+				const VisitResult result = nodeVisitor(bbox, node->level - 1);
+				if (result == eVisitStop)
+					return false;
+				if (result == eVisitContinue)
+					break;
+			}
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
+			}
+			else
+				stack.pop();
+		}
+		return true;
+	}
+
+	TREE_TEMPLATE
+		template <typename Visitor>
+	bool TREE_QUAL::rayVisitImpl(const node_type *root,
+		const RealType rayOrigin[Dimension], const RealType rayDirection[Dimension],
+		Visitor &visitor) const {
+		assert(root);
+
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			count_type index = frame.cursor;
+			for (; index < node->count; ++index) {
+				const bbox_type &bbox = node->bboxes[index];
+				if (!bbox.template intersectsRay<RealType>(rayOrigin, rayDirection))
+					continue;
+				if (node->isBranch())
+					break;
+				if (!visitor(node->values[index], bbox))
+					return false;
+			}
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
+			}
+			else
+				stack.pop();
+		}
+		return true;
+	}
 
-				if (nodeBBox.overlaps(point, radius)) {
-					BranchDistance &branch = branches[current++];
-					branch.index = index;
+	// The cursor keeps the planes the node straddles, its children are tested
+	// only against those.
+	TREE_TEMPLATE
+		template <class FrustumClass, typename OutIter>
+	void TREE_QUAL::frustumImpl(const node_type *root, const FrustumClass &frustum,
+		uint32_t planeMask, bool hierarchical, size_t &foundCount,
+		OutIter &out_it) const {
+		assert(root);
+
+		mask_traversal_stack stack;
+		stack.push(root, MaskCursor(0, planeMask));
+		while (!stack.empty()) {
+			typename mask_traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			// at the target level the hierarchical values are returned as is
+			const bool emitValues = node->isLeaf() ||
+				(hierarchical && node->level <= m_queryTargetLevel);
+			count_type index = frame.cursor.index;
+			uint32_t childMask = 0;
+			for (; index < node->count; ++index) {
+				childMask = frame.cursor.mask;
+				// an empty mask means the node is fully inside
+				const int classification = frame.cursor.mask
+					? frustum.classify(node->bboxes[index], childMask)
+					: FrustumClass::eInside;
+				if (classification == FrustumClass::eOutside)
+					continue;
 
-					// use euclidean distance
-					T center[2];
-					nodeBBox.center(center);
-					branch.distance = distance(point, center);
+				if (emitValues ||
+					(hierarchical && classification == FrustumClass::eInside)) {
+					*out_it = node->values[index];
+					++out_it;
+					++foundCount;
 				}
+				else
+					break;
+			}
+
+			if (index < node->count) {
+				frame.cursor.index = index + 1;
+				stack.push(node->children[index], MaskCursor(0, childMask));
 			}
+			else
+				stack.pop();
+		}
+	}
+
+	// The cursor keeps the rays which hit the node, only those are tested
+	// against its children.
+	TREE_TEMPLATE
+		template <typename Visitor>
+	void TREE_QUAL::rayPacketImpl(const node_type *root,
+		const ray_packet_type &packet, uint32_t active, size_t &foundCount,
+		Visitor &visitor) const {
+		assert(root);
+
+		mask_traversal_stack stack;
+		stack.push(root, MaskCursor(0, active));
+		while (!stack.empty()) {
+			typename mask_traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
 
-			// sort branches based on distances
-			std::sort(branches, branches + current);
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					for (uint32_t mask = packet.hitMask(node->bboxes[index], frame.cursor.mask);
+						mask; mask &= mask - 1) {
+						visitor(detail::lowestBitIndex(mask), node->values[index]);
+						++foundCount;
+					}
+				}
+				stack.pop();
+				continue;
+			}
 
-			// save results
-			for (count_type i = 0; i < current; ++i) {
-				BranchDistance &branch = branches[i];
+			count_type index = frame.cursor.index;
+			uint32_t mask = 0;
+			for (; index < node->count; ++index) {
+				mask = packet.hitMask(node->bboxes[index], frame.cursor.mask);
+				if (mask)
+					break;
+			}
 
-				*it = node->values[branch.index];
-				++it;
-				++foundCount;
+			if (index < node->count) {
+				frame.cursor.index = index + 1;
+				// only the rays which hit the child stay active
+				stack.push(node->children[index], MaskCursor(0, mask));
 			}
+			else
+				stack.pop();
 		}
-		else {
-			// compute distance for each branch
+	}
+
+	TREE_TEMPLATE
+		template <typename HitFunction, class HitCollector>
+	void TREE_QUAL::rayCastImpl(const node_type *root, const ray_type &ray,
+		const HitFunction &hit, HitCollector &collector) const {
+		assert(root);
+
+		// The pending children of every level are on the stack with their entry
+		// distance, pushed back to front so they are visited front to back.
+		typedef detail::TraversalStack<const node_type *, RealType,
+			kMaxHeight * max_child_items> node_stack;
+
+		node_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			const node_type *node = stack.top().node;
+			const RealType entry = stack.top().cursor;
+			stack.pop();
+			// the closest hits so far are in front of the node
+			if (node != root && !collector.accepts(entry))
+				continue;
+
+			RealType tEntry;
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (!ray.intersects(node->bboxes[index], collector.bound(), tEntry))
+						continue;
+					const RealType t = hit(node->values[index], tEntry);
+					if (t >= 0 && collector.accepts(t))
+						collector.offer(node, index, t);
+				}
+				continue;
+			}
+
 			BranchDistance branches[max_child_items];
+			count_type hitCount = 0;
 			for (count_type index = 0; index < node->count; ++index) {
-				const bbox_type &nodeBBox = node->bboxes[index];
+				if (ray.intersects(node->bboxes[index], collector.bound(), tEntry)) {
+					branches[hitCount].distance = tEntry;
+					branches[hitCount].index = index;
+					++hitCount;
+				}
+			}
+			detail::insertionSort(branches, branches + hitCount);
+
+			for (count_type index = hitCount; index-- > 0;)
+				stack.push(node->children[branches[index].index], branches[index].distance);
+		}
+	}
 
-				BranchDistance &branch = branches[index];
-				// check if the radius overlaps with the node's bbox
-				if (nodeBBox.overlaps(point, radius)) {
-					// use euclidean distance
-					T center[2];
-					nodeBBox.center(center);
-					branch.distance = distance(point, center);
+	TREE_TEMPLATE
+		template <typename OutIter>
+	void TREE_QUAL::withinDistanceImpl(const node_type *root,
+		const T point[Dimension], RealType radiusSquare, size_t &foundCount,
+		OutIter &out_it) const {
+		assert(root);
+
+		traversal_stack stack;
+		stack.push(root, 0);
+		while (!stack.empty()) {
+			typename traversal_stack::Frame &frame = stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (count_type index = 0; index < node->count; ++index) {
+					if (distance(point, node->bboxes[index]) <= radiusSquare) {
+						*out_it = node->values[index];
+						++out_it;
+						++foundCount;
+					}
 				}
-				else
-					// discarded branch
-					branch.distance = -1;
+				stack.pop();
+				continue;
+			}
 
-				branch.index = index;
+			count_type index = frame.cursor;
+			while (index < node->count &&
+				distance(point, node->bboxes[index]) > radiusSquare)
+				++index;
+
+			if (index < node->count) {
+				frame.cursor = index + 1;
+				stack.push(node->children[index], 0);
 			}
+			else
+				stack.pop();
+		}
+	}
 
-			// sort branches based on distances
-			std::sort(branches, branches + node->count);
-			// prune branches
-			count_type first = node->count;
-			for (count_type index = 0; index < node->count; ++index) {
-				BranchDistance &branch = branches[index];
-				if (branch.distance >= 0) {
-					first = index;
+	TREE_TEMPLATE
+		template <typename OutIter>
+	void TREE_QUAL::nearestImpl(const node_type *root, const T point[2], T radius,
+		size_t &foundCount, OutIter it) const {
+		SPATIAL_TREE_STATIC_ASSERT(Dimension == 2, "Only for 2 dimensions!");
+
+		assert(root);
+		assert(root->level >= 0);
+
+		// Each frame keeps the sorted children of its node and advances over
+		// them, so the children are visited closest first.
+		nearest_traversal_stack stack;
+		const node_type *node = root;
+		while (node) {
+			if (node->isLeaf()) {
+				BranchDistance branches[max_child_items];
+				const count_type count = nearestBranches(*node, point, radius, branches);
+
+				// save results
+				for (count_type index = 0; index < count; ++index) {
+					*it = node->values[branches[index].index];
+					++it;
+					++foundCount;
+				}
+			}
+			else {
+				NearestCursor &cursor = stack.pushFrame(node).cursor;
+				cursor.count = nearestBranches(*node, point, radius, cursor.branches);
+				cursor.current = 0;
+			}
+
+			// continue with the next closest child of the deepest pending node
+			node = NULL;
+			while (!stack.empty()) {
+				NearestCursor &cursor = stack.top().cursor;
+				if (cursor.current < cursor.count) {
+					node = stack.top().node->children[cursor.branches[cursor.current++].index];
 					break;
 				}
+				stack.pop();
 			}
+		}
+	}
+
+	// Collects the branches overlapping the radius sorted by the distance of
+	// their center.
+	TREE_TEMPLATE
+		typename TREE_QUAL::count_type TREE_QUAL::nearestBranches(
+			const node_type &node, const T point[2], T radius,
+			BranchDistance branches[max_child_items]) const {
+		count_type count = 0;
+		for (count_type index = 0; index < node.count; ++index) {
+			const bbox_type &nodeBBox = node.bboxes[index];
+
+			// check if the radius overlaps with the node's bbox
+			if (nodeBBox.overlaps(point, radius)) {
+				BranchDistance &branch = branches[count++];
+				branch.index = index;
 
-			// iterate through the active branches
-			for (count_type index = first; index < node->count; ++index) {
-				BranchDistance &branch = branches[index];
-				nearestRec(node->children[branch.index], point, radius, foundCount, it);
+				// use euclidean distance
+				T center[2];
+				nodeBBox.center(center);
+				branch.distance = distance(point, center);
 			}
 		}
+
+		detail::insertionSort(branches, branches + count);
+		return count;
 	}
 
 	TREE_TEMPLATE
@@ -1515,6 +3645,11 @@ namespace spatial {
 		return node_iterator(m_root);
 	}
 
+	TREE_TEMPLATE
+		const typename TREE_QUAL::node_type *TREE_QUAL::rootNode() const {
+		return m_root;
+	}
+
 	TREE_TEMPLATE
 		typename TREE_QUAL::depth_iterator TREE_QUAL::dbegin() {
 		typedef detail::Stack<node_type, count_type> base_it_type;
@@ -1534,7 +3669,7 @@ namespace spatial {
 				it.push(first, 0, base_it_type::eNormal);
 			}
 
-			first = first->children[0];
+			first = first->isBranch() ? first->children[0] : NULL;
 		}
 		return it;
 	}
@@ -1757,6 +3892,125 @@ namespace spatial {
 		}
 	}
 
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	TREE_QUAL::query_iterator<Predicate>::query_iterator(const node_type *root,
+		const Predicate &predicate)
+		: m_predicate(predicate) {
+		assert(root);
+		m_stack.push(root, 0);
+		seek();
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	TREE_QUAL::query_iterator<Predicate>::query_iterator(const Predicate &predicate)
+		: m_predicate(predicate) {}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	bool TREE_QUAL::query_iterator<Predicate>::valid() const {
+		return !m_stack.empty();
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	const ValueType &TREE_QUAL::query_iterator<Predicate>::operator*() const {
+		assert(valid());
+		const typename traversal_stack::Frame &frame = m_stack.top();
+		return frame.node->values[frame.cursor];
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	const ValueType *TREE_QUAL::query_iterator<Predicate>::operator->() const {
+		return &**this;
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	const typename TREE_QUAL::bbox_type &
+		TREE_QUAL::query_iterator<Predicate>::bbox() const {
+		assert(valid());
+		const typename traversal_stack::Frame &frame = m_stack.top();
+		return frame.node->bboxes[frame.cursor];
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	void TREE_QUAL::query_iterator<Predicate>::next() {
+		assert(valid());
+		++m_stack.top().cursor;
+		seek();
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	typename TREE_QUAL::template query_iterator<Predicate> &
+		TREE_QUAL::query_iterator<Predicate>::operator++() {
+		next();
+		return *this;
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	typename TREE_QUAL::template query_iterator<Predicate>
+		TREE_QUAL::query_iterator<Predicate>::operator++(int) {
+		query_iterator it = *this;
+		next();
+		return it;
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	bool TREE_QUAL::query_iterator<Predicate>::operator==(
+		const query_iterator &other) const {
+		if (m_stack.empty() || other.m_stack.empty())
+			return m_stack.empty() == other.m_stack.empty();
+		const typename traversal_stack::Frame &frame = m_stack.top();
+		const typename traversal_stack::Frame &otherFrame = other.m_stack.top();
+		return frame.node == otherFrame.node && frame.cursor == otherFrame.cursor;
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	bool TREE_QUAL::query_iterator<Predicate>::operator!=(
+		const query_iterator &other) const {
+		return !(*this == other);
+	}
+
+	TREE_TEMPLATE
+		template <typename Predicate>
+	void TREE_QUAL::query_iterator<Predicate>::seek() {
+		// same order as queryImpl, stops at each match of a leaf
+		while (!m_stack.empty()) {
+			typename traversal_stack::Frame &frame = m_stack.top();
+			const node_type *node = frame.node;
+
+			if (node->isLeaf()) {
+				for (; frame.cursor < node->count; ++frame.cursor) {
+					if (m_predicate(node->bboxes[frame.cursor]))
+						return;
+				}
+				m_stack.pop();
+				continue;
+			}
+
+			count_type index = frame.cursor;
+			while (index < node->count && !m_predicate.bbox.overlaps(node->bboxes[index]))
+				++index;
+			if (index == node->count) {
+				// No more children, so it will fall back to previous level
+				m_stack.pop();
+				continue;
+			}
+			frame.cursor = index + 1;
+			m_stack.push(node->children[index], 0);
+		}
+	}
+
 #ifdef TREE_DEBUG_TAG
 
 	TREE_TEMPLATE
@@ -0,0 +1,380 @@
+//
+//  ShardedRTree.h
+//
+//
+
+#pragma once
+
+#include "RTree.h"
+
+#ifdef SPATIAL_TREE_USE_CPP11
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <vector>
+
+namespace spatial {
+	/**
+	 @class ShardedRTree
+	 @brief Index partitioned into spatial shards, each one an RTree with its
+	 own reader-writer lock, so the shards are updated and queried in parallel.
+
+	 The world box is split into cells by a kd-tree, either evenly or at the
+	 quantiles of a sample of the values. A value is owned by the shard whose
+	 cell contains the center of its box, so a value which spans several cells
+	 is stored once and the merged results need no deduplication.
+	 The queries test the shards whose values overlap, which may extend past
+	 their cells, and run them on a thread pool.
+
+	 @note The inserts, removes and queries are safe to call from several
+	 threads, the ones of different shards don't wait for each other. The
+	 shard locks are blocking, a query or bulk insert holds one for its whole
+	 shard, and the loops of concurrent calls share the workers of the pool.
+	 @see RTree for the parameters.
+	 */
+	template <typename T,                                            //
+		typename ValueType,                                    //
+		int Dimension,                                         //
+		int max_child_items = 8,                               //
+		int min_child_items = max_child_items / 2,             //
+		typename indexable_getter = Indexable<T, ValueType>,   //
+		int bbox_volume_mode = box::eNormalVolume,             //
+		typename RealType = typename rtree::RealType<T>::type, //
+		typename custom_allocator = spatial::allocator<detail::Node<
+		ValueType, BoundingBox<T, Dimension>, max_child_items>>, //
+		typename split_policy = rtree::quadratic>
+		class ShardedRTree {
+		public:
+			typedef ValueType value_type;
+			typedef BoundingBox<T, Dimension> bbox_type;
+			typedef RTree<T, ValueType, Dimension, max_child_items, min_child_items,
+				indexable_getter, bbox_volume_mode, RealType, custom_allocator,
+				split_policy>
+				tree_type;
+
+		public:
+			/// Splits the world box evenly into the given number of shards.
+			/// @param threadCount threads of the pool, including the calling one,
+			/// zero selects the number of hardware threads.
+			ShardedRTree(const bbox_type &world, unsigned shardCount,
+				indexable_getter indexable = indexable_getter(),
+				unsigned threadCount = 0);
+			/// Splits the world box at the quantiles of the centers of a sample of
+			/// the values, the shards get about the same number of values.
+			template <typename Iter>
+			ShardedRTree(const bbox_type &world, unsigned shardCount, Iter sampleFirst,
+				Iter sampleLast, indexable_getter indexable = indexable_getter(),
+				unsigned threadCount = 0);
+
+			void insert(const ValueType &value);
+			/// Inserts the values, the shards are filled in parallel.
+			template <typename Iter> void insert(Iter first, Iter last);
+			bool remove(const ValueType &value);
+			void clear();
+
+			/// Returns the number of found values, the results of each shard are
+			/// written in the order of the shards.
+			template <typename Predicate, typename OutIter>
+			size_t query(const Predicate &predicate, OutIter out_it) const;
+
+			size_t count() const;
+
+			unsigned shardCount() const;
+			/// Returns the shard owning the value.
+			unsigned shardIndex(const ValueType &value) const;
+			/// Returns the tree of a shard.
+			/// @note Not locked, only use it while the index isn't updated.
+			const tree_type &shard(unsigned index) const;
+			/// Returns the cell of a shard, it contains the centers of its values
+			/// which are inside the world box, the others go to the nearest cell.
+			const bbox_type &cell(unsigned index) const;
+
+		private:
+			struct Shard {
+				tree_type tree;
+				bbox_type cell;
+				/// Bounds of the values, only grows until the shard is cleared.
+				bbox_type bounds;
+				detail::SharedMutex lock;
+
+				Shard(const indexable_getter &indexable, const bbox_type &cell)
+					: tree(indexable), cell(cell), bounds(box::empty_init()) {}
+			};
+
+			/// Split of the kd-tree, a negative child is the complement of a shard
+			/// index.
+			struct Split {
+				int axis;
+				T position;
+				int children[2];
+			};
+
+			int buildSplits(const bbox_type &cell, unsigned shardCount,
+				T *centers, size_t centerCount);
+			unsigned findShard(const T center[Dimension]) const;
+			bbox_type valueBBox(const ValueType &value) const;
+
+			ShardedRTree(const ShardedRTree &);
+			ShardedRTree &operator=(const ShardedRTree &);
+
+		private:
+			indexable_getter m_indexable;
+			std::deque<Shard> m_shards;
+			std::vector<Split> m_splits;
+			mutable detail::ThreadPool m_pool;
+	};
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SHARDED_TREE_TEMPLATE                                                  \
+  template <typename T, typename ValueType, int Dimension,                     \
+            int max_child_items, int min_child_items,                          \
+            typename indexable_getter, int bbox_volume_mode,                   \
+            typename RealType, typename custom_allocator,                      \
+            typename split_policy>
+#define SHARDED_TREE_QUAL                                                      \
+  ShardedRTree<T, ValueType, Dimension, max_child_items, min_child_items,      \
+               indexable_getter, bbox_volume_mode, RealType, custom_allocator, \
+               split_policy>
+
+	SHARDED_TREE_TEMPLATE
+		SHARDED_TREE_QUAL::ShardedRTree(const bbox_type &world, unsigned shardCount,
+			indexable_getter indexable, unsigned threadCount)
+		: m_indexable(indexable), m_pool(threadCount) {
+		assert(shardCount > 0);
+		buildSplits(world, shardCount, NULL, 0);
+	}
+
+	SHARDED_TREE_TEMPLATE
+		template <typename Iter>
+	SHARDED_TREE_QUAL::ShardedRTree(const bbox_type &world, unsigned shardCount,
+		Iter sampleFirst, Iter sampleLast, indexable_getter indexable,
+		unsigned threadCount)
+		: m_indexable(indexable), m_pool(threadCount) {
+		assert(shardCount > 0);
+
+		std::vector<T> centers;
+		for (; sampleFirst != sampleLast; ++sampleFirst) {
+			T center[Dimension];
+			valueBBox(*sampleFirst).center(center);
+			centers.insert(centers.end(), center, center + Dimension);
+		}
+		buildSplits(world, shardCount, centers.empty() ? NULL : &centers[0],
+			centers.size() / Dimension);
+	}
+
+	SHARDED_TREE_TEMPLATE
+		void SHARDED_TREE_QUAL::insert(const ValueType &value) {
+		const bbox_type bbox = valueBBox(value);
+		T center[Dimension];
+		bbox.center(center);
+
+		Shard &shard = m_shards[findShard(center)];
+		shard.lock.lockExclusive();
+		shard.tree.insert(value);
+		shard.bounds.extend(bbox);
+		shard.lock.unlockExclusive();
+	}
+
+	SHARDED_TREE_TEMPLATE
+		template <typename Iter>
+	void SHARDED_TREE_QUAL::insert(Iter first, Iter last) {
+		std::vector<std::vector<ValueType> > values(m_shards.size());
+		for (; first != last; ++first)
+			values[shardIndex(*first)].push_back(*first);
+
+		m_pool.run(m_shards.size(), [&](size_t index, unsigned) {
+			const std::vector<ValueType> &shardValues = values[index];
+			if (shardValues.empty())
+				return;
+
+			Shard &shard = m_shards[index];
+			shard.lock.lockExclusive();
+			for (size_t i = 0; i < shardValues.size(); ++i) {
+				shard.tree.insert(shardValues[i]);
+				shard.bounds.extend(valueBBox(shardValues[i]));
+			}
+			shard.lock.unlockExclusive();
+		});
+	}
+
+	SHARDED_TREE_TEMPLATE
+		bool SHARDED_TREE_QUAL::remove(const ValueType &value) {
+		Shard &shard = m_shards[shardIndex(value)];
+		shard.lock.lockExclusive();
+		const bool removed = shard.tree.remove(value);
+		shard.lock.unlockExclusive();
+		return removed;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		void SHARDED_TREE_QUAL::clear() {
+		for (size_t index = 0; index < m_shards.size(); ++index) {
+			Shard &shard = m_shards[index];
+			shard.lock.lockExclusive();
+			shard.tree.clear();
+			shard.bounds = bbox_type(box::empty_init());
+			shard.lock.unlockExclusive();
+		}
+	}
+
+	SHARDED_TREE_TEMPLATE
+		template <typename Predicate, typename OutIter>
+	size_t SHARDED_TREE_QUAL::query(const Predicate &predicate,
+		OutIter out_it) const {
+		std::vector<unsigned> candidates;
+		for (size_t index = 0; index < m_shards.size(); ++index) {
+			const Shard &shard = m_shards[index];
+			shard.lock.lockShared();
+			if (shard.bounds.overlaps(predicate.bbox))
+				candidates.push_back((unsigned)index);
+			shard.lock.unlockShared();
+		}
+
+		if (candidates.size() == 1) {
+			const Shard &shard = m_shards[candidates[0]];
+			shard.lock.lockShared();
+			const size_t foundCount = shard.tree.query(predicate, out_it);
+			shard.lock.unlockShared();
+			return foundCount;
+		}
+
+		std::vector<std::vector<ValueType> > results(candidates.size());
+		m_pool.run(candidates.size(), [&](size_t index, unsigned) {
+			const Shard &shard = m_shards[candidates[index]];
+			shard.lock.lockShared();
+			shard.tree.query(predicate, std::back_inserter(results[index]));
+			shard.lock.unlockShared();
+		});
+
+		size_t foundCount = 0;
+		for (size_t index = 0; index < results.size(); ++index) {
+			out_it = std::copy(results[index].begin(), results[index].end(), out_it);
+			foundCount += results[index].size();
+		}
+		return foundCount;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		size_t SHARDED_TREE_QUAL::count() const {
+		size_t count = 0;
+		for (size_t index = 0; index < m_shards.size(); ++index) {
+			const Shard &shard = m_shards[index];
+			shard.lock.lockShared();
+			count += shard.tree.count();
+			shard.lock.unlockShared();
+		}
+		return count;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		unsigned SHARDED_TREE_QUAL::shardCount() const {
+		return (unsigned)m_shards.size();
+	}
+
+	SHARDED_TREE_TEMPLATE
+		unsigned SHARDED_TREE_QUAL::shardIndex(const ValueType &value) const {
+		T center[Dimension];
+		valueBBox(value).center(center);
+		return findShard(center);
+	}
+
+	SHARDED_TREE_TEMPLATE
+		const typename SHARDED_TREE_QUAL::tree_type &
+		SHARDED_TREE_QUAL::shard(unsigned index) const {
+		assert(index < m_shards.size());
+		return m_shards[index].tree;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		const typename SHARDED_TREE_QUAL::bbox_type &
+		SHARDED_TREE_QUAL::cell(unsigned index) const {
+		assert(index < m_shards.size());
+		return m_shards[index].cell;
+	}
+
+	// Splits the cell along its longest axis, the shards are divided in halves
+	// and the cut is placed at the matching quantile of the sample centers, or
+	// proportionally without a sample. Returns the index of the split or the
+	// complement of the shard index.
+	SHARDED_TREE_TEMPLATE
+		int SHARDED_TREE_QUAL::buildSplits(const bbox_type &cell, unsigned shardCount,
+			T *centers, size_t centerCount) {
+		if (shardCount == 1) {
+			m_shards.emplace_back(m_indexable, cell);
+			return ~(int)(m_shards.size() - 1);
+		}
+
+		int axis = 0;
+		for (int index = 1; index < Dimension; ++index) {
+			if (cell.max[index] - cell.min[index] > cell.max[axis] - cell.min[axis])
+				axis = index;
+		}
+
+		const unsigned lowCount = shardCount / 2;
+		size_t lowCenters = 0;
+		T position = cell.min[axis] +
+			(T)((cell.max[axis] - cell.min[axis]) * lowCount / shardCount);
+		if (centerCount) {
+			// partition the centers at the quantile along the axis
+			std::vector<size_t> order(centerCount);
+			for (size_t index = 0; index < centerCount; ++index)
+				order[index] = index;
+			lowCenters = centerCount * lowCount / shardCount;
+			std::nth_element(order.begin(), order.begin() + lowCenters, order.end(),
+				[&](size_t lhs, size_t rhs) {
+				return centers[lhs * Dimension + axis] < centers[rhs * Dimension + axis];
+			});
+			position = centers[order[lowCenters] * Dimension + axis];
+			position = std::max(cell.min[axis], std::min(cell.max[axis], position));
+
+			// the centers below the cut first
+			std::vector<T> sorted(centerCount * Dimension);
+			for (size_t index = 0; index < centerCount; ++index)
+				std::copy(centers + order[index] * Dimension,
+					centers + (order[index] + 1) * Dimension,
+					sorted.begin() + index * Dimension);
+			std::copy(sorted.begin(), sorted.end(), centers);
+		}
+
+		const int split = (int)m_splits.size();
+		m_splits.push_back(Split());
+		m_splits[split].axis = axis;
+		m_splits[split].position = position;
+
+		bbox_type lowCell = cell, highCell = cell;
+		lowCell.max[axis] = position;
+		highCell.min[axis] = position;
+		const int low = buildSplits(lowCell, lowCount, centers, lowCenters);
+		const int high = buildSplits(highCell, shardCount - lowCount,
+			centerCount ? centers + lowCenters * Dimension : NULL,
+			centerCount - lowCenters);
+		m_splits[split].children[0] = low;
+		m_splits[split].children[1] = high;
+		return split;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		unsigned SHARDED_TREE_QUAL::findShard(const T center[Dimension]) const {
+		if (m_splits.empty())
+			return 0;
+
+		int node = 0;
+		while (node >= 0) {
+			const Split &split = m_splits[node];
+			node = split.children[center[split.axis] < split.position ? 0 : 1];
+		}
+		return (unsigned)~node;
+	}
+
+	SHARDED_TREE_TEMPLATE
+		typename SHARDED_TREE_QUAL::bbox_type
+		SHARDED_TREE_QUAL::valueBBox(const ValueType &value) const {
+		return bbox_type(m_indexable.min(value), m_indexable.max(value));
+	}
+
+#undef SHARDED_TREE_TEMPLATE
+#undef SHARDED_TREE_QUAL
+
+} // namespace spatial
+#endif
@@ -10,11 +10,17 @@
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
 #include <assert.h>
 #include <stdint.h>
+#include <new>
 #elif SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_STD_ALLOCATOR
 #include <memory>
+#include <new>
 #endif
 
 namespace spatial {
+	namespace detail {
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactNode;
+	}
 
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
 
@@ -37,9 +43,77 @@ namespace spatial {
 		bool overflowed() const { return false; }
 	};
 
+	/// Allocates the compact nodes as leaves or branch nodes by their level,
+	/// each one with the allocator of its type.
+	template <typename ValueType, class BBoxClass, int max_child_items>
+	struct allocator<detail::CompactNode<ValueType, BBoxClass, max_child_items> > {
+		typedef detail::CompactNode<ValueType, BBoxClass, max_child_items>
+			value_type;
+		typedef typename value_type::leaf_type leaf_type;
+		typedef typename value_type::branch_node_type branch_node_type;
+
+		enum { is_overflowable = 0 };
+
+		value_type *allocate(int level) {
+			if (level > 0)
+				return branches.allocate(level);
+			return leaves.allocate(level);
+		}
+
+		void deallocate(const value_type *node) {
+			assert(node);
+			if (node->isLeaf())
+				leaves.deallocate(static_cast<const leaf_type *>(node));
+			else
+				branches.deallocate(static_cast<const branch_node_type *>(node));
+		}
+
+		bool overflowed() const { return false; }
+
+		allocator<leaf_type> leaves;
+		allocator<branch_node_type> branches;
+	};
+
 #elif SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_STD_ALLOCATOR
 
 	using std::allocator;
+
+	namespace detail {
+		/// Allocates the compact nodes as leaves or branch nodes by their level.
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		inline CompactNode<ValueType, BBoxClass, max_child_items> *allocate(
+			std::allocator<CompactNode<ValueType, BBoxClass, max_child_items> > &,
+			int level) {
+			typedef CompactNode<ValueType, BBoxClass, max_child_items> node_type;
+			typedef typename node_type::leaf_type leaf_type;
+			typedef typename node_type::branch_node_type branch_node_type;
+
+			if (level > 0) {
+				std::allocator<branch_node_type> branches;
+				return new (branches.allocate(1)) branch_node_type(level);
+			}
+			std::allocator<leaf_type> leaves;
+			return new (leaves.allocate(1)) leaf_type(level);
+		}
+
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		inline void deallocate(
+			std::allocator<CompactNode<ValueType, BBoxClass, max_child_items> > &,
+			CompactNode<ValueType, BBoxClass, max_child_items> *node) {
+			typedef CompactNode<ValueType, BBoxClass, max_child_items> node_type;
+			typedef typename node_type::leaf_type leaf_type;
+			typedef typename node_type::branch_node_type branch_node_type;
+
+			if (node->isLeaf()) {
+				std::allocator<leaf_type> leaves;
+				leaves.deallocate(static_cast<leaf_type *>(node), 1);
+			}
+			else {
+				std::allocator<branch_node_type> branches;
+				branches.deallocate(static_cast<branch_node_type *>(node), 1);
+			}
+		}
+	} // namespace detail
 #else
 #error "Unknown allocator type!"
 #endif
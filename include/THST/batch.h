@@ -0,0 +1,108 @@
+//
+//  batch.h
+//
+//
+
+#pragma once
+
+#include "config.h"
+
+#ifdef SPATIAL_TREE_USE_CPP11
+#include "hilbert.h"
+#include "nearest.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+		/// Returns the indices of the points sorted along the Hilbert curve.
+		template <int Dimension, typename T>
+		void hilbertOrder(const T *points, size_t count, std::vector<size_t> &order,
+			unsigned threadCount) {
+			std::vector<std::pair<uint64_t, size_t> > keys;
+			hilbertKeys<Dimension>(points, count, keys);
+			parallel_sort(keys.begin(), keys.end(),
+				std::less<std::pair<uint64_t, size_t> >(), threadCount);
+
+			order.resize(count);
+			for (size_t index = 0; index < count; ++index)
+				order[index] = keys[index].second;
+		}
+
+		/// Returns the indices of the predicates sorted along the Hilbert curve of
+		/// the centers of their boxes.
+		template <int Dimension, typename T, typename Predicate>
+		void predicateOrder(const Predicate *predicates, size_t count,
+			std::vector<size_t> &order, unsigned threadCount) {
+			std::vector<T> centers(count * Dimension);
+			for (size_t index = 0; index < count; ++index)
+				predicates[index].bbox.center(&centers[index * Dimension]);
+			hilbertOrder<Dimension>(centers.empty() ? NULL : &centers[0], count,
+				order, threadCount);
+		}
+
+		/// Runs a batch of independent queries on the shared thread pool and
+		/// gathers their results in a compressed sparse row layout, the batches
+		/// run by several threads at once share the workers of the pool.
+		/// The threads take chunks of consecutive queries of the order, so a
+		/// thread runs spatially close queries, and append the results to their
+		/// own buffers, which are copied to the rows of the queries at the end.
+		/// @param query called as query(queryIndex, values), appends the results
+		/// of a query to the values.
+		/// @return Returns the total number of results.
+		template <typename ValueType, typename Query>
+		size_t runBatch(const std::vector<size_t> &order, Query query,
+			BatchResults<ValueType> &results, unsigned threadCount) {
+			// amortizes the scheduling, small enough to balance the threads
+			static const size_t kChunkSize = 32;
+
+			struct Segment {
+				size_t query;
+				size_t begin, end; ///< Range of the thread buffer
+			};
+
+			const size_t count = order.size();
+			ThreadPool &pool = sharedThreadPool();
+			threadCount = pool.threadCount(threadCount);
+			std::vector<std::vector<ValueType> > buffers(threadCount);
+			std::vector<std::vector<Segment> > segments(threadCount);
+
+			pool.run((count + kChunkSize - 1) / kChunkSize,
+				[&](size_t chunk, unsigned thread) {
+				std::vector<ValueType> &buffer = buffers[thread];
+				const size_t last = std::min(count, (chunk + 1) * kChunkSize);
+				for (size_t index = chunk * kChunkSize; index < last; ++index) {
+					const Segment segment = { order[index], buffer.size(), 0 };
+					query(order[index], buffer);
+					segments[thread].push_back(segment);
+					segments[thread].back().end = buffer.size();
+				}
+			}, threadCount);
+
+			results.offsets.assign(count + 1, 0);
+			for (size_t thread = 0; thread < segments.size(); ++thread) {
+				for (size_t index = 0; index < segments[thread].size(); ++index) {
+					const Segment &segment = segments[thread][index];
+					results.offsets[segment.query + 1] = segment.end - segment.begin;
+				}
+			}
+			for (size_t index = 0; index < count; ++index)
+				results.offsets[index + 1] += results.offsets[index];
+
+			results.values.resize(results.offsets[count]);
+			pool.run(buffers.size(), [&](size_t thread, unsigned) {
+				const std::vector<ValueType> &buffer = buffers[thread];
+				for (size_t index = 0; index < segments[thread].size(); ++index) {
+					const Segment &segment = segments[thread][index];
+					std::copy(buffer.begin() + segment.begin, buffer.begin() + segment.end,
+						results.values.begin() + results.offsets[segment.query]);
+				}
+			}, threadCount);
+			return results.offsets[count];
+		}
+	} // namespace detail
+} // namespace spatial
+#endif
@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include "config.h"
+
 #include <algorithm>
 #include <cmath>
 #include <ostream>
@@ -34,13 +36,20 @@ namespace spatial {
 		T min[Dimension];
 		T max[Dimension];
 
+#ifdef SPATIAL_TREE_USE_CPP11
+		/// Trivial, so that a value-initialized box is zeroed.
+		BoundingBox() = default;
+#else
 		BoundingBox();
+#endif
 		BoundingBox(box::empty_init);
 		BoundingBox(const T min[Dimension], const T max[Dimension]);
 
 		void extend(const T point[Dimension]);
 		void extend(const BoundingBox &bbox);
 		BoundingBox extended(const BoundingBox &bbox) const;
+		/// Returns the common part, only valid if the boxes overlap.
+		BoundingBox intersected(const BoundingBox &bbox) const;
 		void set(const T min[Dimension], const T max[Dimension]);
 		void translate(const T point[Dimension]);
 
@@ -58,6 +67,11 @@ namespace spatial {
 		void center(T center[Dimension]) const;
 
 		template <int VolumeMode, typename RealType> RealType volume() const;
+		/// Returns the volume of the intersection with the given bbox.
+		template <int VolumeMode, typename RealType>
+		RealType overlap(const BoundingBox &bbox) const;
+		/// Returns the sum of the edge lengths, i.e. the half perimeter in 2D.
+		template <typename RealType> RealType margin() const;
 		BoundingBox quad2d(box::RegionType type) const;
 
 	private:
@@ -97,8 +111,10 @@ namespace spatial {
 #define BBOX_TEMPLATE template <typename T, int Dimension>
 #define BBOX_QUAL BoundingBox<T, Dimension>
 
+#ifndef SPATIAL_TREE_USE_CPP11
 	BBOX_TEMPLATE
 		BBOX_QUAL::BoundingBox() {}
+#endif
 
 	BBOX_TEMPLATE
 		BBOX_QUAL::BoundingBox(const T min[Dimension], const T max[Dimension]) {
@@ -168,6 +184,19 @@ namespace spatial {
 		return res;
 	}
 
+	BBOX_TEMPLATE
+		BBOX_QUAL
+		BBOX_QUAL::intersected(const BoundingBox &obbox) const {
+		assert(overlaps(obbox));
+
+		BoundingBox res;
+		for (int index = 0; index < Dimension; ++index) {
+			res.min[index] = std::max(min[index], obbox.min[index]);
+			res.max[index] = std::min(max[index], obbox.max[index]);
+		}
+		return res;
+	}
+
 	BBOX_TEMPLATE
 		bool BBOX_QUAL::overlaps(const BoundingBox &bbox) const {
 		// loop will get unrolled
@@ -296,6 +325,28 @@ namespace spatial {
 		return normalVolume<RealType>();
 	}
 
+	BBOX_TEMPLATE
+		template <int VolumeMode, typename RealType>
+	RealType BBOX_QUAL::overlap(const BoundingBox &bbox) const {
+		BoundingBox intersection;
+		for (int index = 0; index < Dimension; ++index) {
+			intersection.min[index] = std::max(min[index], bbox.min[index]);
+			intersection.max[index] = std::min(max[index], bbox.max[index]);
+			if (intersection.min[index] > intersection.max[index])
+				return (RealType)0;
+		}
+		return intersection.template volume<VolumeMode, RealType>();
+	}
+
+	BBOX_TEMPLATE
+		template <typename RealType> RealType BBOX_QUAL::margin() const {
+		RealType margin = (RealType)0;
+		for (int index = 0; index < Dimension; ++index) {
+			margin += max[index] - min[index];
+		}
+		return margin;
+	}
+
 	BBOX_TEMPLATE
 		BBOX_QUAL BBOX_QUAL::quad2d(box::RegionType type) const {
 		const T halfW = (max[0] - min[0]) / 2;
@@ -20,6 +20,12 @@
 #define SPATIAL_TREE_ALLOCATOR 2
 #endif
 
+/// Maximum number of threads of the pool running the parallel queries,
+/// 0 selects the number of hardware threads.
+#ifndef SPATIAL_TREE_MAX_THREADS
+#define SPATIAL_TREE_MAX_THREADS 0
+#endif
+
 /// Preprocessor helper macros
 #define SPATIAL_TREE_STRINGIFY(x) #x
 #define SPATIAL_TREE_TOSTRING(x) SPATIAL_TREE_STRINGIFY(x)
@@ -0,0 +1,80 @@
+//
+//  frustum.h
+//
+//
+
+#pragma once
+
+#include "bbox.h"
+#include "soa_node.h"
+
+#include <stdint.h>
+
+namespace spatial {
+
+	/// Convex region bounded by planes, eg. the 6 planes of a view frustum.
+	/// @note The inside of a plane is where dot(normal, point) + offset >= 0.
+	template <typename RealType, int Dimension, int MaxPlanes = 6> struct Frustum {
+		enum Classification { eOutside, eIntersecting, eInside };
+
+		enum { kMaxPlanes = MaxPlanes };
+
+		RealType normals[MaxPlanes][Dimension];
+		RealType offsets[MaxPlanes];
+		uint32_t count;
+
+		Frustum() : count(0) {}
+
+		/// Adds a plane, returns false if there's no space for it.
+		bool addPlane(const RealType normal[Dimension], RealType offset) {
+			if (count >= (uint32_t)MaxPlanes)
+				return false;
+			for (int axis = 0; axis < Dimension; ++axis)
+				normals[count][axis] = normal[axis];
+			offsets[count] = offset;
+			++count;
+			return true;
+		}
+
+		/// Returns the mask of all the planes.
+		uint32_t planeMask() const {
+			return count ? 0xFFFFFFFFu >> (32 - count) : 0;
+		}
+
+		/// Classifies the bbox against the planes of the mask.
+		/// @param mask on return only the planes the bbox straddles are left, the
+		/// children of the bbox need to test only those.
+		/// @note Tests the corner farthest along the normal(p-vertex) for outside
+		/// and the nearest one(n-vertex) for inside.
+		template <typename T>
+		Classification classify(const BoundingBox<T, Dimension> &bbox,
+			uint32_t &mask) const {
+			SPATIAL_TREE_STATIC_ASSERT(MaxPlanes <= 32, "Maximum 32 planes for the mask!");
+
+			for (uint32_t planes = mask; planes; planes &= planes - 1) {
+				const uint32_t plane = detail::lowestBitIndex(planes);
+				RealType farthest = offsets[plane];
+				RealType nearest = offsets[plane];
+				for (int axis = 0; axis < Dimension; ++axis) {
+					const RealType normal = normals[plane][axis];
+					const RealType low = normal * (RealType)bbox.min[axis];
+					const RealType high = normal * (RealType)bbox.max[axis];
+					if (normal >= 0) {
+						farthest += high;
+						nearest += low;
+					}
+					else {
+						farthest += low;
+						nearest += high;
+					}
+				}
+
+				if (farthest < 0)
+					return eOutside;
+				if (nearest >= 0)
+					mask &= ~(uint32_t(1) << plane);
+			}
+			return mask ? eIntersecting : eInside;
+		}
+	};
+} // namespace spatial
@@ -0,0 +1,102 @@
+//
+//  hilbert.h
+//
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+		/// Number of bits per axis for a 64 bit Hilbert index.
+		template <int Dimension> struct HilbertBits {
+			enum { value = (64 / Dimension) > 31 ? 31 : (64 / Dimension) };
+		};
+
+		/// Returns the index along the Hilbert curve for the given grid coordinates,
+		/// each coordinate must be in the [0, 2^bits) range.
+		/// @note Uses Skilling's transpose algorithm, "Programming the Hilbert curve".
+		template <int Dimension>
+		inline uint64_t hilbertIndex(const uint32_t coords[Dimension], int bits) {
+			uint32_t x[Dimension];
+			for (int axis = 0; axis < Dimension; ++axis)
+				x[axis] = coords[axis];
+
+			const uint32_t highest = uint32_t(1) << (bits - 1);
+			// inverse undo
+			for (uint32_t q = highest; q > 1; q >>= 1) {
+				const uint32_t p = q - 1;
+				for (int axis = 0; axis < Dimension; ++axis) {
+					if (x[axis] & q) {
+						x[0] ^= p; // invert
+					}
+					else {
+						// exchange
+						const uint32_t t = (x[0] ^ x[axis]) & p;
+						x[0] ^= t;
+						x[axis] ^= t;
+					}
+				}
+			}
+			// gray encode
+			for (int axis = 1; axis < Dimension; ++axis)
+				x[axis] ^= x[axis - 1];
+			uint32_t t = 0;
+			for (uint32_t q = highest; q > 1; q >>= 1) {
+				if (x[Dimension - 1] & q)
+					t ^= q - 1;
+			}
+			for (int axis = 0; axis < Dimension; ++axis)
+				x[axis] ^= t;
+
+			// interleave the transposed bits, most significant first
+			uint64_t index = 0;
+			for (int bit = bits - 1; bit >= 0; --bit) {
+				for (int axis = 0; axis < Dimension; ++axis)
+					index = (index << 1) | ((x[axis] >> bit) & 1);
+			}
+			return index;
+		}
+
+		/// Computes the Hilbert keys of the points, paired with their index, the
+		/// points are quantized on a grid covering all of them.
+		template <int Dimension, typename T>
+		void hilbertKeys(const T *points, size_t count,
+			std::vector<std::pair<uint64_t, size_t> > &keys) {
+			static const int kBits = HilbertBits<Dimension>::value;
+
+			T minPoint[Dimension], maxPoint[Dimension];
+			for (size_t index = 0; index < count; ++index) {
+				const T *point = points + index * Dimension;
+				for (int axis = 0; axis < Dimension; ++axis) {
+					if (index == 0 || point[axis] < minPoint[axis])
+						minPoint[axis] = point[axis];
+					if (index == 0 || point[axis] > maxPoint[axis])
+						maxPoint[axis] = point[axis];
+				}
+			}
+
+			double scale[Dimension];
+			for (int axis = 0; axis < Dimension; ++axis) {
+				const double extent = count ? (double)(maxPoint[axis] - minPoint[axis]) : 0.0;
+				scale[axis] =
+					extent > 0 ? (double)((uint64_t(1) << kBits) - 1) / extent : 0.0;
+			}
+
+			keys.resize(count);
+			uint32_t coords[Dimension];
+			for (size_t index = 0; index < count; ++index) {
+				const T *point = points + index * Dimension;
+				for (int axis = 0; axis < Dimension; ++axis) {
+					coords[axis] = (uint32_t)(
+						(double)(point[axis] - minPoint[axis]) * scale[axis]);
+				}
+				keys[index] = std::make_pair(hilbertIndex<Dimension>(coords, kBits), index);
+			}
+		}
+	} // namespace detail
+} // namespace spatial
@@ -0,0 +1,139 @@
+//
+//  mapped_file.h
+//
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace spatial {
+	namespace detail {
+
+		/// Read-only memory mapping of a whole file.
+		class MappedFile {
+		public:
+			MappedFile()
+				: m_data(NULL), m_size(0)
+#if defined(_WIN32)
+				, m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#endif
+			{
+			}
+
+			~MappedFile() { close(); }
+
+			/// Returns false if the file can't be opened or mapped.
+			bool open(const char *path) {
+				close();
+#if defined(_WIN32)
+				m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+					OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				if (m_file == INVALID_HANDLE_VALUE)
+					return false;
+				LARGE_INTEGER size;
+				if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+					close();
+					return false;
+				}
+				m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (!m_mapping) {
+					close();
+					return false;
+				}
+				m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+				if (!m_data) {
+					close();
+					return false;
+				}
+				m_size = (size_t)size.QuadPart;
+#else
+				const int file = ::open(path, O_RDONLY);
+				if (file < 0)
+					return false;
+				struct stat info;
+				if (fstat(file, &info) != 0 || info.st_size == 0) {
+					::close(file);
+					return false;
+				}
+				void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+				// the mapping keeps its own reference to the file
+				::close(file);
+				if (data == MAP_FAILED)
+					return false;
+				m_data = data;
+				m_size = (size_t)info.st_size;
+#endif
+				return true;
+			}
+
+			void close() {
+#if defined(_WIN32)
+				if (m_data)
+					UnmapViewOfFile(m_data);
+				if (m_mapping)
+					CloseHandle(m_mapping);
+				if (m_file != INVALID_HANDLE_VALUE)
+					CloseHandle(m_file);
+				m_file = INVALID_HANDLE_VALUE;
+				m_mapping = NULL;
+#else
+				if (m_data)
+					munmap(const_cast<void *>(m_data), m_size);
+#endif
+				m_data = NULL;
+				m_size = 0;
+			}
+
+			const void *data() const { return m_data; }
+			size_t size() const { return m_size; }
+
+			void swap(MappedFile &other) {
+				std::swap(m_data, other.m_data);
+				std::swap(m_size, other.m_size);
+#if defined(_WIN32)
+				std::swap(m_file, other.m_file);
+				std::swap(m_mapping, other.m_mapping);
+#endif
+			}
+
+		private:
+			// non copyable
+			MappedFile(const MappedFile &);
+			MappedFile &operator=(const MappedFile &);
+
+			const void *m_data;
+			size_t m_size;
+#if defined(_WIN32)
+			HANDLE m_file;
+			HANDLE m_mapping;
+#endif
+		};
+
+		/// FNV-1a hash of the given bytes.
+		inline uint64_t checksum(const void *data, size_t size) {
+			const unsigned char *bytes = static_cast<const unsigned char *>(data);
+			uint64_t hash = 14695981039346656037ull;
+			for (size_t index = 0; index < size; ++index) {
+				hash ^= bytes[index];
+				hash *= 1099511628211ull;
+			}
+			return hash;
+		}
+	} // namespace detail
+} // namespace spatial
@@ -0,0 +1,149 @@
+//
+//  nearest.h
+//
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace spatial {
+
+	/// Reusable buffers of the k nearest search, the trees keep one per thread
+	/// by default, pass one explicitly to control the memory.
+	/// @note Once the buffers have grown to the working size the search doesn't
+	/// allocate anymore, see reserve.
+	template <typename NodeRef, typename RealType> class NearestScratch {
+	public:
+		struct Entry {
+			RealType distance; ///< Squared distance, or the distance along a ray
+			NodeRef node;
+			uint32_t index; ///< Index of the object in a leaf node
+
+			bool operator<(const Entry &other) const {
+				return distance < other.distance;
+			}
+		};
+
+		NearestScratch() : m_bound(0), m_k(0) {}
+
+		/// Reserves space for the pending nodes and the k best objects.
+		void reserve(size_t nodeCount, uint32_t k) {
+			m_pending.reserve(nodeCount);
+			m_best.reserve(k);
+		}
+
+		/// Starts a search for k objects at most maxDistanceSquare away.
+		void start(uint32_t k, RealType maxDistanceSquare) {
+			m_pending.clear();
+			m_best.clear();
+			m_k = k;
+			m_bound = maxDistanceSquare;
+		}
+
+		/// Returns the current pruning distance.
+		RealType bound() const { return m_bound; }
+
+		/// Returns true if a node or object at the given distance can still
+		/// improve the results.
+		bool accepts(RealType distance) const {
+			return m_best.size() < m_k ? distance <= m_bound : distance < m_bound;
+		}
+
+		void pushNode(NodeRef node, RealType distance) {
+			if (!accepts(distance))
+				return;
+			const Entry entry = { distance, node, 0 };
+			m_pending.push_back(entry);
+			std::push_heap(m_pending.begin(), m_pending.end(), Farther());
+		}
+
+		/// Returns the closest pending node, false if no pending node can
+		/// improve the results.
+		bool popNode(NodeRef &node) {
+			while (!m_pending.empty()) {
+				std::pop_heap(m_pending.begin(), m_pending.end(), Farther());
+				const Entry entry = m_pending.back();
+				m_pending.pop_back();
+				if (!accepts(entry.distance)) {
+					// the remaining ones are even farther
+					m_pending.clear();
+					return false;
+				}
+				node = entry.node;
+				return true;
+			}
+			return false;
+		}
+
+		/// Offers an object, keeps it if it's among the k best.
+		void offer(NodeRef node, uint32_t index, RealType distance) {
+			if (!accepts(distance))
+				return;
+			if (m_best.size() == m_k) {
+				std::pop_heap(m_best.begin(), m_best.end());
+				m_best.pop_back();
+			}
+			const Entry entry = { distance, node, index };
+			m_best.push_back(entry);
+			std::push_heap(m_best.begin(), m_best.end());
+			if (m_best.size() == m_k)
+				m_bound = std::min(m_bound, m_best.front().distance);
+		}
+
+		/// Sorts the k best objects by increasing distance.
+		const std::vector<Entry> &results() {
+			std::sort_heap(m_best.begin(), m_best.end());
+			return m_best;
+		}
+
+	private:
+		struct Farther {
+			bool operator()(const Entry &lhs, const Entry &rhs) const {
+				return lhs.distance > rhs.distance;
+			}
+		};
+
+		std::vector<Entry> m_pending; ///< Min heap of the nodes to visit
+		std::vector<Entry> m_best;    ///< Max heap of the k best objects
+		RealType m_bound;             ///< Pruning distance
+		uint32_t m_k;
+	};
+
+	/// Results of a batch of queries in a compressed sparse row layout, the
+	/// results of the i-th query are values[offsets[i], offsets[i + 1]).
+	/// @note Reuse it between batches to avoid allocations.
+	template <typename ValueType> struct BatchResults {
+		std::vector<size_t> offsets;
+		std::vector<ValueType> values;
+
+		/// Returns the number of queries.
+		size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+		/// Returns the number of results of the given query.
+		size_t count(size_t query) const {
+			return offsets[query + 1] - offsets[query];
+		}
+		const ValueType *begin(size_t query) const {
+			return values.empty() ? NULL : &values[0] + offsets[query];
+		}
+		const ValueType *end(size_t query) const {
+			return values.empty() ? NULL : &values[0] + offsets[query + 1];
+		}
+	};
+
+	namespace detail {
+		/// Returns the squared maximum distance, no limit for a negative distance.
+		template <typename RealType>
+		inline RealType squaredMaxDistance(RealType maxDistance) {
+			if (maxDistance < 0 ||
+				maxDistance >= std::sqrt(std::numeric_limits<RealType>::max()))
+				return std::numeric_limits<RealType>::max();
+			return maxDistance * maxDistance;
+		}
+	} // namespace detail
+} // namespace spatial
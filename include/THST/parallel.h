@@ -0,0 +1,367 @@
+//
+//  parallel.h
+//
+//
+
+#pragma once
+
+#include "config.h"
+
+#ifdef SPATIAL_TREE_USE_CPP11
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+
+		/// Returns the number of threads to use, zero selects the number of
+		/// hardware threads.
+		inline unsigned resolveThreadCount(unsigned threadCount) {
+			if (threadCount == 0)
+				threadCount = std::thread::hardware_concurrency();
+			return threadCount ? threadCount : 1;
+		}
+
+		/// Splits the [0, count) range into contiguous chunks and calls
+		/// function(begin, end, threadIndex) for each of them on its own thread.
+		/// @note The calling thread processes the first chunk.
+		template <typename Function>
+		void parallel_for(size_t count, unsigned threadCount, Function function) {
+			if (count < threadCount)
+				threadCount = (unsigned)count;
+			if (threadCount <= 1) {
+				if (count)
+					function(size_t(0), count, 0u);
+				return;
+			}
+
+			std::vector<std::thread> threads;
+			threads.reserve(threadCount - 1);
+			for (unsigned index = 1; index < threadCount; ++index) {
+				threads.emplace_back(function, count * index / threadCount,
+					count * (index + 1) / threadCount, index);
+			}
+			function(size_t(0), count / threadCount, 0u);
+			for (size_t index = 0; index < threads.size(); ++index)
+				threads[index].join();
+		}
+
+		/// Sorts the range by sorting a chunk per thread and then merging the
+		/// adjacent chunks in parallel.
+		/// @note Not stable, same as std::sort.
+		template <typename RandomIter, typename Compare>
+		void parallel_sort(RandomIter first, RandomIter last, Compare compare,
+			unsigned threadCount) {
+			// below this the thread overhead is higher than the gain
+			static const size_t kMinParallelCount = 4096;
+
+			const size_t count = last - first;
+			if (threadCount <= 1 || count < kMinParallelCount) {
+				std::sort(first, last, compare);
+				return;
+			}
+
+			std::vector<size_t> bounds(threadCount + 1);
+			for (unsigned index = 0; index <= threadCount; ++index)
+				bounds[index] = count * index / threadCount;
+
+			parallel_for(threadCount, threadCount,
+				[&](size_t begin, size_t end, unsigned) {
+				for (size_t chunk = begin; chunk < end; ++chunk)
+					std::sort(first + bounds[chunk], first + bounds[chunk + 1], compare);
+			});
+
+			for (size_t width = 1; width < threadCount; width *= 2) {
+				const size_t mergeCount = (threadCount + 2 * width - 1) / (2 * width);
+				parallel_for(mergeCount, threadCount,
+					[&](size_t begin, size_t end, unsigned) {
+					for (size_t merge = begin; merge < end; ++merge) {
+						const size_t low = merge * 2 * width;
+						const size_t middle = std::min<size_t>(low + width, threadCount);
+						const size_t high = std::min<size_t>(low + 2 * width, threadCount);
+						if (middle < high)
+							std::inplace_merge(first + bounds[low], first + bounds[middle],
+								first + bounds[high], compare);
+					}
+				});
+			}
+		}
+
+		/// Reader-writer spin latch of a node, yields to the other threads while
+		/// waiting. A waiting writer blocks the new readers, so it's not starved
+		/// by the queries.
+		/// @note The copies are unlocked, the latch state isn't copied.
+		class SharedLatch {
+		public:
+			SharedLatch() : m_state(0) {}
+			SharedLatch(const SharedLatch &) : m_state(0) {}
+
+			SharedLatch &operator=(const SharedLatch &) { return *this; }
+
+			void lockExclusive() const {
+				for (unsigned spin = 0;; ++spin) {
+					uint32_t state = m_state.load(std::memory_order_relaxed);
+					if ((state & ~kPending) == 0) {
+						// also clears the pending flag
+						if (m_state.compare_exchange_weak(state, kExclusive,
+							std::memory_order_acquire))
+							return;
+					}
+					else if (!(state & kPending))
+						m_state.fetch_or(kPending, std::memory_order_relaxed);
+					pause(spin);
+				}
+			}
+
+			void unlockExclusive() const {
+				// keeps the flag of the waiting writers
+				m_state.fetch_and(~kExclusive, std::memory_order_release);
+			}
+
+			void lockShared() const {
+				for (unsigned spin = 0;; ++spin) {
+					uint32_t state = m_state.load(std::memory_order_relaxed);
+					if (!(state & (kExclusive | kPending)) &&
+						m_state.compare_exchange_weak(state, state + 1,
+							std::memory_order_acquire))
+						return;
+					pause(spin);
+				}
+			}
+
+			void unlockShared() const {
+				m_state.fetch_sub(1, std::memory_order_release);
+			}
+
+		private:
+			enum { kExclusive = 0x80000000u, kPending = 0x40000000u };
+
+			static void pause(unsigned spin) {
+				if (spin >= 16)
+					std::this_thread::yield();
+			}
+
+			/// Number of readers, or the exclusive flag, and the pending flag.
+			mutable std::atomic<uint32_t> m_state;
+		};
+
+		/// Blocking reader-writer lock, the waiting threads sleep instead of
+		/// spinning, for the locks held during whole queries or bulk updates.
+		/// Same as SharedLatch, a waiting writer blocks the new readers.
+		class SharedMutex {
+		public:
+			SharedMutex() : m_readers(0), m_waitingWriters(0), m_writer(false) {}
+
+			void lockExclusive() const {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				++m_waitingWriters;
+				m_writerGate.wait(lock, [this]() { return !m_writer && m_readers == 0; });
+				--m_waitingWriters;
+				m_writer = true;
+			}
+
+			void unlockExclusive() const {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_writer = false;
+				if (m_waitingWriters)
+					m_writerGate.notify_one();
+				else
+					m_readerGate.notify_all();
+			}
+
+			void lockShared() const {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_readerGate.wait(lock,
+					[this]() { return !m_writer && m_waitingWriters == 0; });
+				++m_readers;
+			}
+
+			void unlockShared() const {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (--m_readers == 0 && m_waitingWriters)
+					m_writerGate.notify_one();
+			}
+
+		private:
+			SharedMutex(const SharedMutex &);
+			SharedMutex &operator=(const SharedMutex &);
+
+			mutable std::mutex m_mutex;
+			mutable std::condition_variable m_readerGate;
+			mutable std::condition_variable m_writerGate;
+			mutable unsigned m_readers;
+			mutable unsigned m_waitingWriters;
+			mutable bool m_writer;
+		};
+
+		/// Set of worker threads running the iterations of parallel loops together
+		/// with the calling threads, avoids starting threads per loop.
+		/// The loops started at the same time, by other threads or from a loop
+		/// iteration, are queued and share the workers: an idle worker joins the
+		/// loop with the fewest workers, and while several loops run the workers
+		/// pick a loop again after each iteration.
+		class ThreadPool {
+		public:
+			/// @param maxThreads maximum number of threads running a loop, including
+			/// the calling one, zero selects the number of hardware threads. The
+			/// workers are started by the first loops needing them.
+			explicit ThreadPool(unsigned maxThreads = 0)
+				: m_maxThreads(resolveThreadCount(maxThreads)), m_loopCount(0),
+				m_stop(false) {}
+
+			~ThreadPool() {
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_stop = true;
+				}
+				m_wake.notify_all();
+				for (size_t index = 0; index < m_workers.size(); ++index)
+					m_workers[index].join();
+			}
+
+			/// Returns the number of threads running a loop started with the thread
+			/// count, zero selects all the threads of the pool.
+			unsigned threadCount(unsigned threadCount) const {
+				return threadCount ? std::min(threadCount, m_maxThreads) : m_maxThreads;
+			}
+
+			/// Calls function(index, threadIndex) for each index of [0, count) and
+			/// returns once all of them are done, the calling thread's index is 0.
+			/// @param threadCount maximum number of threads running the loop,
+			/// including the calling one, zero uses all the threads of the pool.
+			/// @note The thread indices are lower than threadCount(threadCount) and a
+			/// thread index is used by a single thread at a time.
+			template <typename Function>
+			void run(size_t count, Function function, unsigned threadCount = 0) {
+				threadCount = (unsigned)std::min<size_t>(this->threadCount(threadCount), count);
+				if (threadCount <= 1) {
+					for (size_t index = 0; index < count; ++index)
+						function(index, 0u);
+					return;
+				}
+				grow(threadCount);
+
+				Loop loop;
+				loop.invoke = &invoke<Function>;
+				loop.function = &function;
+				loop.count = count;
+				loop.next = 0;
+				loop.active = 0;
+				for (unsigned index = threadCount - 1; index > 0; --index)
+					loop.freeThreads.push_back(index);
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_loops.push_back(&loop);
+					m_loopCount.store(m_loops.size(), std::memory_order_relaxed);
+				}
+				m_wake.notify_all();
+				runTasks(loop, 0);
+
+				// no worker joins the loop once removed, waits for the ones running it
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_loops.erase(std::find(m_loops.begin(), m_loops.end(), &loop));
+				m_loopCount.store(m_loops.size(), std::memory_order_relaxed);
+				m_done.wait(lock, [&]() { return loop.active == 0; });
+			}
+
+		private:
+			/// A running loop, owned by the calling thread.
+			struct Loop {
+				void(*invoke)(void *function, size_t index, unsigned threadIndex);
+				void *function;
+				size_t count;
+				std::atomic<size_t> next;          ///< Next iteration to run
+				std::vector<unsigned> freeThreads; ///< Thread indices left for workers
+				unsigned active;                   ///< Workers running the loop
+			};
+
+			template <typename Function>
+			static void invoke(void *function, size_t index, unsigned threadIndex) {
+				(*static_cast<Function *>(function))(index, threadIndex);
+			}
+
+			/// Starts workers until there are threadCount threads with the calling
+			/// one, the workers are kept for the next loops.
+			void grow(unsigned threadCount) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				while (m_workers.size() + 1 < threadCount)
+					m_workers.emplace_back(&ThreadPool::work, this);
+			}
+
+			/// Returns the loop with iterations and thread indices left that has the
+			/// fewest workers, null if none.
+			Loop *nextLoop() const {
+				Loop *next = NULL;
+				for (size_t index = 0; index < m_loops.size(); ++index) {
+					Loop *loop = m_loops[index];
+					if (loop->freeThreads.empty() ||
+						loop->next.load(std::memory_order_relaxed) >= loop->count)
+						continue;
+					if (!next || loop->active < next->active)
+						next = loop;
+				}
+				return next;
+			}
+
+			void work() {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				for (;;) {
+					Loop *loop = NULL;
+					m_wake.wait(lock,
+						[&]() { return m_stop || (loop = nextLoop()) != NULL; });
+					if (m_stop)
+						return;
+
+					const unsigned threadIndex = loop->freeThreads.back();
+					loop->freeThreads.pop_back();
+					++loop->active;
+					lock.unlock();
+					runTasks(*loop, threadIndex);
+					lock.lock();
+					loop->freeThreads.push_back(threadIndex);
+					if (--loop->active == 0)
+						m_done.notify_all();
+				}
+			}
+
+			/// Runs the iterations left of the loop, a worker leaves the loop after
+			/// an iteration while other loops run so it picks the loop needing it most.
+			void runTasks(Loop &loop, unsigned threadIndex) {
+				for (size_t index = loop.next++; index < loop.count; index = loop.next++) {
+					loop.invoke(loop.function, index, threadIndex);
+					if (threadIndex && m_loopCount.load(std::memory_order_relaxed) > 1)
+						return;
+				}
+			}
+
+			ThreadPool(const ThreadPool &);
+			ThreadPool &operator=(const ThreadPool &);
+
+			const unsigned m_maxThreads;
+			std::vector<std::thread> m_workers;
+			std::vector<Loop *> m_loops;       ///< Loops waiting for workers
+			std::atomic<size_t> m_loopCount;   ///< Size of m_loops, read without lock
+			std::mutex m_mutex;
+			std::condition_variable m_wake;
+			std::condition_variable m_done;
+			bool m_stop;
+		};
+
+		/// Returns the thread pool shared by the parallel queries, limited to
+		/// SPATIAL_TREE_MAX_THREADS threads, the loops start the workers they need.
+		inline ThreadPool &sharedThreadPool() {
+			static ThreadPool pool(SPATIAL_TREE_MAX_THREADS);
+			return pool;
+		}
+
+	} // namespace detail
+} // namespace spatial
+
+#endif // SPATIAL_TREE_USE_CPP11
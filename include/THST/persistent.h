@@ -0,0 +1,99 @@
+//
+//  persistent.h
+//
+//
+
+#pragma once
+
+#include "config.h"
+
+#ifdef SPATIAL_TREE_USE_CPP11
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+		struct snapshot_tag {};
+
+		/// Deletes a published version and then flags it as released, the
+		/// release orders the reads of its readers before the reclamation.
+		template <class TreeClass> struct SnapshotDeleter {
+			std::shared_ptr<std::atomic<bool> > released;
+
+			void operator()(const TreeClass *tree) const {
+				delete tree;
+				released->store(true, std::memory_order_release);
+			}
+		};
+
+		/// Copy on write state of a published tree, shared by the writer and its
+		/// snapshots.
+		/// The nodes of the published versions are immutable, the writer copies
+		/// the nodes it modifies and retires the replaced ones into the epoch of
+		/// the latest version. The nodes of an epoch are deallocated once its
+		/// version and all the older ones have been released.
+		template <class TreeClass, class NodeClass, class AllocatorClass>
+		struct PersistentState {
+			struct Epoch {
+				std::shared_ptr<std::atomic<bool> > released; ///< Set by the deleter
+				std::vector<NodeClass *> retired;  ///< Nodes replaced by copies
+				std::vector<NodeClass *> subtrees; ///< Subtrees dropped by the writer
+			};
+
+			/// Read by the snapshots when they are released.
+			std::atomic<const TreeClass *> writer;
+			AllocatorClass allocator;
+			/// Nodes allocated since the last publish, modified in place.
+			std::unordered_set<const NodeClass *> owned;
+			std::deque<Epoch> epochs;
+			std::shared_ptr<const TreeClass> published;
+
+			PersistentState(const TreeClass *writer, const AllocatorClass &allocator)
+				: writer(writer), allocator(allocator) {}
+
+			~PersistentState() { reclaim(true); }
+
+			bool isOwned(const NodeClass *node) const { return owned.count(node) != 0; }
+
+			void retire(NodeClass *node) {
+				assert(!epochs.empty());
+				epochs.back().retired.push_back(node);
+			}
+
+			/// Deallocates the nodes of the released epochs, or of all of them.
+			void reclaim(bool all) {
+				while (!epochs.empty() &&
+					(all || epochs.front().released->load(std::memory_order_acquire))) {
+					Epoch &epoch = epochs.front();
+					for (size_t i = 0; i < epoch.retired.size(); ++i)
+						detail::deallocate(allocator, epoch.retired[i]);
+					for (size_t i = 0; i < epoch.subtrees.size(); ++i)
+						deallocateSubtree(epoch.subtrees[i]);
+					epochs.pop_front();
+				}
+			}
+
+		private:
+			void deallocateSubtree(NodeClass *root) {
+				std::vector<NodeClass *> stack(1, root);
+				while (!stack.empty()) {
+					NodeClass *node = stack.back();
+					stack.pop_back();
+					if (node->isBranch()) {
+						for (typename NodeClass::count_type index = 0; index < node->count;
+							++index)
+							stack.push_back(node->children[index]);
+					}
+					detail::deallocate(allocator, node);
+				}
+			}
+
+			PersistentState(const PersistentState &);
+			PersistentState &operator=(const PersistentState &);
+		};
+	} // namespace detail
+} // namespace spatial
+#endif
@@ -106,4 +106,29 @@ within(const T min[Dimension], const T max[Dimension]) {
   return predicate_t(typename predicate_t::box_t(min, max));
 }
 
+/// Returned by a node visitor to control the traversal.
+enum VisitResult {
+  eVisitContinue, ///< Visit the children of the node
+  eVisitSkip,     ///< Skip the children of the node
+  eVisitStop      ///< Stop the traversal
+};
+
+namespace detail {
+/// Node visitor which visits all the nodes.
+struct VisitAllNodes {
+  template <typename BBoxClass>
+  inline VisitResult operator()(const BBoxClass &, int) const {
+    return eVisitContinue;
+  }
+};
+
+/// Value visitor which stops at the first value.
+struct StopAtFirst {
+  template <typename ValueType, typename BBoxClass>
+  inline bool operator()(const ValueType &, const BBoxClass &) const {
+    return false;
+  }
+};
+} // namespace detail
+
 } // namespace spatial
@@ -100,6 +100,10 @@ namespace spatial {
 			template <typename Predicate, typename OutIter>
 			size_t queryHierachical(const Predicate &predicate, float factor,
 				OutIter out_it) const;
+			/// @return Returns false if the visitor stopped the traversal.
+			template <typename Predicate, typename Visitor, typename NodeVisitor>
+			bool visit(const Predicate &predicate, Visitor &visitor,
+				NodeVisitor &nodeVisitor) const;
 			template <typename custom_allocator> void clear(custom_allocator &allocator);
 			void translate(const T point[2]);
 			size_t count() const;
@@ -371,6 +375,38 @@ namespace spatial {
 			return foundCount;
 		}
 
+		TREE_TEMPLATE
+			template <typename Predicate, typename Visitor, typename NodeVisitor>
+		bool TREE_QUAL::visit(const Predicate &predicate, Visitor &visitor,
+			NodeVisitor &nodeVisitor) const {
+			for (typename ObjectList::const_iterator it = objects.begin();
+				it != objects.end(); ++it) {
+				if (predicate(it->box) && !visitor(it->value, it->box))
+					return false;
+			}
+
+			if (isLeaf())
+				return true;
+
+			for (int i = 0; i < 4; i++) {
+				assert(children[i]);
+
+				const QuadTreeNode &node = *children[i];
+				if (!predicate.bbox.overlaps(node.box))
+					continue;
+
+				const VisitResult result = nodeVisitor(node.box, node.level);
+				if (result == eVisitStop)
+					return false;
+				if (result == eVisitContinue && !node.visit(predicate, visitor, nodeVisitor))
+					return false;
+				// Break if we know that the zone is fully contained by a region
+				if (node.box.contains(predicate.bbox))
+					break;
+			}
+			return true;
+		}
+
 		TREE_TEMPLATE
 			void TREE_QUAL::translate(const T point[2]) {
 			for (typename ObjectList::iterator it = objects.begin(); it != objects.end();
@@ -0,0 +1,76 @@
+//
+//  ray.h
+//
+//
+
+#pragma once
+
+#include "bbox.h"
+
+#include <limits>
+
+namespace spatial {
+
+	/// Ray with the inverse direction and the direction signs precomputed for the
+	/// slab test, the distances along the ray are in units of the direction.
+	template <typename RealType, int Dimension> struct Ray {
+		RealType origin[Dimension];
+		RealType direction[Dimension];
+		RealType invDirection[Dimension];
+		/// Is one if the direction is negative on the axis, selects the far slab.
+		int sign[Dimension];
+
+		Ray(const RealType rayOrigin[Dimension],
+			const RealType rayDirection[Dimension]) {
+			for (int axis = 0; axis < Dimension; ++axis) {
+				origin[axis] = rayOrigin[axis];
+				direction[axis] = rayDirection[axis];
+				invDirection[axis] = rayDirection[axis] != (RealType)0
+					? (RealType)1 / rayDirection[axis]
+					: std::numeric_limits<RealType>::max();
+				sign[axis] = rayDirection[axis] < (RealType)0;
+			}
+		}
+
+		/// Returns true if the ray enters the bbox within [0, tMax].
+		/// @param tEntry receives the distance where the ray enters the bbox, zero
+		/// if the origin is inside.
+		template <typename T>
+		bool intersects(const BoundingBox<T, Dimension> &bbox, RealType tMax,
+			RealType &tEntry) const {
+			RealType tMin = 0;
+			for (int axis = 0; axis < Dimension; ++axis) {
+				if (direction[axis] == (RealType)0) {
+					// parallel to the slab
+					if (origin[axis] < (RealType)bbox.min[axis] ||
+						origin[axis] > (RealType)bbox.max[axis])
+						return false;
+					continue;
+				}
+
+				const RealType nearSlab = (RealType)(sign[axis] ? bbox.max[axis] : bbox.min[axis]);
+				const RealType farSlab = (RealType)(sign[axis] ? bbox.min[axis] : bbox.max[axis]);
+				const RealType tNear = (nearSlab - origin[axis]) * invDirection[axis];
+				const RealType tFar = (farSlab - origin[axis]) * invDirection[axis];
+				if (tNear > tMin)
+					tMin = tNear;
+				if (tFar < tMax)
+					tMax = tFar;
+				if (tMin > tMax)
+					return false;
+			}
+			tEntry = tMin;
+			return true;
+		}
+	};
+
+	namespace detail {
+		/// Uses the distance where the ray enters the bbox of the value as hit.
+		struct BoxHit {
+			template <typename ValueType, typename RealType>
+			RealType operator()(const ValueType &, RealType boxDistance) const {
+				return boxDistance;
+			}
+		};
+	} // namespace detail
+} // namespace spatial
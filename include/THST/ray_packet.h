@@ -0,0 +1,141 @@
+//
+//  ray_packet.h
+//
+//
+
+#pragma once
+
+#include "bbox.h"
+#include "soa_node.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace spatial {
+	namespace detail {
+		/// Slab tests a bbox against the rays of a packet stored as structure of
+		/// arrays, returns the mask of the rays which enter the bbox within their
+		/// [0, tMax] range.
+		template <typename RealType, int Dimension, int Stride> struct RaySlabKernel {
+			static uint32_t mask(const RealType(&origin)[Dimension][Stride],
+				const RealType(&invDirection)[Dimension][Stride],
+				const RealType(&tMax)[Stride],
+				const RealType(&bboxMin)[Dimension],
+				const RealType(&bboxMax)[Dimension], uint32_t count, uint32_t active) {
+				uint32_t mask = 0;
+				for (uint32_t lane = 0; lane < count; ++lane) {
+					if (!(active & (uint32_t(1) << lane)))
+						continue;
+					RealType tNear = 0;
+					RealType tFar = tMax[lane];
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const RealType t0 = (bboxMin[axis] - origin[axis][lane]) * invDirection[axis][lane];
+						const RealType t1 = (bboxMax[axis] - origin[axis][lane]) * invDirection[axis][lane];
+						tNear = std::max(tNear, std::min(t0, t1));
+						tFar = std::min(tFar, std::max(t0, t1));
+					}
+					mask |= uint32_t(tNear <= tFar) << lane;
+				}
+				return mask;
+			}
+		};
+
+#if defined(SPATIAL_TREE_SIMD_AVX) || defined(SPATIAL_TREE_SIMD_SSE2)
+		template <int Dimension, int Stride>
+		struct RaySlabKernel<float, Dimension, Stride> {
+			static uint32_t mask(const float(&origin)[Dimension][Stride],
+				const float(&invDirection)[Dimension][Stride],
+				const float(&tMax)[Stride], const float(&bboxMin)[Dimension],
+				const float(&bboxMax)[Dimension], uint32_t count, uint32_t active) {
+				uint32_t mask = 0;
+				for (uint32_t lane = 0; lane < count; lane += 4) {
+					if (!((active >> lane) & 0xF))
+						continue;
+					__m128 tNear = _mm_setzero_ps();
+					__m128 tFar = _mm_loadu_ps(tMax + lane);
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const __m128 rayOrigin = _mm_loadu_ps(origin[axis] + lane);
+						const __m128 inv = _mm_loadu_ps(invDirection[axis] + lane);
+						const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bboxMin[axis]), rayOrigin), inv);
+						const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bboxMax[axis]), rayOrigin), inv);
+						tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+						tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+					}
+					mask |= uint32_t(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar))) << lane;
+				}
+				return mask;
+			}
+		};
+#endif
+
+		/// Gathers the hits of a packet as ray index and value pairs.
+		template <typename ValueType> struct HitGatherer {
+			std::vector<std::pair<uint32_t, ValueType> > *hits;
+
+			explicit HitGatherer(std::vector<std::pair<uint32_t, ValueType> > &hits)
+				: hits(&hits) {}
+
+			void operator()(uint32_t ray, const ValueType &value) const {
+				hits->push_back(std::make_pair(ray, value));
+			}
+		};
+	} // namespace detail
+
+	/// Packet of coherent rays traversed together, the node boxes are tested
+	/// against all the active rays at once.
+	/// @note A ray is the segment [0, tMax] from its origin, the boxes behind
+	/// the origin aren't hit, unlike with RTree::rayQuery.
+	/// @note The distances along the rays are in units of their direction.
+	template <typename RealType, int Dimension, int MaxRays = 16> struct RayPacket {
+		/// Padded to whole SIMD widths.
+		enum { kMaxRays = MaxRays, kStride = (MaxRays + 7) & ~7 };
+
+		RealType origin[Dimension][kStride];
+		RealType invDirection[Dimension][kStride];
+		RealType tMax[kStride];
+		uint32_t count;
+
+		RayPacket() : count(0) {
+			// the padding lanes never hit
+			std::fill(&origin[0][0], &origin[0][0] + Dimension * kStride, RealType(0));
+			std::fill(&invDirection[0][0], &invDirection[0][0] + Dimension * kStride, RealType(0));
+			std::fill(tMax, tMax + kStride, RealType(-1));
+		}
+
+		/// Adds a ray, returns false if the packet is full.
+		bool add(const RealType rayOrigin[Dimension],
+			const RealType rayDirection[Dimension],
+			RealType rayMax = std::numeric_limits<RealType>::max()) {
+			if (count >= (uint32_t)MaxRays)
+				return false;
+
+			for (int axis = 0; axis < Dimension; ++axis) {
+				origin[axis][count] = rayOrigin[axis];
+				// a large inverse keeps the parallel rays free of NaNs
+				invDirection[axis][count] = rayDirection[axis] != (RealType)0
+					? (RealType)1 / rayDirection[axis]
+					: std::numeric_limits<RealType>::max();
+			}
+			tMax[count] = rayMax;
+			++count;
+			return true;
+		}
+
+		/// Returns the mask of the active rays which hit the bbox.
+		template <typename T>
+		uint32_t hitMask(const BoundingBox<T, Dimension> &bbox, uint32_t active) const {
+			SPATIAL_TREE_STATIC_ASSERT(MaxRays <= 32, "Maximum 32 rays for the mask!");
+
+			RealType bboxMin[Dimension], bboxMax[Dimension];
+			for (int axis = 0; axis < Dimension; ++axis) {
+				bboxMin[axis] = (RealType)bbox.min[axis];
+				bboxMax[axis] = (RealType)bbox.max[axis];
+			}
+			return detail::RaySlabKernel<RealType, Dimension, kStride>::mask(
+				origin, invDirection, tMax, bboxMin, bboxMax, count, active) & active;
+		}
+	};
+} // namespace spatial
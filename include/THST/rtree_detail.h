@@ -5,6 +5,13 @@
 
 #pragma once
 
+#include "hilbert.h"
+
+#include <deque>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
 //#define TREE_DEBUG_TAG
 
 namespace spatial {
@@ -52,6 +59,71 @@ namespace spatial {
 			int m_tos;                           ///< Top Of Stack index
 		};                                     // class stack_iterator
 
+		/// Floor of the base 2 logarithm.
+		template <int N> struct Log2 {
+			enum { value = 1 + Log2<N / 2>::value };
+		};
+		template <> struct Log2<1> {
+			enum { value = 0 };
+		};
+
+		/// Upper bound of the height of a tree with up to 2^64 items, where each
+		/// node but the root has at least min_child_items children.
+		template <int min_child_items> struct MaxTreeHeight {
+			enum {
+				value = 64 / Log2<(min_child_items > 1 ? min_child_items : 2)>::value + 1
+			};
+		};
+
+		/// Fixed size stack which replaces the recursion of the tree traversals,
+		/// each frame keeps a node and the cursor to its next child.
+		template <typename NodePtr, typename Cursor, int Capacity>
+		class TraversalStack {
+		public:
+			struct Frame {
+				NodePtr node;
+				Cursor cursor;
+			};
+
+			TraversalStack() : m_size(0) {}
+
+			bool empty() const { return m_size == 0; }
+
+			Frame &top() {
+				assert(m_size > 0);
+				return m_frames[m_size - 1];
+			}
+			const Frame &top() const {
+				assert(m_size > 0);
+				return m_frames[m_size - 1];
+			}
+
+			void push(NodePtr node, Cursor cursor = Cursor()) {
+				assert(m_size < Capacity);
+				Frame &frame = m_frames[m_size++];
+				frame.node = node;
+				frame.cursor = cursor;
+			}
+
+			/// Pushes a frame whose cursor is set in place by the caller, for the
+			/// cursors too large to copy.
+			Frame &pushFrame(NodePtr node) {
+				assert(m_size < Capacity);
+				Frame &frame = m_frames[m_size++];
+				frame.node = node;
+				return frame;
+			}
+
+			void pop() {
+				assert(m_size > 0);
+				--m_size;
+			}
+
+		private:
+			Frame m_frames[Capacity];
+			int m_size;
+		};
+
 		/// May be data or may be another subtree
 		/// The parents level determines this.
 		/// If the parents level is 0, then this is data
@@ -61,15 +133,31 @@ namespace spatial {
 			NodeClass *child;
 
 #ifndef NDEBUG
-			Branch() : child(NULL) {}
+			Branch() : value(), child(NULL) {}
 #endif
 		}; // Branch
 
-		template <typename ValueType, class BBoxClass, int max_child_items>
-		struct Node {
+		/// Layout of the child bounding boxes of a node, selects the query
+		/// traversal of the tree.
+		struct aos_layout_tag {};
+		struct soa_layout_tag {};
+
+		/// Latch of the nodes which aren't shared between threads, takes no space.
+		struct NoLatch {};
+
+		/// @tparam LatchClass base class which latches the node, used by the
+		/// concurrent tree.
+		template <typename ValueType, class BBoxClass, int max_child_items,
+			class LatchClass = NoLatch>
+		struct Node : LatchClass {
 			typedef Branch<ValueType, BBoxClass, Node> branch_type;
 			typedef uint32_t count_type;
 			typedef BBoxClass box_type;
+			typedef aos_layout_tag layout_tag;
+
+			/// @note If has_branch_values is false then the branch nodes have no
+			/// values, if is_level_sized is true then a node can't change its level.
+			enum { has_branch_values = 1, is_level_sized = 0 };
 
 			count_type count; ///< Number of branches in the node
 			int32_t level;    ///< Leaf is zero, others positive
@@ -100,6 +188,15 @@ namespace spatial {
 
 				return bbox;
 			}
+			void setBBox(count_type index, const BBoxClass &bbox) {
+				assert(index < count);
+				bboxes[index] = bbox;
+			}
+			void getBranch(count_type index, branch_type &branch) const {
+				branch.bbox = bboxes[index];
+				branch.value = values[index];
+				branch.child = children[index];
+			}
 			bool addBranch(const branch_type &branch) {
 				if (count >= max_child_items) // Split is necessary
 					return false;
@@ -124,6 +221,216 @@ namespace spatial {
 			}
 		}; // Node
 
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactLeaf;
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactBranch;
+
+		/// Node without the arrays unused by its level, the header shared by the
+		/// leaves, CompactLeaf, which add only the values and the branch nodes,
+		/// CompactBranch, which add only the children.
+		/// @note The ValueType must be trivial and the branch nodes have no values,
+		/// i.e. no hierarchical values. A node is allocated as a leaf or a branch
+		/// by its level, see the spatial::allocator specialization.
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactNode {
+			typedef Branch<ValueType, BBoxClass, CompactNode> branch_type;
+			typedef uint32_t count_type;
+			typedef BBoxClass box_type;
+			typedef aos_layout_tag layout_tag;
+			typedef CompactLeaf<ValueType, BBoxClass, max_child_items> leaf_type;
+			typedef CompactBranch<ValueType, BBoxClass, max_child_items> branch_node_type;
+
+			enum { has_branch_values = 0, is_level_sized = 1 };
+
+			count_type count; ///< Number of branches in the node
+			int32_t level;    ///< Leaf is zero, others positive
+			BBoxClass bboxes[max_child_items];
+			/// Array of the leaf or branch node
+			union {
+				ValueType *values;
+				CompactNode **children;
+			};
+
+			/// Copies the branches, the node must have the same level.
+			CompactNode &operator=(const CompactNode &node) {
+				assert(level == node.level);
+				copy(node);
+				return *this;
+			}
+
+			/// Returns the size of a node of the given level.
+			static size_t allocationSize(int level) {
+				return level > 0 ? sizeof(branch_node_type) : sizeof(leaf_type);
+			}
+
+			bool isBranch() const { return (level > 0); }
+
+			bool isLeaf() const { return (level == 0); }
+
+			BBoxClass cover() const {
+				BBoxClass bbox = bboxes[0];
+				for (count_type index = 1; index < count; ++index) {
+					bbox.extend(bboxes[index]);
+				}
+
+				return bbox;
+			}
+			void setBBox(count_type index, const BBoxClass &bbox) {
+				assert(index < count);
+				bboxes[index] = bbox;
+			}
+			void getBranch(count_type index, branch_type &branch) const {
+				branch.bbox = bboxes[index];
+				if (isLeaf()) {
+					branch.value = values[index];
+					branch.child = NULL;
+				}
+				else
+					branch.child = children[index];
+			}
+			bool addBranch(const branch_type &branch) {
+				if (count >= max_child_items) // Split is necessary
+					return false;
+
+				if (isLeaf())
+					values[count] = branch.value;
+				else
+					children[count] = branch.child;
+				bboxes[count++] = branch.bbox;
+				return true;
+			}
+			void disconnectBranch(count_type index) {
+				assert(index < max_child_items);
+				assert(count > 0);
+
+				--count;
+				if (isLeaf())
+					values[index] = values[count];
+				else
+					children[index] = children[count];
+				bboxes[index] = bboxes[count];
+			}
+
+		protected:
+			explicit CompactNode(int level) : count(0), level(level) {}
+
+		private:
+			CompactNode(const CompactNode &);
+
+			// copies only the used part of the arrays
+			void copy(const CompactNode &node) {
+				count = node.count;
+				level = node.level;
+				for (count_type index = 0; index < count; ++index) {
+					bboxes[index] = node.bboxes[index];
+					if (isLeaf())
+						values[index] = node.values[index];
+					else
+						children[index] = node.children[index];
+				}
+			}
+		}; // CompactNode
+
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactLeaf : CompactNode<ValueType, BBoxClass, max_child_items> {
+			ValueType leafValues[max_child_items];
+
+			explicit CompactLeaf(int level = 0)
+				: CompactNode<ValueType, BBoxClass, max_child_items>(level) {
+				assert(level == 0);
+				this->values = leafValues;
+			}
+		};
+
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct CompactBranch : CompactNode<ValueType, BBoxClass, max_child_items> {
+			CompactNode<ValueType, BBoxClass, max_child_items> *branchChildren[max_child_items];
+
+			explicit CompactBranch(int level)
+				: CompactNode<ValueType, BBoxClass, max_child_items>(level) {
+				assert(level > 0);
+				this->children = branchChildren;
+			}
+		};
+
+		/// Complete type of the leaves of a node class.
+		template <class NodeClass> struct LeafNode {
+			typedef NodeClass type;
+		};
+
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct LeafNode<CompactNode<ValueType, BBoxClass, max_child_items> > {
+			typedef CompactLeaf<ValueType, BBoxClass, max_child_items> type;
+		};
+
+		/// Node source of the parallel packing, the leaves are staged per thread and
+		/// later copied to the tree allocator.
+		template <class NodeClass> struct StagingNodePool {
+			std::deque<typename LeafNode<NodeClass>::type> nodes; // stable addresses on growth
+
+			NodeClass *allocate(int level) {
+				assert(level == 0);
+				nodes.emplace_back(level);
+				return &nodes.back();
+			}
+		};
+
+		/// Writes the pairs of a join to an output iterator.
+		template <typename OutIter, typename ValueType, typename OtherValueType>
+		struct PairWriter {
+			OutIter out_it;
+
+			explicit PairWriter(OutIter out_it) : out_it(out_it) {}
+
+			void operator()(const ValueType &value, const OtherValueType &other) {
+				*out_it = std::make_pair(value, other);
+				++out_it;
+			}
+		};
+
+		/// Sorts the few children of a node, cheaper than std::sort for at most
+		/// max_child_items elements.
+		template <typename T> inline void insertionSort(T *first, T *last) {
+			for (T *current = first + (first != last); current < last; ++current) {
+				const T item = *current;
+				T *hole = current;
+				for (; hole != first && item < *(hole - 1); --hole)
+					*hole = *(hole - 1);
+				*hole = item;
+			}
+		}
+
+		/// Orders the branches by the center of their bbox along the given axis.
+		template <class BranchClass> struct BranchCenterCompare {
+			int axis;
+
+			explicit BranchCenterCompare(int axis) : axis(axis) {}
+
+			inline bool operator()(const BranchClass &a, const BranchClass &b) const {
+				// avoid division, the half is the same for both sides
+				return (a.bbox.min[axis] + a.bbox.max[axis]) <
+					(b.bbox.min[axis] + b.bbox.max[axis]);
+			}
+		};
+
+		/// Orders the branch indices by the lower or upper bound of their bbox along
+		/// the given axis.
+		template <class BranchClass> struct BranchBoundCompare {
+			const BranchClass *branches;
+			int axis;
+			bool upper;
+
+			BranchBoundCompare(const BranchClass *branches, int axis, bool upper)
+				: branches(branches), axis(axis), upper(upper) {}
+
+			inline bool operator()(uint32_t a, uint32_t b) const {
+				const BranchClass &branchA = branches[a];
+				const BranchClass &branchB = branches[b];
+				return upper ? branchA.bbox.max[axis] < branchB.bbox.max[axis]
+					: branchA.bbox.min[axis] < branchB.bbox.min[axis];
+			}
+		};
 
 		struct AlwayTruePredicate {
 
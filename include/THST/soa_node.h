@@ -0,0 +1,279 @@
+//
+//  soa_node.h
+//
+//
+
+#pragma once
+
+#include "bbox.h"
+#include "predicates.h"
+#include "rtree_detail.h"
+
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SPATIAL_TREE_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) ||                                  \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPATIAL_TREE_SIMD_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace spatial {
+	namespace detail {
+
+		/// Returns the index of the lowest set bit, the mask must not be zero.
+		inline uint32_t lowestBitIndex(uint64_t mask) {
+			assert(mask);
+#if defined(__GNUC__) || defined(__clang__)
+			return (uint32_t)__builtin_ctzll(mask);
+#elif defined(_MSC_VER) && defined(_M_X64)
+			unsigned long index;
+			_BitScanForward64(&index, mask);
+			return (uint32_t)index;
+#else
+			uint32_t index = 0;
+			while (!(mask & 1)) {
+				mask >>= 1;
+				++index;
+			}
+			return index;
+#endif
+		}
+
+		/// Tests the boxes in the structure of arrays layout against a box and
+		/// returns the bitmask of the overlapping ones.
+		/// @note Reads the arrays in whole SIMD widths, the stride must be padded.
+		template <typename T, int Dimension, int Stride> struct OverlapKernel {
+			static uint64_t mask(const T(&mins)[Dimension][Stride],
+				const T(&maxs)[Dimension][Stride],
+				const BoundingBox<T, Dimension> &bbox, uint32_t count) {
+				uint64_t mask = 0;
+				for (uint32_t index = 0; index < count; ++index) {
+					bool overlaps = true;
+					for (int axis = 0; axis < Dimension; ++axis) {
+						overlaps &= (mins[axis][index] <= bbox.max[axis]) &
+							(bbox.min[axis] <= maxs[axis][index]);
+					}
+					mask |= uint64_t(overlaps) << index;
+				}
+				return mask;
+			}
+		};
+
+#if defined(SPATIAL_TREE_SIMD_AVX)
+		template <int Dimension, int Stride>
+		struct OverlapKernel<float, Dimension, Stride> {
+			static uint64_t mask(const float(&mins)[Dimension][Stride],
+				const float(&maxs)[Dimension][Stride],
+				const BoundingBox<float, Dimension> &bbox, uint32_t count) {
+				uint64_t mask = 0;
+				for (uint32_t index = 0; index < count; index += 8) {
+					__m256 lanes = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const __m256 min = _mm256_loadu_ps(mins[axis] + index);
+						const __m256 max = _mm256_loadu_ps(maxs[axis] + index);
+						lanes = _mm256_and_ps(lanes,
+							_mm256_cmp_ps(min, _mm256_set1_ps(bbox.max[axis]), _CMP_LE_OQ));
+						lanes = _mm256_and_ps(lanes,
+							_mm256_cmp_ps(_mm256_set1_ps(bbox.min[axis]), max, _CMP_LE_OQ));
+					}
+					mask |= uint64_t(_mm256_movemask_ps(lanes)) << index;
+				}
+				return mask;
+			}
+		};
+
+		template <int Dimension, int Stride>
+		struct OverlapKernel<double, Dimension, Stride> {
+			static uint64_t mask(const double(&mins)[Dimension][Stride],
+				const double(&maxs)[Dimension][Stride],
+				const BoundingBox<double, Dimension> &bbox, uint32_t count) {
+				uint64_t mask = 0;
+				for (uint32_t index = 0; index < count; index += 4) {
+					__m256d lanes = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const __m256d min = _mm256_loadu_pd(mins[axis] + index);
+						const __m256d max = _mm256_loadu_pd(maxs[axis] + index);
+						lanes = _mm256_and_pd(lanes,
+							_mm256_cmp_pd(min, _mm256_set1_pd(bbox.max[axis]), _CMP_LE_OQ));
+						lanes = _mm256_and_pd(lanes,
+							_mm256_cmp_pd(_mm256_set1_pd(bbox.min[axis]), max, _CMP_LE_OQ));
+					}
+					mask |= uint64_t(_mm256_movemask_pd(lanes)) << index;
+				}
+				return mask;
+			}
+		};
+#elif defined(SPATIAL_TREE_SIMD_SSE2)
+		template <int Dimension, int Stride>
+		struct OverlapKernel<float, Dimension, Stride> {
+			static uint64_t mask(const float(&mins)[Dimension][Stride],
+				const float(&maxs)[Dimension][Stride],
+				const BoundingBox<float, Dimension> &bbox, uint32_t count) {
+				uint64_t mask = 0;
+				for (uint32_t index = 0; index < count; index += 4) {
+					__m128 lanes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const __m128 min = _mm_loadu_ps(mins[axis] + index);
+						const __m128 max = _mm_loadu_ps(maxs[axis] + index);
+						lanes = _mm_and_ps(lanes, _mm_cmple_ps(min, _mm_set1_ps(bbox.max[axis])));
+						lanes = _mm_and_ps(lanes, _mm_cmple_ps(_mm_set1_ps(bbox.min[axis]), max));
+					}
+					mask |= uint64_t(_mm_movemask_ps(lanes)) << index;
+				}
+				return mask;
+			}
+		};
+
+		template <int Dimension, int Stride>
+		struct OverlapKernel<double, Dimension, Stride> {
+			static uint64_t mask(const double(&mins)[Dimension][Stride],
+				const double(&maxs)[Dimension][Stride],
+				const BoundingBox<double, Dimension> &bbox, uint32_t count) {
+				uint64_t mask = 0;
+				for (uint32_t index = 0; index < count; index += 2) {
+					__m128d lanes = _mm_castsi128_pd(_mm_set1_epi32(-1));
+					for (int axis = 0; axis < Dimension; ++axis) {
+						const __m128d min = _mm_loadu_pd(mins[axis] + index);
+						const __m128d max = _mm_loadu_pd(maxs[axis] + index);
+						lanes = _mm_and_pd(lanes, _mm_cmple_pd(min, _mm_set1_pd(bbox.max[axis])));
+						lanes = _mm_and_pd(lanes, _mm_cmple_pd(_mm_set1_pd(bbox.min[axis]), max));
+					}
+					mask |= uint64_t(_mm_movemask_pd(lanes)) << index;
+				}
+				return mask;
+			}
+		};
+#endif
+
+		template <typename ValueType, class BBoxClass, int max_child_items>
+		struct SoaNode;
+
+		/// Node which also keeps the bounding boxes of its children in a structure
+		/// of arrays layout, i.e. a min and max array per axis, so that all the
+		/// children are tested at once by the SSE/AVX kernels.
+		/// @note Select it via the value_type of the tree allocator, it costs an
+		/// extra copy of the bounding boxes per node and supports up to 64 children.
+		template <typename ValueType, typename T, int Dimension, int max_child_items>
+		struct SoaNode<ValueType, BoundingBox<T, Dimension>, max_child_items> {
+			typedef BoundingBox<T, Dimension> bbox_type;
+			typedef Branch<ValueType, bbox_type, SoaNode> branch_type;
+			typedef uint32_t count_type;
+			typedef bbox_type box_type;
+			typedef soa_layout_tag layout_tag;
+
+			enum { has_branch_values = 1, is_level_sized = 0 };
+
+			/// Padded to the widest SIMD register, 8 floats.
+			enum { kStride = (max_child_items + 7) & ~7 };
+
+			count_type count; ///< Number of branches in the node
+			int32_t level;    ///< Leaf is zero, others positive
+			ValueType values[max_child_items];
+			bbox_type bboxes[max_child_items];
+			SoaNode *children[max_child_items];
+			T mins[Dimension][kStride];
+			T maxs[Dimension][kStride];
+
+			SoaNode() : level(0) { clearLanes(); }
+
+			SoaNode(int level) : count(0), level(level) { clearLanes(); }
+
+			bool isBranch() const { return (level > 0); }
+
+			bool isLeaf() const { return (level == 0); }
+
+			bbox_type cover() const {
+				bbox_type bbox = bboxes[0];
+				for (count_type index = 1; index < count; ++index) {
+					bbox.extend(bboxes[index]);
+				}
+
+				return bbox;
+			}
+			void setBBox(count_type index, const bbox_type &bbox) {
+				assert(index < count);
+				bboxes[index] = bbox;
+				for (int axis = 0; axis < Dimension; ++axis) {
+					mins[axis][index] = bbox.min[axis];
+					maxs[axis][index] = bbox.max[axis];
+				}
+			}
+			void getBranch(count_type index, branch_type &branch) const {
+				branch.bbox = bboxes[index];
+				branch.value = values[index];
+				branch.child = children[index];
+			}
+			bool addBranch(const branch_type &branch) {
+				if (count >= max_child_items) // Split is necessary
+					return false;
+
+				values[count] = branch.value;
+				children[count] = branch.child;
+				++count;
+				setBBox(count - 1, branch.bbox);
+				return true;
+			}
+
+			void disconnectBranch(count_type index) {
+				assert(index < max_child_items);
+				assert(count > 0);
+
+				values[index] = values[--count];
+				children[index] = children[count];
+				bboxes[index] = bboxes[count];
+				for (int axis = 0; axis < Dimension; ++axis) {
+					mins[axis][index] = mins[axis][count];
+					maxs[axis][index] = maxs[axis][count];
+				}
+			}
+
+			/// Returns the bitmask of the children which overlap the bbox.
+			uint64_t overlapMask(const bbox_type &bbox) const {
+				SPATIAL_TREE_STATIC_ASSERT(max_child_items <= 64,
+					"Maximum 64 children for the mask!");
+
+				const uint64_t mask =
+					OverlapKernel<T, Dimension, kStride>::mask(mins, maxs, bbox, count);
+				// discard the padding lanes
+				return count < 64 ? mask & ((uint64_t(1) << count) - 1) : mask;
+			}
+
+		private:
+			// the kernels load whole registers, the lanes past the count hold empty
+			// boxes which never overlap
+			void clearLanes() {
+				std::fill(&mins[0][0], &mins[0][0] + Dimension * kStride,
+					NumericLimits<T>::highest());
+				std::fill(&maxs[0][0], &maxs[0][0] + Dimension * kStride,
+					NumericLimits<T>::lowest());
+			}
+		}; // SoaNode
+
+		/// Returns the bitmask of the children which match the predicate.
+		template <class NodeClass, typename Predicate>
+		inline uint64_t childMask(const NodeClass &node, const Predicate &predicate) {
+			uint64_t mask = 0;
+			for (typename NodeClass::count_type index = 0; index < node.count;
+				++index) {
+				if (predicate(node.bboxes[index]))
+					mask |= uint64_t(1) << index;
+			}
+			return mask;
+		}
+
+		template <class NodeClass, typename T, int Dimension>
+		inline uint64_t childMask(
+			const NodeClass &node,
+			const SpatialPredicate<T, Dimension, intersects_tag> &predicate) {
+			return node.overlapMask(predicate.bbox);
+		}
+	} // namespace detail
+} // namespace spatial
@@ -79,4 +79,31 @@ namespace test {
 
 		size_t count;
 	};
+
+	// heap allocator which counts the live nodes, the copies share the counter
+	template <class NodeClass> struct counting_allocator {
+		typedef NodeClass value_type;
+		typedef NodeClass *ptr_type;
+
+		enum { is_overflowable = 0 };
+
+		explicit counting_allocator(long *live = NULL) : live(live) {}
+
+		ptr_type allocate(int level) {
+			if (live)
+				++*live;
+			return new NodeClass(level);
+		}
+
+		void deallocate(const ptr_type node) {
+			assert(node);
+			if (live)
+				--*live;
+			delete node;
+		}
+
+		bool overflowed() const { return false; }
+
+		long *live;
+	};
 }
@@ -177,3 +177,87 @@ TEST_CASE("test insert") {
 		CHECK(results.size() == 7);
 	}
 }
+
+TEST_CASE("test visit") {
+	int min[]{ 0, 0 };
+	int max[]{ 256, 256 };
+	spatial::QuadTree<int, Box2<int>, 4> qtree{ min, max };
+	qtree.insert(std::begin(kBoxes), std::end(kBoxes));
+
+	int searchMin[]{ 0, 0 };
+	int searchMax[]{ 40, 40 };
+	std::vector<Box2<int>> expected;
+	qtree.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(expected));
+	REQUIRE(expected.size() > 3);
+
+	SUBCASE("visits all the matches") {
+		std::vector<Box2<int>> visited;
+		CHECK(qtree.visit(spatial::intersects<2>(searchMin, searchMax),
+			[&visited](const Box2<int>& value, const spatial::BoundingBox<int, 2>&) {
+				visited.push_back(value);
+				return true;
+			}));
+		CHECK(visited == expected);
+	}
+
+	SUBCASE("stops early") {
+		std::vector<Box2<int>> visited;
+		CHECK(!qtree.visit(spatial::intersects<2>(searchMin, searchMax),
+			[&visited](const Box2<int>& value, const spatial::BoundingBox<int, 2>&) {
+				visited.push_back(value);
+				return visited.size() < 3;
+			}));
+		CHECK(visited == std::vector<Box2<int>>(expected.begin(), expected.begin() + 3));
+	}
+
+	SUBCASE("skips the child nodes") {
+		int nodeCount{ 0 };
+		std::vector<Box2<int>> visited;
+		CHECK(qtree.visit(spatial::intersects<2>(searchMin, searchMax),
+			[&visited](const Box2<int>& value, const spatial::BoundingBox<int, 2>&) {
+				visited.push_back(value);
+				return true;
+			},
+			[&nodeCount](const spatial::BoundingBox<int, 2>&, int) {
+				++nodeCount;
+				return spatial::eVisitSkip;
+			}));
+		CHECK(nodeCount > 0);
+		CHECK(visited.size() < expected.size());
+	}
+}
+
+TEST_CASE("test parallel query") {
+	int min[]{ 0, 0 };
+	int max[]{ 256, 256 };
+	spatial::QuadTree<int, Box2<int>, 4> qtree{ min, max };
+	qtree.insert(std::begin(kBoxes), std::end(kBoxes));
+
+	typedef decltype(spatial::intersects<2>(min, max)) predicate_t;
+	std::vector<predicate_t> predicates;
+	for (int y = 0; y < 256; y += 16) {
+		for (int x = 0; x < 256; x += 16) {
+			int queryMin[]{ x, y };
+			int queryMax[]{ x + 24, y + 24 };
+			predicates.push_back(spatial::intersects<2>(queryMin, queryMax));
+		}
+	}
+
+	for (unsigned threadCount : { 1u, 3u }) {
+		CAPTURE(threadCount);
+		spatial::BatchResults<Box2<int>> results;
+		const size_t total = qtree.parallel_query(predicates.data(), predicates.size(),
+			results, threadCount);
+		REQUIRE(results.size() == predicates.size());
+		CHECK(results.values.size() == total);
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < predicates.size(); ++i) {
+			std::vector<Box2<int>> expected;
+			qtree.query(predicates[i], std::back_inserter(expected));
+			mismatches += expected != std::vector<Box2<int>>(results.begin(i), results.end(i));
+		}
+		CHECK(mismatches == 0);
+		CHECK(total > sizeof(kBoxes) / sizeof(kBoxes[0]));
+	}
+}
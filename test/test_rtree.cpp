@@ -3,11 +3,26 @@
 #include "custom_allocator.h"
 
 #define SPATIAL_TREE_ALLOCATOR 2
+// the parallel tests need the worker threads even on a single core
+#define SPATIAL_TREE_MAX_THREADS 4
 
+#include <THST/ConcurrentRTree.h>
+#include <THST/FrozenRTree.h>
 #include <THST/RTree.h>
+#include <THST/ShardedRTree.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <numeric>
+#include <set>
 #include <sstream>
+#include <thread>
 
 template <typename T> struct Point {
 	union {
@@ -387,6 +402,2130 @@ TEST_CASE("custom indexable for array and indices as values")
 	CHECK(resultsStream.str() == "index: 9 object9 min: 3 3 max: 12 16 | index: 10 object10 min: 0 0 max: 64 32 | index: 11 object11 min: 3 2 max: 32 35 | index: 1 object1 min: 1 1 max: 2 2 | index: 7 object7 min: 2 1 max: 2 3 | index: 0 object0 min: 5 2 max: 16 7 | index: 5 object5 min: 0 0 max: 8 8 | index: 6 object6 min: 4 4 max: 6 8 | index: 8 object8 min: 4 2 max: 8 4 | ");
 }
 
+// deterministic pseudo random boxes, used for comparing the tree variants
+std::vector<Box2<int>> generateBoxes(size_t count, int worldSize = 1000, int maxSize = 20) {
+	std::vector<Box2<int>> result(count);
+	uint32_t seed = 12345;
+	auto next = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (int)(seed >> 8);
+	};
+	for (auto& box : result) {
+		box.min[0] = next() % worldSize;
+		box.min[1] = next() % worldSize;
+		box.max[0] = box.min[0] + next() % maxSize;
+		box.max[1] = box.min[1] + next() % maxSize;
+	}
+	return result;
+}
+
+template <class TreeClass>
+std::vector<size_t> queryIndices(const TreeClass& tree, const Box2<int>& searchBox)
+{
+	std::vector<size_t> indices;
+	tree.query(spatial::intersects<2>(searchBox.min, searchBox.max), std::back_inserter(indices));
+	std::sort(indices.begin(), indices.end());
+	return indices;
+}
+
+struct VectorIndexable {
+
+	VectorIndexable(const std::vector<Box2<int>>& array) : array(&array) {}
+
+	const int* min(const size_t index) const { return (*array)[index].min; }
+	const int* max(const size_t index) const { return (*array)[index].max; }
+
+	const std::vector<Box2<int>>* array;
+};
+
+TEST_CASE("bulk loading")
+{
+	SUBCASE("small range")
+	{
+		rtree_box_t rtree;
+		rtree.bulk_load(std::begin(kBoxes), std::end(kBoxes));
+		CHECK(rtree.count() == 16u);
+		CHECK(rtree.levels() == 1);
+
+		rtree_box_t::bbox_type treeBBox = rtree.bbox();
+		CHECK(treeBBox.min[0] == 0);
+		CHECK(treeBBox.min[1] == 0);
+		CHECK(treeBBox.max[0] == 256);
+		CHECK(treeBBox.max[1] == 128);
+
+		std::vector<Box2<int>> results;
+		Box2<int> box = { {0, 0}, {20, 50} };
+		rtree.query(spatial::contains<2>(box.min, box.max), std::back_inserter(results));
+		CHECK(results.size() == 7);
+
+		// the packed tree is still dynamic
+		rtree.insert(box);
+		CHECK(rtree.count() == 17u);
+		CHECK(rtree.remove(box));
+		CHECK(rtree.count() == 16u);
+
+		// loading replaces the previous content
+		rtree.bulk_load(std::begin(kBoxes), std::begin(kBoxes) + 3);
+		CHECK(rtree.count() == 3u);
+		CHECK(rtree.levels() == 0);
+		rtree.bulk_load(std::begin(kBoxes), std::begin(kBoxes));
+		CHECK(rtree.count() == 0u);
+	}
+
+	SUBCASE("same results as the iterative insertion")
+	{
+		const std::vector<Box2<int>> values = generateBoxes(1000);
+		std::vector<size_t> indices(values.size());
+		std::iota(indices.begin(), indices.end(), 0);
+
+		typedef spatial::RTree<int, size_t, 2, 4, 2, VectorIndexable> tree_t;
+		VectorIndexable indexable(values);
+		tree_t packed(indices.begin(), indices.end(), indexable);
+		tree_t inserted(indexable);
+		inserted.insert(indices.begin(), indices.end());
+		CHECK(packed.count() == 1000u);
+		CHECK(packed.levels() == 4);
+
+		// all nodes except the root must be at least half full
+		bool validFill = true;
+		for (auto it = packed.dbegin(); it.valid(); it.next()) {
+			size_t childCount = 0;
+			for (auto nodeIt = it.child(); nodeIt.valid(); nodeIt.next())
+				++childCount;
+			validFill &= childCount >= tree_t::min_items;
+		}
+		CHECK(validFill);
+
+		const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(packed, query) != queryIndices(inserted, query);
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+TEST_CASE("hilbert packing")
+{
+	SUBCASE("consecutive curve cells are neighbours")
+	{
+		const int kBits = 3;
+		const uint32_t kSize = 1 << kBits;
+		std::vector<std::pair<uint64_t, Point<int>>> cells;
+		for (uint32_t x = 0; x < kSize; ++x) {
+			for (uint32_t y = 0; y < kSize; ++y) {
+				const uint32_t coords[2] = { x, y };
+				Point<int> cell;
+				cell.set(x, y);
+				cells.emplace_back(spatial::detail::hilbertIndex<2>(coords, kBits), cell);
+			}
+		}
+		std::sort(cells.begin(), cells.end(),
+			[](const std::pair<uint64_t, Point<int>>& a, const std::pair<uint64_t, Point<int>>& b) { return a.first < b.first; });
+
+		bool adjacent = true;
+		for (size_t i = 0; i < cells.size(); ++i) {
+			adjacent &= cells[i].first == i;
+			if (i > 0) {
+				const Point<int>& a = cells[i - 1].second;
+				const Point<int>& b = cells[i].second;
+				adjacent &= std::abs(a.x - b.x) + std::abs(a.y - b.y) == 1;
+			}
+		}
+		CHECK(adjacent);
+	}
+
+	SUBCASE("same results as the iterative insertion")
+	{
+		const std::vector<Box2<int>> values = generateBoxes(1000);
+		std::vector<size_t> indices(values.size());
+		std::iota(indices.begin(), indices.end(), 0);
+
+		typedef spatial::RTree<int, size_t, 2, 4, 2, VectorIndexable> tree_t;
+		VectorIndexable indexable(values);
+		tree_t packed(indexable);
+		packed.bulk_load(indices.begin(), indices.end(), spatial::rtree::eHilbertSort);
+		tree_t inserted(indexable);
+		inserted.insert(indices.begin(), indices.end());
+		CHECK(packed.count() == 1000u);
+		CHECK(packed.levels() == 4);
+
+		// leaves are filled consecutively, only the last two can be partially full
+		size_t leafCount = 0, fullLeafCount = 0;
+		for (auto it = packed.dbegin(); it.valid(); it.next()) {
+			if (it.level() != 1)
+				continue;
+			size_t childCount = 0;
+			for (auto nodeIt = it.child(); nodeIt.valid(); nodeIt.next())
+				++childCount;
+			++leafCount;
+			fullLeafCount += childCount == tree_t::max_items;
+		}
+		CHECK(leafCount == 250u);
+		CHECK(fullLeafCount == 250u);
+
+		const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(packed, query) != queryIndices(inserted, query);
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+TEST_CASE("parallel bulk loading")
+{
+	const std::vector<Box2<int>> values = generateBoxes(20000, 10000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 10000, 500);
+
+	typedef spatial::RTree<int, size_t, 2, 8, 4, VectorIndexable> tree_t;
+	VectorIndexable indexable(values);
+
+	SUBCASE("sort tile recursive")
+	{
+		tree_t sequential(indexable);
+		sequential.bulk_load(indices.begin(), indices.end());
+		tree_t parallel(indexable);
+		parallel.bulk_load(indices.begin(), indices.end(), spatial::rtree::eSortTileRecursive, 4);
+		CHECK(parallel.count() == values.size());
+		CHECK(parallel.levels() == sequential.levels());
+
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(parallel, query) != queryIndices(sequential, query);
+		}
+		CHECK(mismatches == 0);
+	}
+
+	SUBCASE("hilbert packing gives the same tree")
+	{
+		tree_t sequential(indexable);
+		sequential.bulk_load(indices.begin(), indices.end(), spatial::rtree::eHilbertSort);
+		tree_t parallel(indexable);
+		parallel.bulk_load(indices.begin(), indices.end(), spatial::rtree::eHilbertSort, 3);
+		CHECK(parallel.count() == values.size());
+		CHECK(parallel.levels() == sequential.levels());
+
+		std::vector<size_t> sequentialOrder, parallelOrder;
+		for (auto it = sequential.lbegin(); it.valid(); it.next())
+			sequentialOrder.push_back(*it);
+		for (auto it = parallel.lbegin(); it.valid(); it.next())
+			parallelOrder.push_back(*it);
+		CHECK(parallelOrder == sequentialOrder);
+	}
+
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+	SUBCASE("custom allocator")
+	{
+		typedef spatial::detail::Node<size_t, spatial::BoundingBox<int, 2>, 8> node_t;
+		typedef test::tree_allocator<node_t, false> allocator_t;
+		typedef spatial::RTree<int, size_t, 2, 8, 4, VectorIndexable, spatial::box::eNormalVolume,
+			float, allocator_t> custom_tree_t;
+
+		allocator_t allocator;
+		allocator.resize(custom_tree_t::nodeCount(values.size()) + 1);
+		custom_tree_t parallel(indexable, allocator);
+		parallel.bulk_load(indices.begin(), indices.end(), spatial::rtree::eSortTileRecursive, 0);
+		CHECK(parallel.count() == values.size());
+
+		tree_t sequential(indexable);
+		sequential.bulk_load(indices.begin(), indices.end());
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(parallel, query) != queryIndices(sequential, query);
+		}
+		CHECK(mismatches == 0);
+	}
+#endif
+}
+
+// sum of the volumes of the leaf nodes
+template <class TreeClass>
+float leafVolume(TreeClass& tree)
+{
+	float volume = 0;
+	for (auto it = tree.dbegin(); it.valid(); it.next()) {
+		if (it.level() == 1)
+			volume += it.bbox().template volume<spatial::box::eNormalVolume, float>();
+	}
+	return volume;
+}
+
+TEST_CASE("rstar split policy")
+{
+	const std::vector<Box2<int>> values = generateBoxes(2000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable, spatial::box::eNormalVolume,
+		float, spatial::allocator<spatial::detail::Node<size_t, spatial::BoundingBox<int, 2>, 8>>,
+		spatial::rtree::rstar> rstar_tree_t;
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> quadratic_tree_t;
+
+	VectorIndexable indexable(values);
+	rstar_tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	quadratic_tree_t quadratic(indexable);
+	quadratic.insert(indices.begin(), indices.end());
+	CHECK(rtree.count() == values.size());
+
+	SUBCASE("nodes are not underfilled")
+	{
+		size_t underfilled = 0;
+		for (auto it = rtree.dbegin(); it.valid(); it.next()) {
+			if (it.level() == 0)
+				continue;
+			size_t childCount = 0;
+			for (auto nodeIt = it.child(); nodeIt.valid(); nodeIt.next())
+				++childCount;
+			underfilled += childCount < rstar_tree_t::min_items;
+		}
+		CHECK(underfilled == 0);
+		CHECK(leafVolume(rtree) < leafVolume(quadratic));
+	}
+
+	SUBCASE("same results as the quadratic split")
+	{
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(rtree, query) != queryIndices(quadratic, query);
+		}
+		CHECK(mismatches == 0);
+
+		for (size_t i = 0; i < indices.size(); i += 2) {
+			rtree.remove(indices[i]);
+			quadratic.remove(indices[i]);
+		}
+		CHECK(rtree.count() == values.size() / 2);
+		for (const auto& query : queries) {
+			mismatches += queryIndices(rtree, query) != queryIndices(quadratic, query);
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+// inserts and removes the values, checks the node fill and compares the
+// query results with the default quadratic split
+template <class SplitPolicy>
+void checkSplitPolicy(const std::vector<Box2<int>>& values)
+{
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable, spatial::box::eNormalVolume,
+		float, spatial::allocator<spatial::detail::Node<size_t, spatial::BoundingBox<int, 2>, 16>>,
+		SplitPolicy> tree_t;
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable> quadratic_tree_t;
+
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	quadratic_tree_t quadratic(indexable);
+	quadratic.insert(indices.begin(), indices.end());
+	CHECK(rtree.count() == values.size());
+
+	size_t underfilled = 0;
+	for (auto it = rtree.dbegin(); it.valid(); it.next()) {
+		if (it.level() == 0)
+			continue;
+		size_t childCount = 0;
+		for (auto nodeIt = it.child(); nodeIt.valid(); nodeIt.next())
+			++childCount;
+		underfilled += childCount < tree_t::min_items;
+	}
+	CHECK(underfilled == 0);
+
+	size_t mismatches = 0;
+	for (const auto& query : queries) {
+		mismatches += queryIndices(rtree, query) != queryIndices(quadratic, query);
+	}
+	CHECK(mismatches == 0);
+
+	for (size_t i = 0; i < indices.size(); i += 3) {
+		rtree.remove(indices[i]);
+		quadratic.remove(indices[i]);
+	}
+	CHECK(rtree.count() == quadratic.count());
+	for (const auto& query : queries) {
+		mismatches += queryIndices(rtree, query) != queryIndices(quadratic, query);
+	}
+	CHECK(mismatches == 0);
+}
+
+TEST_CASE("split policies")
+{
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+
+	SUBCASE("linear split")
+	{
+		checkSplitPolicy<spatial::rtree::linear>(values);
+	}
+
+	SUBCASE("ang tan split")
+	{
+		checkSplitPolicy<spatial::rtree::ang_tan>(values);
+	}
+
+	SUBCASE("ang tan split of identical boxes")
+	{
+		// all the boxes are on the same side, the groups are rebalanced
+		checkSplitPolicy<spatial::rtree::ang_tan>(std::vector<Box2<int>>(200, Box2<int>{ {5, 5}, {10, 10} }));
+	}
+}
+
+// compares the queries of the SoA node layout with the default one, the trees
+// have the same structure so the results must be in the same order
+template <typename T>
+struct BoxIndexable {
+
+	BoxIndexable(const std::vector<spatial::BoundingBox<T, 2>>& array) : array(&array) {}
+
+	const T* min(const size_t index) const { return (*array)[index].min; }
+	const T* max(const size_t index) const { return (*array)[index].max; }
+
+	const std::vector<spatial::BoundingBox<T, 2>>* array;
+};
+
+template <typename T>
+void checkSoaNode(const std::vector<Box2<int>>& values)
+{
+	typedef spatial::BoundingBox<T, 2> bbox_t;
+	typedef spatial::RTree<T, size_t, 2, 16, 6, BoxIndexable<T>,
+		spatial::box::eNormalVolume, float,
+		spatial::allocator<spatial::detail::SoaNode<size_t, bbox_t, 16>>> soa_tree_t;
+	typedef spatial::RTree<T, size_t, 2, 16, 6, BoxIndexable<T>> tree_t;
+
+	std::vector<bbox_t> boxes;
+	for (const auto& value : values) {
+		const T min[2] = { (T)value.min[0], (T)value.min[1] };
+		const T max[2] = { (T)value.max[0], (T)value.max[1] };
+		boxes.push_back(bbox_t(min, max));
+	}
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	// the lanes read by the kernels past the count hold empty boxes
+	typedef spatial::detail::SoaNode<size_t, bbox_t, 16> node_t;
+	node_t node(0);
+	typename node_t::branch_type branch = typename node_t::branch_type();
+	branch.bbox = boxes[0];
+	node.addBranch(branch);
+	for (int lane = 1; lane < node_t::kStride; ++lane) {
+		CHECK(node.mins[0][lane] > node.maxs[0][lane]);
+		CHECK(node.mins[1][lane] > node.maxs[1][lane]);
+	}
+
+	BoxIndexable<T> indexable(boxes);
+	soa_tree_t rtree(indexable);
+	tree_t reference(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	reference.insert(indices.begin(), indices.end());
+
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+	auto compare = [&]() {
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			const T min[2] = { (T)query.min[0], (T)query.min[1] };
+			const T max[2] = { (T)query.max[0], (T)query.max[1] };
+			std::vector<size_t> results, expected;
+			rtree.query(spatial::intersects<2>(min, max), std::back_inserter(results));
+			reference.query(spatial::intersects<2>(min, max), std::back_inserter(expected));
+			mismatches += results != expected;
+			results.clear();
+			expected.clear();
+			rtree.query(spatial::contains<2>(min, max), std::back_inserter(results));
+			reference.query(spatial::contains<2>(min, max), std::back_inserter(expected));
+			mismatches += results != expected;
+		}
+		return mismatches;
+	};
+	CHECK(compare() == 0);
+
+	for (size_t i = 0; i < values.size(); i += 3) {
+		rtree.remove(i);
+		reference.remove(i);
+	}
+	CHECK(rtree.count() == reference.count());
+	CHECK(compare() == 0);
+
+	// translates only the nodes, the queries are offset as well
+	rtree.bulk_load(indices.begin(), indices.end());
+	reference.bulk_load(indices.begin(), indices.end());
+	CHECK(compare() == 0);
+}
+
+TEST_CASE("soa node layout")
+{
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+
+	SUBCASE("float, SIMD kernel")
+	{
+		checkSoaNode<float>(values);
+	}
+
+	SUBCASE("double, SIMD kernel")
+	{
+		checkSoaNode<double>(values);
+	}
+
+	SUBCASE("int, scalar kernel")
+	{
+		checkSoaNode<int>(values);
+	}
+}
+
+TEST_CASE("compact nodes")
+{
+	typedef spatial::detail::Node<size_t, spatial::BoundingBox<int, 2>, 16> node_t;
+	typedef spatial::detail::CompactNode<size_t, spatial::BoundingBox<int, 2>, 16> compact_node_t;
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable, spatial::box::eNormalVolume,
+		float, spatial::allocator<compact_node_t>> compact_tree_t;
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable> tree_t;
+
+	typedef spatial::detail::CompactNode<uint32_t, spatial::BoundingBox<int, 2>, 16> compact_id_node_t;
+	CHECK(compact_id_node_t::allocationSize(0) < compact_id_node_t::allocationSize(1));
+	CHECK(compact_node_t::allocationSize(1) < sizeof(node_t));
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+
+	VectorIndexable indexable(values);
+	compact_tree_t rtree(indexable);
+	tree_t reference(indexable);
+	auto compare = [&](const compact_tree_t& tree) {
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			mismatches += queryIndices(tree, query) != queryIndices(reference, query);
+		}
+		return mismatches;
+	};
+
+	SUBCASE("insert and remove")
+	{
+		rtree.insert(indices.begin(), indices.end());
+		reference.insert(indices.begin(), indices.end());
+		CHECK(compare(rtree) == 0);
+
+		for (size_t i = 0; i < indices.size(); i += 3) {
+			rtree.remove(indices[i]);
+			reference.remove(indices[i]);
+		}
+		CHECK(rtree.count() == reference.count());
+		CHECK(compare(rtree) == 0);
+
+		std::vector<size_t> leaves;
+		for (auto it = rtree.lbegin(); it.valid(); it.next())
+			leaves.push_back(*it);
+		std::sort(leaves.begin(), leaves.end());
+		std::vector<size_t> expected;
+		for (auto it = reference.lbegin(); it.valid(); it.next())
+			expected.push_back(*it);
+		std::sort(expected.begin(), expected.end());
+		CHECK(leaves == expected);
+
+		const float origin[2] = { 0.5f, 0.5f };
+		const float direction[2] = { 1.f, 1.f };
+		std::vector<size_t> hits, expectedHits;
+		rtree.rayQuery(origin, direction, std::back_inserter(hits));
+		reference.rayQuery(origin, direction, std::back_inserter(expectedHits));
+		std::sort(hits.begin(), hits.end());
+		std::sort(expectedHits.begin(), expectedHits.end());
+		CHECK(hits == expectedHits);
+	}
+
+	SUBCASE("bulk loading and copy")
+	{
+		rtree.bulk_load(indices.begin(), indices.end());
+		reference.bulk_load(indices.begin(), indices.end());
+		CHECK(compare(rtree) == 0);
+
+		compact_tree_t copy(rtree);
+		CHECK(compare(copy) == 0);
+
+		compact_tree_t assigned(indexable);
+		assigned.insert(indices.begin(), indices.begin() + 10);
+		assigned = rtree;
+		CHECK(assigned.count() == rtree.count());
+		CHECK(compare(assigned) == 0);
+
+		rtree.bulk_load(indices.begin(), indices.end(), spatial::rtree::eHilbertSort, 4);
+		CHECK(compare(rtree) == 0);
+	}
+
+	SUBCASE("small tree")
+	{
+		// the root is a leaf
+		rtree.insert(indices.begin(), indices.begin() + 5);
+		CHECK(rtree.dbegin().valid());
+		compact_tree_t copy(rtree);
+		CHECK(copy.count() == 5);
+	}
+}
+
+// compares the queries of the frozen tree with the ones of the source tree,
+// including the order of the results
+template <class TreeClass, class FrozenTreeClass>
+size_t compareFrozen(const TreeClass& tree, const FrozenTreeClass& frozen,
+	const std::vector<Box2<int>>& queries)
+{
+	size_t mismatches = 0;
+	for (const auto& query : queries) {
+		std::vector<size_t> results, expected;
+		frozen.query(spatial::intersects<2>(query.min, query.max), std::back_inserter(results));
+		tree.query(spatial::intersects<2>(query.min, query.max), std::back_inserter(expected));
+		mismatches += results != expected;
+
+		results.clear();
+		expected.clear();
+		frozen.hierachical_query(spatial::intersects<2>(query.min, query.max), std::back_inserter(results));
+		tree.hierachical_query(spatial::intersects<2>(query.min, query.max), std::back_inserter(expected));
+		mismatches += results != expected;
+
+		results.clear();
+		expected.clear();
+		frozen.k_nearest(query.min, 10, std::back_inserter(results));
+		tree.k_nearest(query.min, 10, std::back_inserter(expected));
+		mismatches += results != expected;
+
+		results.clear();
+		expected.clear();
+		const float origin[2] = { (float)query.min[0], (float)query.min[1] };
+		const float direction[2] = { 1.f, 0.5f };
+		frozen.rayQuery(origin, direction, std::back_inserter(results));
+		tree.rayQuery(origin, direction, std::back_inserter(expected));
+		mismatches += results != expected;
+	}
+	return mismatches;
+}
+
+TEST_CASE("frozen rtree")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+	typedef spatial::FrozenRTree<int, size_t, 2, 8> frozen_tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+
+	SUBCASE("empty tree")
+	{
+		frozen_tree_t frozen(rtree);
+		CHECK(frozen.count() == 0);
+		CHECK(!frozen.query(spatial::intersects<2>(queries[0].min, queries[0].max)));
+	}
+
+	SUBCASE("inserted tree")
+	{
+		rtree.insert(indices.begin(), indices.end());
+		// hierarchical values on the branch nodes
+		size_t branchValue = values.size();
+		for (auto it = rtree.dbegin(); it.valid(); it.next())
+			*it = branchValue++;
+
+		frozen_tree_t frozen(rtree);
+		CHECK(frozen.count() == rtree.count());
+		CHECK(frozen.levels() == rtree.levels());
+		CHECK(frozen.bbox().min[0] == rtree.bbox().min[0]);
+		CHECK(frozen.bbox().max[1] == rtree.bbox().max[1]);
+		CHECK(frozen.nodes()[0].level == (int)rtree.levels());
+		CHECK(compareFrozen(rtree, frozen, queries) == 0);
+
+		rtree.setQueryTargetLevel(1);
+		frozen.setQueryTargetLevel(1);
+		CHECK(compareFrozen(rtree, frozen, queries) == 0);
+	}
+
+	SUBCASE("bulk loaded tree")
+	{
+		rtree.bulk_load(indices.begin(), indices.end(), spatial::rtree::eHilbertSort);
+		frozen_tree_t frozen(rtree);
+		CHECK(compareFrozen(rtree, frozen, queries) == 0);
+
+		// children are stored after their parent, level by level
+		for (size_t i = 0; i < frozen.nodeCount(); ++i) {
+			const auto& node = frozen.nodes()[i];
+			if (node.isBranch())
+				CHECK(frozen.nodes()[node.firstChild].level == node.level - 1);
+		}
+	}
+
+	SUBCASE("raw pointer output")
+	{
+		rtree.insert(indices.begin(), indices.end());
+		frozen_tree_t frozen(rtree);
+		REQUIRE(frozen.levels() > 2);
+
+		// the output iterator must advance across the subtrees
+		const int min[2] = { 0, 0 };
+		const int max[2] = { 1000, 1000 };
+		std::vector<size_t> results(values.size() * 2), expected(values.size() * 2);
+		size_t count = frozen.query(spatial::intersects<2>(min, max), results.data());
+		CHECK(count == rtree.query(spatial::intersects<2>(min, max), expected.data()));
+		CHECK(count == values.size());
+		CHECK(std::equal(expected.begin(), expected.begin() + count, results.begin()));
+
+		rtree.setQueryTargetLevel(1);
+		frozen.setQueryTargetLevel(1);
+		const int queryMin[2] = { 100, 100 };
+		const int queryMax[2] = { 900, 900 };
+		count = frozen.hierachical_query(spatial::intersects<2>(queryMin, queryMax), results.data());
+		CHECK(count == rtree.hierachical_query(spatial::intersects<2>(queryMin, queryMax), expected.data()));
+		CHECK(count > 1);
+		CHECK(std::equal(expected.begin(), expected.begin() + count, results.begin()));
+
+		const float origin[2] = { 0.f, 0.f };
+		const float direction[2] = { 1.f, 1.f };
+		count = frozen.rayQuery(origin, direction, results.data());
+		CHECK(count == rtree.rayQuery(origin, direction, expected.data()));
+		CHECK(count > 1);
+		CHECK(std::equal(expected.begin(), expected.begin() + count, results.begin()));
+	}
+
+	SUBCASE("layout without branch values")
+	{
+		typedef spatial::detail::CompactNode<size_t, spatial::BoundingBox<int, 2>, 8> compact_node_t;
+		typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable, spatial::box::eNormalVolume,
+			float, spatial::allocator<compact_node_t>> compact_tree_t;
+
+		compact_tree_t compact(indexable);
+		compact.insert(indices.begin(), indices.end());
+		frozen_tree_t frozen(compact);
+		CHECK(!frozen.hasBranchValues());
+
+		size_t mismatches = 0;
+		for (const auto& query : queries) {
+			std::vector<size_t> results, expected;
+			frozen.query(spatial::intersects<2>(query.min, query.max), std::back_inserter(results));
+			compact.query(spatial::intersects<2>(query.min, query.max), std::back_inserter(expected));
+			mismatches += results != expected;
+		}
+		CHECK(mismatches == 0);
+
+		// the branch values aren't returned as results
+		const int min[2] = { 0, 0 };
+		const int max[2] = { 1000, 1000 };
+		std::vector<size_t> results;
+		CHECK(frozen.hierachical_query(spatial::intersects<2>(min, max), std::back_inserter(results)) == 0);
+		CHECK(results.empty());
+
+		const char* path = "test_rtree_frozen_compact.bin";
+		REQUIRE(frozen.save(path));
+		frozen_tree_t mapped;
+		REQUIRE(mapped.open(path, true));
+		CHECK(!mapped.hasBranchValues());
+		CHECK(mapped.hierachical_query(spatial::intersects<2>(min, max)) == false);
+		mapped = frozen_tree_t();
+		remove(path);
+
+		frozen_tree_t regular(rtree);
+		CHECK(regular.hasBranchValues());
+	}
+}
+
+TEST_CASE("mapped frozen rtree")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+	typedef spatial::FrozenRTree<int, size_t, 2, 8> frozen_tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(100, 1000, 100);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	const char* path = "test_rtree_frozen.bin";
+
+	{
+		frozen_tree_t frozen(rtree);
+		frozen.setQueryTargetLevel(1);
+		REQUIRE(frozen.save(path));
+	}
+
+	SUBCASE("open")
+	{
+		frozen_tree_t mapped;
+		REQUIRE(mapped.open(path, true));
+		CHECK(mapped.count() == rtree.count());
+		CHECK(mapped.levels() == rtree.levels());
+
+		rtree.setQueryTargetLevel(1);
+		CHECK(compareFrozen(rtree, mapped, queries) == 0);
+
+		// the copy owns its nodes
+		frozen_tree_t copy(mapped);
+		mapped = frozen_tree_t();
+		CHECK(compareFrozen(rtree, copy, queries) == 0);
+	}
+
+	SUBCASE("validation")
+	{
+		std::vector<char> data;
+		{
+			std::ifstream file(path, std::ios::binary);
+			data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		// copy to an 8 byte aligned buffer
+		std::vector<uint64_t> buffer((data.size() + 7) / 8);
+		memcpy(&buffer[0], &data[0], data.size());
+		frozen_tree_t frozen;
+		CHECK(frozen.load(&buffer[0], data.size(), true));
+		CHECK(!frozen.load(&buffer[0], data.size() - 1));
+
+		// different tree type
+		spatial::FrozenRTree<float, size_t, 2, 8> floatTree;
+		CHECK(!floatTree.open(path));
+		spatial::FrozenRTree<int, size_t, 3, 8> tree3d;
+		CHECK(!tree3d.open(path));
+		spatial::FrozenRTree<int, size_t, 2, 16> wideTree;
+		CHECK(!wideTree.open(path));
+
+		// corrupted header and nodes
+		char* bytes = reinterpret_cast<char*>(&buffer[0]);
+		bytes[8] ^= 1;
+		CHECK(!frozen.load(&buffer[0], data.size()));
+		bytes[8] ^= 1;
+		bytes[data.size() - 1] ^= 1;
+		CHECK(frozen.load(&buffer[0], data.size()));
+		CHECK(!frozen.load(&buffer[0], data.size(), true));
+		bytes[data.size() - 1] ^= 1;
+		CHECK(!frozen.open("missing_file.bin"));
+
+		// damaged nodes are rejected without verifying the checksum
+		typedef frozen_tree_t::node_type node_t;
+		node_t* nodes = reinterpret_cast<node_t*>(bytes + sizeof(spatial::detail::FrozenHeader));
+		const size_t nodeCount = (data.size() - sizeof(spatial::detail::FrozenHeader)) / sizeof(node_t);
+		REQUIRE(nodes[1].isBranch());
+		node_t& node = nodes[1];
+		const node_t original = node;
+		auto damaged = [&](void (*damage)(node_t&, size_t)) {
+			damage(node, nodeCount);
+			const bool loaded = frozen.load(&buffer[0], data.size());
+			node = original;
+			return !loaded;
+		};
+		CHECK(damaged([](node_t& n, size_t) { n.count = frozen_tree_t::max_items + 1; }));
+		CHECK(damaged([](node_t& n, size_t count) { n.firstChild = (uint32_t)count - 1; }));
+		CHECK(damaged([](node_t& n, size_t) { n.firstChild = 1; }));
+		CHECK(damaged([](node_t& n, size_t) { n.level += 1; }));
+		CHECK(damaged([](node_t& n, size_t) { n.level = -1; }));
+		CHECK(frozen.load(&buffer[0], data.size(), true));
+
+		// a damaged mapped file
+		{
+			std::ofstream file(path, std::ios::binary);
+			node.firstChild = 0xFFFFFFF0u;
+			file.write(bytes, data.size());
+			node = original;
+		}
+		CHECK(!frozen.open(path));
+	}
+
+	remove(path);
+}
+
+// squared minimum distance of the point to the box
+float squareDistance(const int point[2], const Box2<int>& box) {
+	float distance = 0;
+	for (int axis = 0; axis < 2; ++axis) {
+		const int d = std::max(std::max(box.min[axis] - point[axis], 0), point[axis] - box.max[axis]);
+		distance += float(d) * d;
+	}
+	return distance;
+}
+
+TEST_CASE("bounded k nearest")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(50, 1000, 1);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	spatial::FrozenRTree<int, size_t, 2, 8> frozen(rtree);
+
+	tree_t::nearest_scratch_type scratch;
+	scratch.reserve(256, 20);
+	std::vector<size_t> results, frozenResults;
+	results.reserve(20);
+	size_t mismatches = 0;
+	for (const auto& query : queries) {
+		// brute force distances
+		std::vector<float> expected;
+		for (const auto& value : values)
+			expected.push_back(squareDistance(query.min, value));
+		std::sort(expected.begin(), expected.end());
+
+		results.clear();
+		CHECK(rtree.k_nearest(query.min, 20, std::back_inserter(results), scratch) == 20);
+		for (size_t i = 0; i < results.size(); ++i)
+			mismatches += squareDistance(query.min, values[results[i]]) != expected[i];
+
+		frozenResults.clear();
+		frozen.k_nearest(query.min, 20, std::back_inserter(frozenResults));
+		mismatches += results != frozenResults;
+
+		// only the objects within the distance
+		const float maxDistance = 15.f;
+		results.clear();
+		rtree.k_nearest(query.min, 20, std::back_inserter(results), maxDistance);
+		const size_t withinCount =
+			std::upper_bound(expected.begin(), expected.end(), maxDistance * maxDistance) - expected.begin();
+		CHECK(results.size() == std::min<size_t>(withinCount, 20));
+		for (size_t index : results)
+			mismatches += squareDistance(query.min, values[index]) > maxDistance * maxDistance;
+	}
+	CHECK(mismatches == 0);
+	CHECK(rtree.k_nearest(queries[0].min, 0, std::back_inserter(results)) == 0);
+	CHECK(rtree.k_nearest(queries[0].min, 5, std::back_inserter(results), 0.f) <= 5);
+}
+
+TEST_CASE("batched k nearest")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(200, 1000, 1);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	std::vector<int> points;
+	for (const auto& query : queries)
+		points.insert(points.end(), query.min, query.min + 2);
+
+	spatial::BatchResults<size_t> batch;
+	for (float maxDistance : { -1.f, 12.f }) {
+		const size_t total = rtree.k_nearest_batch(points.data(), queries.size(), 8, batch, maxDistance);
+		REQUIRE(batch.size() == queries.size());
+		CHECK(batch.values.size() == total);
+
+		size_t mismatches = 0;
+		std::vector<size_t> expected;
+		for (size_t i = 0; i < queries.size(); ++i) {
+			expected.clear();
+			rtree.k_nearest(queries[i].min, 8, std::back_inserter(expected), maxDistance);
+			mismatches += !std::equal(expected.begin(), expected.end(), batch.begin(i)) ||
+				batch.count(i) != expected.size();
+		}
+		CHECK(mismatches == 0);
+	}
+
+	// an unbounded k with a radius only stores the found values
+	const uint32_t allValues = std::numeric_limits<uint32_t>::max();
+	size_t withinTotal = 0;
+	std::vector<size_t> within;
+	for (const auto& query : queries)
+		withinTotal += rtree.within_distance(query.min, 12.f, std::back_inserter(within));
+	CHECK(rtree.k_nearest_batch(points.data(), queries.size(), allValues, batch, 12.f) == withinTotal);
+	CHECK(batch.values.size() == withinTotal);
+
+	CHECK(rtree.k_nearest_batch(points.data(), 0, 8, batch) == 0);
+	CHECK(batch.size() == 0);
+}
+
+TEST_CASE("within distance query")
+{
+	struct Box3 {
+		float min[3], max[3];
+		int id;
+	};
+
+	std::vector<Box3> boxes(2000);
+	uint32_t seed = 777;
+	auto next = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (float)((seed >> 8) % 1000);
+	};
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		Box3& box = boxes[i];
+		for (int axis = 0; axis < 3; ++axis) {
+			box.min[axis] = next();
+			box.max[axis] = box.min[axis] + next() / 100;
+		}
+		box.id = (int)i;
+	}
+
+	spatial::RTree<float, Box3, 3, 8> rtree(boxes.begin(), boxes.end());
+	auto squareDistance3 = [](const float point[3], const Box3& box) {
+		float distance = 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			const float d = std::max(std::max(box.min[axis] - point[axis], 0.f), point[axis] - box.max[axis]);
+			distance += d * d;
+		}
+		return distance;
+	};
+
+	size_t mismatches = 0;
+	for (int q = 0; q < 20; ++q) {
+		const float point[3] = { next(), next(), next() };
+		const float radius = 20.f + q * 5;
+
+		std::vector<int> expected;
+		for (const Box3& box : boxes) {
+			if (squareDistance3(point, box) <= radius * radius)
+				expected.push_back(box.id);
+		}
+
+		std::vector<Box3> results;
+		CHECK(rtree.within_distance(point, radius, std::back_inserter(results)) == expected.size());
+		std::vector<int> ids;
+		for (const Box3& box : results)
+			ids.push_back(box.id);
+		std::sort(ids.begin(), ids.end());
+		mismatches += ids != expected;
+
+		results.clear();
+		rtree.within_distance(point, radius, std::back_inserter(results), true);
+		mismatches += results.size() != expected.size();
+		for (size_t i = 1; i < results.size(); ++i)
+			mismatches += squareDistance3(point, results[i - 1]) > squareDistance3(point, results[i]);
+	}
+	CHECK(mismatches == 0);
+
+	std::vector<Box3> results;
+	CHECK(rtree.within_distance(boxes[0].min, 0.f, std::back_inserter(results)) >= 1);
+	CHECK(rtree.within_distance(boxes[0].min, -1.f, std::back_inserter(results)) == 0);
+}
+
+TEST_CASE("closest hit ray cast")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> origins = generateBoxes(50, 1000, 1);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	// only the odd values are hit, at the ray's entry into their box
+	auto oddHit = [](size_t value, float boxDistance) {
+		return value % 2 ? boxDistance : -1.f;
+	};
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < origins.size(); ++i) {
+		const float origin[2] = { (float)origins[i].min[0], (float)origins[i].min[1] };
+		const float direction[2] = { (float)(i % 7) - 3.f, (float)(i % 5) - 2.f + 0.5f };
+		const tree_t::ray_type ray(origin, direction);
+
+		// brute force distances
+		std::vector<float> expected, expectedOdd;
+		for (size_t value = 0; value < values.size(); ++value) {
+			spatial::BoundingBox<int, 2> bbox(values[value].min, values[value].max);
+			float t;
+			if (ray.intersects(bbox, std::numeric_limits<float>::max(), t)) {
+				expected.push_back(t);
+				if (value % 2)
+					expectedOdd.push_back(t);
+			}
+		}
+		std::sort(expected.begin(), expected.end());
+		std::sort(expectedOdd.begin(), expectedOdd.end());
+
+		size_t value;
+		float distance;
+		const bool found = rtree.rayCast(ray, value, distance);
+		mismatches += found != !expected.empty();
+		if (found)
+			mismatches += distance != expected[0];
+
+		const bool foundOdd = rtree.rayCast(ray, value, distance, oddHit);
+		mismatches += foundOdd != !expectedOdd.empty();
+		if (foundOdd)
+			mismatches += distance != expectedOdd[0] || value % 2 == 0;
+
+		std::vector<size_t> hits;
+		rtree.rayCastHits(ray, 5, std::back_inserter(hits));
+		mismatches += hits.size() != std::min<size_t>(5, expected.size());
+		for (size_t h = 0; h < hits.size(); ++h) {
+			spatial::BoundingBox<int, 2> bbox(values[hits[h]].min, values[hits[h]].max);
+			float t;
+			if (ray.intersects(bbox, std::numeric_limits<float>::max(), t))
+				mismatches += t != expected[h];
+			else
+				++mismatches;
+		}
+
+		// limited range
+		if (expected.size() > 1 && expected[0] < expected[1]) {
+			hits.clear();
+			rtree.rayCastHits(ray, 5, std::back_inserter(hits), spatial::detail::BoxHit(), expected[0]);
+			mismatches += hits.size() != 1;
+		}
+	}
+	CHECK(mismatches == 0);
+}
+
+TEST_CASE("ray packet query")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	// coherent rays from the same region
+	tree_t::ray_packet_type packet;
+	std::vector<tree_t::ray_type> rays;
+	for (int i = 0; i < 16; ++i) {
+		const float origin[2] = { 500.f + i, 480.f - i };
+		const float direction[2] = { 1.f + 0.1f * i, 0.5f - 0.07f * i };
+		CHECK(packet.add(origin, direction, i < 8 ? 300.f : 1000.f));
+		rays.push_back(tree_t::ray_type(origin, direction));
+	}
+	CHECK(!packet.add(rays[0].origin, rays[0].direction));
+
+	spatial::BatchResults<size_t> results;
+	const size_t total = rtree.rayPacketQuery(packet, results);
+	REQUIRE(results.size() == 16);
+	CHECK(total == results.values.size());
+
+	size_t mismatches = 0, hitCount = 0;
+	for (int i = 0; i < 16; ++i) {
+		std::vector<size_t> expected;
+		for (size_t value = 0; value < values.size(); ++value) {
+			spatial::BoundingBox<int, 2> bbox(values[value].min, values[value].max);
+			float t;
+			if (rays[i].intersects(bbox, i < 8 ? 300.f : 1000.f, t))
+				expected.push_back(value);
+		}
+		std::vector<size_t> hits(results.begin(i), results.end(i));
+		std::sort(hits.begin(), hits.end());
+		mismatches += hits != expected;
+		hitCount += hits.size();
+
+		// same order as a single ray
+		tree_t::ray_packet_type single;
+		single.add(rays[i].origin, rays[i].direction, i < 8 ? 300.f : 1000.f);
+		spatial::BatchResults<size_t> singleResults;
+		rtree.rayPacketQuery(single, singleResults);
+		mismatches += !std::equal(singleResults.values.begin(), singleResults.values.end(), results.begin(i)) ||
+			singleResults.values.size() != results.count(i);
+	}
+	CHECK(mismatches == 0);
+	CHECK(hitCount > 16);
+
+	// the rays start inside or past some boxes, rayQuery also returns the
+	// boxes behind the origins
+	tree_t::ray_packet_type crossing;
+	std::vector<tree_t::ray_type> crossingRays;
+	for (int i = 0; i < 16; ++i) {
+		const Box2<int>& box = values[i * 100];
+		const float origin[2] = { (box.min[0] + box.max[0]) * 0.5f, (box.min[1] + box.max[1]) * 0.5f };
+		const float direction[2] = { i % 2 ? -1.f : 1.f, 0.3f - 0.05f * i };
+		crossing.add(origin, direction, i < 8 ? 200.f : std::numeric_limits<float>::max());
+		crossingRays.push_back(tree_t::ray_type(origin, direction));
+	}
+	rtree.rayPacketQuery(crossing, results);
+	mismatches = 0;
+	size_t behind = 0;
+	for (int i = 0; i < 16; ++i) {
+		const float tMax = i < 8 ? 200.f : std::numeric_limits<float>::max();
+		std::vector<size_t> lineHits, expected;
+		rtree.rayQuery(crossingRays[i].origin, crossingRays[i].direction, std::back_inserter(lineHits));
+		for (size_t value : lineHits) {
+			spatial::BoundingBox<int, 2> bbox(values[value].min, values[value].max);
+			float t;
+			if (crossingRays[i].intersects(bbox, tMax, t))
+				expected.push_back(value);
+		}
+		behind += lineHits.size() - expected.size();
+		CHECK(std::find(expected.begin(), expected.end(), (size_t)i * 100) != expected.end());
+		mismatches += !std::equal(expected.begin(), expected.end(), results.begin(i)) ||
+			results.count(i) != expected.size();
+	}
+	CHECK(mismatches == 0);
+	CHECK(behind > 0);
+
+	size_t visited = 0;
+	rtree.rayPacketQuery(packet, [&visited](uint32_t ray, size_t) { visited += ray < 16; });
+	CHECK(visited == total);
+	CHECK(rtree.rayPacketQuery(tree_t::ray_packet_type(), results) == 0);
+	CHECK(results.size() == 0);
+}
+
+TEST_CASE("frustum query")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+	typedef spatial::Frustum<float, 2, 4> frustum_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	// diamond centered at (500, 500)
+	frustum_t frustum;
+	const float normals[4][2] = { { 1, 1 }, { -1, 1 }, { 1, -1 }, { -1, -1 } };
+	for (const auto& normal : normals)
+		CHECK(frustum.addPlane(normal, 300.f - 500.f * (normal[0] + normal[1])));
+	CHECK(!frustum.addPlane(normals[0], 0.f));
+
+	auto classify = [&frustum](const spatial::BoundingBox<int, 2>& bbox) {
+		uint32_t mask = frustum.planeMask();
+		return frustum.classify(bbox, mask);
+	};
+
+	std::vector<size_t> expected;
+	for (size_t value = 0; value < values.size(); ++value) {
+		if (classify(spatial::BoundingBox<int, 2>(values[value].min, values[value].max)) != frustum_t::eOutside)
+			expected.push_back(value);
+	}
+	CHECK(!expected.empty());
+
+	std::vector<size_t> results;
+	CHECK(rtree.query(frustum, std::back_inserter(results)) == expected.size());
+	std::sort(results.begin(), results.end());
+	CHECK(results == expected);
+
+	// hierarchical values on the branch nodes
+	std::map<size_t, spatial::BoundingBox<int, 2>> branches;
+	size_t branchValue = values.size();
+	for (auto it = rtree.dbegin(); it.valid(); it.next()) {
+		*it = branchValue;
+		branches[branchValue++] = it.bbox();
+	}
+
+	std::vector<size_t> hierarchical;
+	rtree.hierachical_query(frustum, std::back_inserter(hierarchical));
+	size_t mismatches = 0, branchCount = 0;
+	std::set<size_t> leaves;
+	for (size_t value : hierarchical) {
+		if (value >= values.size()) {
+			++branchCount;
+			mismatches += classify(branches[value]) != frustum_t::eInside;
+		}
+		else
+			leaves.insert(value);
+	}
+	CHECK(branchCount > 0);
+	// the values not returned as leaves are inside the returned branches
+	for (size_t value : expected) {
+		if (!leaves.count(value))
+			mismatches += classify(spatial::BoundingBox<int, 2>(values[value].min, values[value].max)) != frustum_t::eInside;
+	}
+	for (size_t value : leaves)
+		mismatches += !std::binary_search(expected.begin(), expected.end(), value);
+	CHECK(mismatches == 0);
+	CHECK(hierarchical.size() < expected.size());
+}
+
+TEST_CASE("spatial join")
+{
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable> tree_t;
+	// another value type and a different height
+	typedef spatial::RTree<int, Box2<int>, 2, 4> other_tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(2000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> others = generateBoxes(700, 1200, 60);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	other_tree_t otherTree(others.begin(), others.end());
+	REQUIRE(rtree.levels() != otherTree.levels());
+
+	std::vector<std::pair<size_t, size_t>> expected;
+	for (size_t i = 0; i < values.size(); ++i) {
+		const spatial::BoundingBox<int, 2> bbox(values[i].min, values[i].max);
+		for (size_t j = 0; j < others.size(); ++j) {
+			if (bbox.overlaps(spatial::BoundingBox<int, 2>(others[j].min, others[j].max)))
+				expected.push_back(std::make_pair(i, j));
+		}
+	}
+	CHECK(!expected.empty());
+
+	// the boxes of the others are unique, map them back to their index
+	auto otherIndex = [&others](const Box2<int>& box) {
+		return size_t(std::find(others.begin(), others.end(), box) - others.begin());
+	};
+
+	std::vector<std::pair<size_t, Box2<int>>> pairs;
+	CHECK(rtree.join(otherTree, std::back_inserter(pairs)) == expected.size());
+	std::vector<std::pair<size_t, size_t>> results;
+	for (const auto& pair : pairs)
+		results.push_back(std::make_pair(pair.first, otherIndex(pair.second)));
+	std::sort(results.begin(), results.end());
+	CHECK(results == expected);
+
+	// the other way around
+	size_t count = 0;
+	CHECK(otherTree.join_visit(rtree, [&count](const Box2<int>&, size_t) { ++count; }) == expected.size());
+	CHECK(count == expected.size());
+
+	tree_t empty(indexable);
+	std::vector<std::pair<size_t, size_t>> selfPairs;
+	CHECK(rtree.join(empty, std::back_inserter(selfPairs)) == 0);
+	CHECK(empty.join(otherTree, std::back_inserter(pairs)) == 0);
+}
+
+TEST_CASE("overlapping pairs")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(2000, 1000, 40);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	std::vector<std::pair<size_t, size_t>> expected;
+	for (size_t i = 0; i < values.size(); ++i) {
+		const spatial::BoundingBox<int, 2> bbox(values[i].min, values[i].max);
+		for (size_t j = i + 1; j < values.size(); ++j) {
+			if (bbox.overlaps(spatial::BoundingBox<int, 2>(values[j].min, values[j].max)))
+				expected.push_back(std::make_pair(i, j));
+		}
+	}
+	CHECK(!expected.empty());
+
+	auto normalize = [](std::vector<std::pair<size_t, size_t>>& pairs) {
+		for (auto& pair : pairs) {
+			if (pair.first > pair.second)
+				std::swap(pair.first, pair.second);
+		}
+		std::sort(pairs.begin(), pairs.end());
+	};
+
+	std::vector<std::pair<size_t, size_t>> pairs;
+	CHECK(rtree.overlapping_pairs([&pairs](size_t a, size_t b) { pairs.push_back(std::make_pair(a, b)); }) ==
+		expected.size());
+	normalize(pairs);
+	CHECK(pairs == expected);
+
+	// more threads split the tasks below the children of the root
+	for (unsigned threadCount : { 1u, 3u, 0u, 16u }) {
+		pairs.clear();
+		CHECK(rtree.overlapping_pairs(pairs, threadCount) == expected.size());
+		normalize(pairs);
+		CHECK(pairs == expected);
+	}
+}
+
+TEST_CASE("visitor query")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(1000, 1000, 40);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	const int searchMin[] = { 100, 100 };
+	const int searchMax[] = { 600, 600 };
+	std::vector<size_t> expected;
+	rtree.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(expected));
+	REQUIRE(expected.size() > 10);
+
+	// visits the same values in the same order
+	std::vector<size_t> visited;
+	CHECK(rtree.visit(spatial::intersects<2>(searchMin, searchMax),
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return true;
+		}));
+	CHECK(visited == expected);
+
+	// stops after the first ones
+	visited.clear();
+	CHECK(!rtree.visit(spatial::intersects<2>(searchMin, searchMax),
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return visited.size() < 10;
+		}));
+	CHECK(visited == std::vector<size_t>(expected.begin(), expected.begin() + 10));
+
+	CHECK(rtree.query(spatial::intersects<2>(searchMin, searchMax)));
+	const int emptyMin[] = { -100, -100 };
+	const int emptyMax[] = { -50, -50 };
+	CHECK(!rtree.query(spatial::intersects<2>(emptyMin, emptyMax)));
+
+	// skipping the subtrees which aren't fully inside leaves only the contained values
+	const spatial::BoundingBox<int, 2> searchBox(searchMin, searchMax);
+	visited.clear();
+	int nodeCount = 0;
+	CHECK(rtree.visit(spatial::intersects<2>(searchMin, searchMax),
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return true;
+		},
+		[&searchBox, &nodeCount](const spatial::BoundingBox<int, 2>& bbox, int level) {
+			CHECK(level >= 0);
+			++nodeCount;
+			return searchBox.contains(bbox) ? spatial::eVisitContinue : spatial::eVisitSkip;
+		}));
+	CHECK(nodeCount > 0);
+	CHECK(visited.size() < expected.size());
+	for (size_t value : visited)
+		CHECK(searchBox.contains(spatial::BoundingBox<int, 2>(values[value].min, values[value].max)));
+
+	// stops at the first node
+	nodeCount = 0;
+	CHECK(!rtree.visit(spatial::intersects<2>(searchMin, searchMax),
+		[](size_t, const spatial::BoundingBox<int, 2>&) { return true; },
+		[&nodeCount](const spatial::BoundingBox<int, 2>&, int) {
+			++nodeCount;
+			return spatial::eVisitStop;
+		}));
+	CHECK(nodeCount == 1);
+
+	// ray visit matches the ray query
+	const float rayOrigin[] = { 0.5f, 300.5f };
+	const float rayDirection[] = { 1, 0.25f };
+	std::vector<size_t> hits;
+	rtree.rayQuery(rayOrigin, rayDirection, std::back_inserter(hits));
+	REQUIRE(hits.size() > 2);
+	visited.clear();
+	CHECK(rtree.rayVisit(rayOrigin, rayDirection,
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return true;
+		}));
+	CHECK(visited == hits);
+	visited.clear();
+	CHECK(!rtree.rayVisit(rayOrigin, rayDirection,
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return false;
+		}));
+	CHECK(visited.size() == 1);
+	CHECK(visited[0] == hits[0]);
+}
+
+TEST_CASE("lazy query iterator")
+{
+	typedef spatial::detail::CompactNode<size_t, spatial::BoundingBox<int, 2>, 16> compact_node_t;
+	typedef spatial::RTree<int, size_t, 2, 16, 6, VectorIndexable, spatial::box::eNormalVolume,
+		float, spatial::allocator<compact_node_t>> compact_tree_t;
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(2000, 1000, 40);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	compact_tree_t compactTree(indices.begin(), indices.end(), indexable);
+
+	const int searchMin[] = { 200, 300 };
+	const int searchMax[] = { 500, 450 };
+	const auto predicate = spatial::intersects<2>(searchMin, searchMax);
+	std::vector<size_t> expected;
+	rtree.query(predicate, std::back_inserter(expected));
+	REQUIRE(expected.size() > 10);
+
+	// same values in the same order
+	std::vector<size_t> found;
+	for (auto it = rtree.qbegin(predicate); it.valid(); it.next()) {
+		CHECK(predicate(it.bbox()));
+		found.push_back(*it);
+	}
+	CHECK(found == expected);
+	CHECK(std::vector<size_t>(rtree.qbegin(predicate), rtree.qend(predicate)) == expected);
+	CHECK(std::distance(rtree.qbegin(predicate), rtree.qend(predicate)) == (ptrdiff_t)expected.size());
+
+	// stops early
+	auto it = rtree.qbegin(predicate);
+	for (int i = 0; i < 5; ++i)
+		++it;
+	CHECK(it != rtree.qend(predicate));
+	CHECK(*it == expected[5]);
+	CHECK(*it++ == expected[5]);
+	CHECK(*it == expected[6]);
+
+	// contains predicate on the compact nodes
+	const auto containsPredicate = spatial::contains<2>(searchMin, searchMax);
+	expected.clear();
+	compactTree.query(containsPredicate, std::back_inserter(expected));
+	REQUIRE(!expected.empty());
+	CHECK(std::vector<size_t>(compactTree.qbegin(containsPredicate), compactTree.qend(containsPredicate)) ==
+		expected);
+
+	const int emptyMin[] = { -100, -100 };
+	const int emptyMax[] = { -50, -50 };
+	const auto emptyPredicate = spatial::intersects<2>(emptyMin, emptyMax);
+	CHECK(!rtree.qbegin(emptyPredicate).valid());
+	CHECK(rtree.qbegin(emptyPredicate) == rtree.qend(emptyPredicate));
+
+	tree_t emptyTree(indexable);
+	CHECK(!emptyTree.qbegin(predicate).valid());
+
+	// deeper than the fixed size stack of the other iterators
+	typedef spatial::RTree<int, size_t, 2, 2, 1, VectorIndexable> deep_tree_t;
+	deep_tree_t deepTree(indexable);
+	deepTree.insert(indices.begin(), indices.end());
+	REQUIRE(deepTree.levels() > 16);
+	const int allMin[] = { -100, -100 };
+	const int allMax[] = { 2000, 2000 };
+	const auto allPredicate = spatial::intersects<2>(allMin, allMax);
+	expected.clear();
+	deepTree.query(allPredicate, std::back_inserter(expected));
+	CHECK(expected.size() == values.size());
+	CHECK(std::vector<size_t>(deepTree.qbegin(allPredicate), deepTree.qend(allPredicate)) == expected);
+}
+
+TEST_CASE("explicit stack traversal")
+{
+	// a deep tree with the smallest nodes
+	typedef spatial::RTree<int, size_t, 2, 3, 1, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(5000, 1000, 20);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	CHECK(rtree.levels() > 8);
+	CHECK(rtree.count() == values.size());
+
+	// visits the leaves from left to right
+	const int allMin[] = { -100, -100 };
+	const int allMax[] = { 2000, 2000 };
+	std::vector<size_t> leaves;
+	for (tree_t::leaf_iterator it = rtree.lbegin(); it.valid(); it.next())
+		leaves.push_back(*it);
+	std::vector<size_t> results;
+	CHECK(rtree.query(spatial::intersects<2>(allMin, allMax), std::back_inserter(results)) ==
+		values.size());
+	CHECK(results == leaves);
+
+	// the output iterator is advanced across the nodes
+	const int searchMin[] = { 200, 200 };
+	const int searchMax[] = { 400, 500 };
+	results.clear();
+	const size_t found = rtree.query(spatial::intersects<2>(searchMin, searchMax),
+		std::back_inserter(results));
+	REQUIRE(found > 10);
+	std::vector<size_t> buffer(found);
+	CHECK(rtree.query(spatial::intersects<2>(searchMin, searchMax), buffer.data()) == found);
+	CHECK(buffer == results);
+
+	const int point[] = { 500, 500 };
+	results.clear();
+	const size_t nearestCount = rtree.nearest(point, 50, std::back_inserter(results));
+	REQUIRE(nearestCount > 1);
+	buffer.assign(nearestCount, 0);
+	CHECK(rtree.nearest(point, 50, buffer.data()) == nearestCount);
+	CHECK(buffer == results);
+
+	// the visitor and distance traversals
+	std::vector<size_t> visited;
+	CHECK(rtree.visit(spatial::intersects<2>(searchMin, searchMax),
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return true;
+		}));
+	results.clear();
+	rtree.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(results));
+	CHECK(visited == results);
+
+	const float origin[] = { 0.f, 10.f };
+	const float direction[] = { 1.f, 0.8f };
+	visited.clear();
+	CHECK(rtree.rayVisit(origin, direction,
+		[&visited](size_t value, const spatial::BoundingBox<int, 2>&) {
+			visited.push_back(value);
+			return true;
+		}));
+	results.clear();
+	rtree.rayQuery(origin, direction, std::back_inserter(results));
+	REQUIRE(results.size() > 1);
+	CHECK(visited == results);
+
+	const tree_t::ray_type ray(origin, direction);
+	float closest = std::numeric_limits<float>::max();
+	for (const auto& box : values) {
+		float t;
+		if (ray.intersects(spatial::BoundingBox<int, 2>(box.min, box.max), closest, t))
+			closest = std::min(closest, t);
+	}
+	size_t hitValue;
+	float hitDistance;
+	REQUIRE(rtree.rayCast(ray, hitValue, hitDistance));
+	CHECK(hitDistance == closest);
+
+	results.clear();
+	const size_t withinCount = rtree.within_distance(point, 60.f, std::back_inserter(results));
+	REQUIRE(withinCount > 1);
+	buffer.assign(withinCount, 0);
+	CHECK(rtree.within_distance(point, 60.f, buffer.data()) == withinCount);
+	CHECK(buffer == results);
+
+	// copy and translate
+	tree_t copy(rtree);
+	CHECK(copy.count() == rtree.count());
+	results.clear();
+	copy.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(results));
+	std::vector<size_t> expected;
+	rtree.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(expected));
+	CHECK(results == expected);
+
+	const int offset[] = { 10, -20 };
+	copy.translate(offset);
+	const int translatedMin[] = { searchMin[0] + offset[0], searchMin[1] + offset[1] };
+	const int translatedMax[] = { searchMax[0] + offset[0], searchMax[1] + offset[1] };
+	results.clear();
+	copy.query(spatial::intersects<2>(translatedMin, translatedMax), std::back_inserter(results));
+	CHECK(results == expected);
+
+	copy.clear();
+	CHECK(copy.count() == 0);
+	CHECK(rtree.count() == values.size());
+}
+
+#if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
+TEST_CASE("persistent snapshots")
+{
+	typedef spatial::detail::Node<size_t, spatial::BoundingBox<int, 2>, 8> node_t;
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable, spatial::box::eNormalVolume,
+		float, test::counting_allocator<node_t>, spatial::rtree::rstar> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000, 1000, 30);
+	VectorIndexable indexable(values);
+	const int allMin[] = { -100, -100 };
+	const int allMax[] = { 2000, 2000 };
+	auto sortedValues = [&](const tree_t& tree) {
+		std::vector<size_t> results;
+		tree.query(spatial::intersects<2>(allMin, allMax), std::back_inserter(results));
+		std::sort(results.begin(), results.end());
+		return results;
+	};
+	auto range = [](size_t first, size_t last) {
+		std::vector<size_t> indices(last - first);
+		std::iota(indices.begin(), indices.end(), first);
+		return indices;
+	};
+
+	long live = 0;
+	{
+		tree_t rtree(indexable, test::counting_allocator<node_t>(&live));
+		// same updates without the copy on write
+		tree_t reference(indexable, test::counting_allocator<node_t>());
+		for (size_t i = 0; i < 1000; ++i) {
+			rtree.insert(i);
+			reference.insert(i);
+		}
+		CHECK(!rtree.snapshot());
+
+		tree_t::snapshot_type first = rtree.publish();
+		CHECK(rtree.snapshot() == first);
+		const long publishedNodes = live;
+
+		// the snapshot is left untouched by the updates
+		for (size_t i = 1000; i < 1500; ++i) {
+			rtree.insert(i);
+			reference.insert(i);
+		}
+		for (size_t i = 0; i < 300; ++i) {
+			CHECK(rtree.remove(i));
+			reference.remove(i);
+		}
+		CHECK(!rtree.remove(0));
+		CHECK(first->count() == 1000);
+		CHECK(sortedValues(*first) == range(0, 1000));
+		CHECK(rtree.count() == 1200);
+		CHECK(sortedValues(rtree) == range(300, 1500));
+
+		const int searchMin[] = { 100, 200 };
+		const int searchMax[] = { 400, 500 };
+		std::vector<size_t> results, expected;
+		rtree.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(results));
+		reference.query(spatial::intersects<2>(searchMin, searchMax), std::back_inserter(expected));
+		CHECK(results == expected);
+
+		// the replaced nodes are kept for the first snapshot
+		tree_t::snapshot_type second = rtree.publish();
+		CHECK(live > publishedNodes);
+		CHECK(sortedValues(*second) == range(300, 1500));
+		CHECK(sortedValues(*first) == range(0, 1000));
+
+		// a rejected conditional insert copies nothing
+		const long beforeRejected = live;
+		CHECK(!rtree.insert(1500, [](const tree_t::bbox_type&) { return false; }));
+		CHECK(live == beforeRejected);
+
+		// a small update copies only a path
+		const long beforeUpdate = live;
+		rtree.insert(1500);
+		CHECK(live - beforeUpdate <= (long)rtree.levels() + 2);
+
+		first.reset();
+		rtree.publish();
+		const long afterReclaim = live;
+		CHECK(afterReclaim < beforeUpdate + (long)rtree.levels() + 2);
+
+		// translate and clear copy or keep the published nodes too
+		rtree.translate(allMin);
+		CHECK(sortedValues(*second) == range(300, 1500));
+		rtree.clear();
+		CHECK(rtree.count() == 0);
+		CHECK(sortedValues(*second) == range(300, 1500));
+
+		// the bulk loaded and assigned nodes aren't published, a remove copies
+		// nothing
+		const std::vector<size_t> loaded = range(0, 1000);
+		rtree.publish();
+		rtree.bulk_load(loaded.begin(), loaded.end());
+		long beforeRemove = live;
+		CHECK(rtree.remove(10));
+		CHECK(live == beforeRemove);
+		{
+			tree_t other(indexable, test::counting_allocator<node_t>(&live));
+			other.insert(loaded.begin(), loaded.end());
+			rtree.publish();
+			rtree = other;
+		}
+		beforeRemove = live;
+		CHECK(rtree.remove(20));
+		CHECK(live == beforeRemove);
+		CHECK(sortedValues(*second) == range(300, 1500));
+		rtree.clear();
+
+		// the snapshots may outlive the tree
+		tree_t::snapshot_type last = rtree.publish();
+		rtree.insert(7);
+		CHECK(sortedValues(*second) == range(300, 1500));
+		second.reset();
+		{
+			tree_t other(indexable, test::counting_allocator<node_t>(&live));
+			other.swap(rtree);
+			other.insert(8);
+			CHECK(last->count() == 0);
+			CHECK(other.publish()->count() == 2);
+		}
+		CHECK(live > 0);
+		last.reset();
+	}
+	CHECK(live == 0);
+
+	SUBCASE("concurrent readers")
+	{
+		tree_t rtree(indexable, test::counting_allocator<node_t>());
+		for (size_t i = 0; i < 500; ++i)
+			rtree.insert(i);
+		rtree.publish();
+
+		// the writer keeps a sliding window of values, each snapshot must hold
+		// a contiguous range of them
+		std::atomic<bool> done(false);
+		std::atomic<size_t> errors(0), reads(0);
+		std::vector<std::thread> readers;
+		for (int thread = 0; thread < 3; ++thread) {
+			readers.emplace_back([&]() {
+				while (!done) {
+					const tree_t::snapshot_type snapshot = rtree.snapshot();
+					std::vector<size_t> results;
+					snapshot->query(spatial::intersects<2>(allMin, allMax), std::back_inserter(results));
+					std::sort(results.begin(), results.end());
+					if (results.size() != snapshot->count() || results.empty() ||
+						results.back() - results.front() + 1 != results.size())
+						++errors;
+					++reads;
+				}
+			});
+		}
+
+		for (size_t i = 500; i < values.size(); ++i) {
+			rtree.insert(i);
+			rtree.remove(i - 500);
+			if (i % 16 == 0)
+				rtree.publish();
+		}
+		done = true;
+		for (auto& reader : readers)
+			reader.join();
+		CHECK(errors == 0);
+		CHECK(reads > 0);
+		CHECK(sortedValues(*rtree.publish()) == range(values.size() - 500, values.size()));
+	}
+}
+#endif
+
+TEST_CASE("concurrent rtree")
+{
+	typedef spatial::ConcurrentRTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> reference_t;
+
+	const size_t kThreads = 4;
+	const size_t kPerThread = 5000;
+	const std::vector<Box2<int>> values = generateBoxes(kThreads * kPerThread, 1000, 30);
+	VectorIndexable indexable(values);
+	const int allMin[] = { -100, -100 };
+	const int allMax[] = { 2000, 2000 };
+
+	tree_t rtree(indexable);
+	// number of values inserted by each thread so far
+	std::atomic<size_t> inserted[kThreads];
+	for (size_t thread = 0; thread < kThreads; ++thread)
+		inserted[thread] = 0;
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0);
+
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < kThreads; ++thread) {
+		threads.emplace_back([&, thread]() {
+			for (size_t i = 0; i < kPerThread; ++i) {
+				rtree.insert(thread * kPerThread + i);
+				inserted[thread].store(i + 1);
+			}
+		});
+	}
+	for (int reader = 0; reader < 2; ++reader) {
+		threads.emplace_back([&]() {
+			while (!done) {
+				// the values inserted before the query must be found, once
+				size_t before[kThreads];
+				for (size_t thread = 0; thread < kThreads; ++thread)
+					before[thread] = inserted[thread].load();
+
+				std::vector<size_t> results;
+				rtree.query(spatial::intersects<2>(allMin, allMax), std::back_inserter(results));
+				std::sort(results.begin(), results.end());
+				if (std::adjacent_find(results.begin(), results.end()) != results.end())
+					++errors;
+				for (size_t thread = 0; thread < kThreads; ++thread) {
+					for (size_t i = 0; i < before[thread]; i += 97) {
+						if (!std::binary_search(results.begin(), results.end(), thread * kPerThread + i))
+							++errors;
+					}
+				}
+			}
+		});
+	}
+	for (size_t thread = 0; thread < kThreads; ++thread)
+		threads[thread].join();
+	done = true;
+	for (size_t thread = kThreads; thread < threads.size(); ++thread)
+		threads[thread].join();
+
+	CHECK(errors == 0);
+	CHECK(rtree.count() == values.size());
+	CHECK(rtree.levels() > 2);
+
+	reference_t reference(indexable);
+	for (size_t i = 0; i < values.size(); ++i)
+		reference.insert(i);
+
+	const std::vector<Box2<int>> searches = generateBoxes(50, 1000, 200);
+	for (const Box2<int>& search : searches) {
+		std::vector<size_t> results, expected;
+		rtree.query(spatial::intersects<2>(search.min, search.max), std::back_inserter(results));
+		reference.query(spatial::intersects<2>(search.min, search.max), std::back_inserter(expected));
+		std::sort(results.begin(), results.end());
+		std::sort(expected.begin(), expected.end());
+		CHECK(results == expected);
+	}
+}
+
+TEST_CASE("sharded rtree")
+{
+	typedef spatial::ShardedRTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> reference_t;
+
+	// large boxes, many of them span several shards
+	const std::vector<Box2<int>> values = generateBoxes(8000, 1000, 80);
+	VectorIndexable indexable(values);
+	const int worldMin[] = { 0, 0 };
+	const int worldMax[] = { 1000, 1000 };
+	const tree_t::bbox_type world(worldMin, worldMax);
+
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	std::vector<size_t> sample;
+	for (size_t i = 0; i < values.size(); i += 10)
+		sample.push_back(i);
+
+	tree_t sharded(world, 7, sample.begin(), sample.end(), indexable, 3);
+	CHECK(sharded.shardCount() == 7);
+	// the bulk insert fills the shards in parallel
+	sharded.insert(indices.begin(), indices.begin() + 4000);
+	// the single inserts from several threads
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < 4; ++thread) {
+		threads.emplace_back([&, thread]() {
+			for (size_t i = 4000 + thread; i < values.size(); i += 4)
+				sharded.insert(i);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	reference_t reference(indexable);
+	for (size_t i = 0; i < values.size(); ++i)
+		reference.insert(i);
+	CHECK(sharded.count() == values.size());
+
+	// the values are owned by the shard of their center, the sample balances them
+	for (unsigned index = 0; index < sharded.shardCount(); ++index) {
+		const tree_t::tree_type& shard = sharded.shard(index);
+		CHECK(shard.count() > values.size() / 7 / 2);
+		const int allMin[] = { -100, -100 };
+		const int allMax[] = { 2000, 2000 };
+		std::vector<size_t> owned;
+		shard.query(spatial::intersects<2>(allMin, allMax), std::back_inserter(owned));
+		for (size_t value : owned) {
+			int center[2];
+			tree_t::bbox_type(values[value].min, values[value].max).center(center);
+			// the centers outside the world go to the nearest cell
+			if (world.contains(center))
+				CHECK(sharded.cell(index).contains(center));
+			CHECK(sharded.shardIndex(value) == index);
+		}
+	}
+
+	auto checkQueries = [&]() {
+		const std::vector<Box2<int>> searches = generateBoxes(40, 1000, 300);
+		for (const Box2<int>& search : searches) {
+			std::vector<size_t> results, expected;
+			const size_t found = sharded.query(spatial::intersects<2>(search.min, search.max), std::back_inserter(results));
+			reference.query(spatial::intersects<2>(search.min, search.max), std::back_inserter(expected));
+			CHECK(found == results.size());
+			std::sort(results.begin(), results.end());
+			std::sort(expected.begin(), expected.end());
+			CHECK(results == expected);
+		}
+	};
+	checkQueries();
+
+	for (size_t i = 0; i < values.size(); i += 3) {
+		CHECK(sharded.remove(i));
+		reference.remove(i);
+	}
+	CHECK(!sharded.remove(0));
+	CHECK(sharded.count() == reference.count());
+	checkQueries();
+
+	// evenly split, without a sample
+	tree_t even(world, 4, indexable, 1);
+	even.insert(indices.begin(), indices.end());
+	CHECK(even.count() == values.size());
+	for (unsigned index = 0; index < even.shardCount(); ++index)
+		CHECK(even.cell(index).max[0] - even.cell(index).min[0] == 500);
+	even.clear();
+	CHECK(even.count() == 0);
+}
+
+TEST_CASE("parallel query")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(3000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	const std::vector<Box2<int>> queries = generateBoxes(500, 1000, 40);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+
+	// each row holds the same values in the same order as a single query
+	auto checkRows = [&](const spatial::BatchResults<size_t>& results, size_t total,
+		std::function<void(size_t, std::vector<size_t>&)> query) {
+		REQUIRE(results.size() == queries.size());
+		CHECK(results.values.size() == total);
+
+		size_t mismatches = 0;
+		std::vector<size_t> expected;
+		for (size_t i = 0; i < queries.size(); ++i) {
+			expected.clear();
+			query(i, expected);
+			mismatches += !std::equal(expected.begin(), expected.end(), results.begin(i)) ||
+				results.count(i) != expected.size();
+		}
+		CHECK(mismatches == 0);
+	};
+
+	typedef decltype(spatial::intersects<2>(queries[0].min, queries[0].max)) predicate_t;
+	std::vector<predicate_t> predicates;
+	for (const auto& query : queries)
+		predicates.push_back(spatial::intersects<2>(query.min, query.max));
+
+	spatial::BatchResults<size_t> results;
+	for (unsigned threadCount : { 1u, 3u, 0u }) {
+		CAPTURE(threadCount);
+
+		size_t total = rtree.parallel_query(predicates.data(), predicates.size(), results, threadCount);
+		CHECK(total > queries.size());
+		checkRows(results, total, [&](size_t i, std::vector<size_t>& expected) {
+			rtree.query(predicates[i], std::back_inserter(expected));
+		});
+
+		std::vector<float> origins, directions;
+		for (size_t i = 0; i < queries.size(); ++i) {
+			origins.insert(origins.end(), queries[i].min, queries[i].min + 2);
+			directions.push_back(std::cos(0.1f * i));
+			directions.push_back(std::sin(0.1f * i));
+		}
+		total = rtree.parallel_ray_query(origins.data(), directions.data(), queries.size(), results, threadCount);
+		CHECK(total > queries.size());
+		checkRows(results, total, [&](size_t i, std::vector<size_t>& expected) {
+			rtree.rayQuery(&origins[i * 2], &directions[i * 2], std::back_inserter(expected));
+		});
+
+		std::vector<int> points;
+		for (const auto& query : queries)
+			points.insert(points.end(), query.min, query.min + 2);
+		total = rtree.k_nearest_batch(points.data(), queries.size(), 8, results, -1.f, threadCount);
+		CHECK(total == queries.size() * 8);
+		checkRows(results, total, [&](size_t i, std::vector<size_t>& expected) {
+			rtree.k_nearest(&points[i * 2], 8, std::back_inserter(expected));
+		});
+	}
+
+	CHECK(rtree.parallel_query(predicates.data(), 0, results, 2) == 0);
+	CHECK(results.size() == 0);
+
+	SUBCASE("concurrent batches")
+	{
+		// records the threads running the queries of a batch
+		struct ThreadPredicate : predicate_t {
+			ThreadPredicate(const predicate_t& predicate, std::set<std::thread::id>& threads,
+				std::mutex& mutex)
+				: predicate_t(predicate), threads(&threads), mutex(&mutex) {}
+
+			bool operator()(const typename predicate_t::box_t& bbox) const {
+				std::lock_guard<std::mutex> lock(*mutex);
+				threads->insert(std::this_thread::get_id());
+				return predicate_t::operator()(bbox);
+			}
+
+			std::set<std::thread::id>* threads;
+			std::mutex* mutex;
+		};
+
+		std::vector<std::set<std::thread::id>> threadSets(2);
+		std::vector<std::mutex> mutexes(2);
+		std::vector<size_t> mismatches(2, 0);
+		std::atomic<unsigned> ready(0);
+		std::vector<std::thread> threads;
+		for (size_t caller = 0; caller < threadSets.size(); ++caller) {
+			threads.emplace_back([&, caller]() {
+				std::vector<ThreadPredicate> batch;
+				for (const auto& predicate : predicates)
+					batch.push_back(ThreadPredicate(predicate, threadSets[caller], mutexes[caller]));
+				spatial::BatchResults<size_t> batchResults;
+				std::vector<size_t> expected;
+
+				++ready;
+				while (ready < threadSets.size())
+					std::this_thread::yield();
+				// repeated so the workers get scheduled on a single core
+				for (int repeat = 0; repeat < 10; ++repeat) {
+					rtree.parallel_query(batch.data(), batch.size(), batchResults, 0);
+					for (size_t i = 0; i < predicates.size(); ++i) {
+						expected.clear();
+						rtree.query(predicates[i], std::back_inserter(expected));
+						mismatches[caller] += !std::equal(expected.begin(), expected.end(),
+							batchResults.begin(i)) || batchResults.count(i) != expected.size();
+					}
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+
+		for (size_t caller = 0; caller < threadSets.size(); ++caller) {
+			CAPTURE(caller);
+			CHECK(mismatches[caller] == 0);
+			CHECK(threadSets[caller].size() > 1);
+		}
+	}
+}
+
+TEST_CASE("parallel single query")
+{
+	typedef spatial::RTree<int, size_t, 2, 8, 3, VectorIndexable> tree_t;
+
+	const std::vector<Box2<int>> values = generateBoxes(5000);
+	std::vector<size_t> indices(values.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+	VectorIndexable indexable(values);
+	tree_t rtree(indexable);
+	rtree.insert(indices.begin(), indices.end());
+	REQUIRE(rtree.levels() > 2);
+
+	const int boxes[][4] = {
+		{ 0, 0, 1000, 1000 }, { 100, 200, 700, 600 }, { 480, 480, 520, 520 }, { 2000, 2000, 2100, 2100 } };
+	for (const auto& box : boxes) {
+		const int min[2] = { box[0], box[1] };
+		const int max[2] = { box[2], box[3] };
+		const auto predicate = spatial::intersects<2>(min, max);
+
+		std::vector<size_t> expected;
+		const size_t expectedCount = rtree.query(predicate, std::back_inserter(expected));
+		for (unsigned threadCount : { 1u, 2u, 3u, 0u }) {
+			CAPTURE(threadCount);
+			std::vector<size_t> results;
+			CHECK(rtree.parallel_query(predicate, std::back_inserter(results), threadCount) == expectedCount);
+			CHECK(results == expected);
+		}
+	}
+
+	SUBCASE("concurrent calls")
+	{
+		// the concurrent calls share the workers of the pool
+		const int min[2] = { 0, 0 };
+		const int max[2] = { 1000, 1000 };
+		const auto predicate = spatial::intersects<2>(min, max);
+		std::vector<size_t> expected;
+		rtree.query(predicate, std::back_inserter(expected));
+
+		std::vector<std::vector<size_t>> results(4);
+		std::vector<std::thread> threads;
+		for (size_t thread = 0; thread < results.size(); ++thread) {
+			threads.emplace_back([&, thread]() {
+				for (int repeat = 0; repeat < 10; ++repeat) {
+					results[thread].clear();
+					rtree.parallel_query(predicate, std::back_inserter(results[thread]), 3);
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+		for (const auto& result : results)
+			CHECK(result == expected);
+	}
+}
+
 #if SPATIAL_TREE_ALLOCATOR == SPATIAL_TREE_DEFAULT_ALLOCATOR
 TEST_CASE("Custom allocator test")
 {